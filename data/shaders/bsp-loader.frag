@@ -1,10 +1,16 @@
 #version 330 core
 
-out vec3 color;
+out vec4 color;
 
 // Interpolated values from the vertex shaders
-in vec3 fragmentColor;
+in vec2 fragmentTextureCoord;
+in vec2 fragmentLightmapCoord;
+
+uniform sampler2D texture_sampler;
+uniform sampler2D lightmap_sampler;
 
 void main(){
-	color = fragmentColor;
+	// The texture modulated by the lightmap, like GL_MODULATE on two units
+	color = texture(texture_sampler, fragmentTextureCoord) *
+	        texture(lightmap_sampler, fragmentLightmapCoord);
 }
@@ -1,17 +1,19 @@
 #version 330 core
 
+// The attribute locations the level's vertex arrays use
 layout(location = 0) in vec3 vertexPosition_modelspace;
-layout(location = 1) in vec3 vertexColor;
+layout(location = 1) in vec2 vertexTextureCoord;
+layout(location = 2) in vec2 vertexLightmapCoord;
 
 // Output data ; will be interpolated for each fragment.
-out vec3 fragmentColor;
+out vec2 fragmentTextureCoord;
+out vec2 fragmentLightmapCoord;
 
 uniform mat4 MVP;
 
 void main(){
 	gl_Position = MVP * vec4(vertexPosition_modelspace, 1);
 
-	// The color of each vertex will be interpolated
-	// to produce the color of each fragment
-	fragmentColor = vertexColor;
+	fragmentTextureCoord = vertexTextureCoord;
+	fragmentLightmapCoord = vertexLightmapCoord;
 }
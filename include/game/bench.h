@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+
+namespace game {
+// Named benchmarks that can be run from the command line with
+// `bsp-loader --bench <name> [args...]`
+class Bench {
+public:
+    using Function = std::function<int(const std::vector<std::string> &args)>;
+    struct Entry {
+        std::string name;
+        std::string usage;
+        Function run;
+    };
+
+    static int run(const std::string &name, const std::vector<std::string> &args);
+private:
+    static std::vector<Entry> _benches;
+};
+}
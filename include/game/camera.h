@@ -4,6 +4,8 @@
 
 #include <spdlog/spdlog.h>
 
+#include <game/config.h>
+
 namespace game {
 class Camera {
 private:
@@ -19,6 +21,8 @@ private:
 
     glm::tvec3<float> _velocity =  { 0.0f, 0.0f, 0.0f };
 
+    RenderBackend _render_backend = RenderBackend::Legacy;
+
 public:
     Camera();
 
@@ -38,5 +42,9 @@ public:
 
     float field_of_view() const { return _field_of_view; }
     void field_of_view(const float val) { _field_of_view = val; }
+
+    // Only the legacy backend gets the matrices loaded into OpenGL too
+    RenderBackend render_backend() const { return _render_backend; }
+    void render_backend(RenderBackend backend) { _render_backend = backend; }
 };
 }
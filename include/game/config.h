@@ -3,6 +3,12 @@
 #include <string>
 
 namespace game {
+// How the level is drawn
+enum class RenderBackend {
+    Legacy, // fixed function texture units and client arrays
+    Glsl,   // the world shader with generic vertex attributes
+};
+
 class Config {
 private:
     static std::string _project_name;
@@ -11,8 +17,30 @@ private:
     static std::string _data_path;
     static std::string _shader_path;
     static std::string _map_name;
+    static std::string _asset_manifest;
     static size_t _window_width;
     static size_t _window_height;
+    static bool _map_use_mmap;
+    static bool _map_use_cache;
+    static size_t _worker_threads;
+    static int _patch_level;
+    static bool _patch_lod;
+    static int _patch_lod_min_level;
+    static int _patch_lod_max_level;
+    static float _patch_lod_distance;
+    static size_t _visibility_cache_size;
+    static bool _frustum_cull;
+    static bool _frustum_cull_faces;
+    static bool _frustum_walk_nodes;
+    static int _pvs_compress_clusters;
+    static bool _occlusion_cull;
+    static size_t _occlusion_width;
+    static size_t _occlusion_height;
+    static size_t _occluder_max_faces;
+    static float _occluder_min_size;
+    static RenderBackend _render_backend;
+    static bool _texture_streaming;
+    static double _texture_upload_ms;
 public:
     static bool load(const std::string &filename);
     static const auto &data_path() { return _data_path; };
@@ -38,5 +66,75 @@ public:
 
     static const auto &map_name() { return _map_name; };
     static void map_name(const std::string &val) { _map_name = val; };
+
+    static const auto &asset_manifest() { return _asset_manifest; };
+    static void asset_manifest(const std::string &val) { _asset_manifest = val; };
+
+    static const auto &map_use_mmap() { return _map_use_mmap; };
+    static void map_use_mmap(const bool val) { _map_use_mmap = val; };
+
+    static const auto &map_use_cache() { return _map_use_cache; };
+    static void map_use_cache(const bool val) { _map_use_cache = val; };
+
+    static const auto &worker_threads() { return _worker_threads; };
+    static void worker_threads(const size_t val) { _worker_threads = val; };
+
+    static const auto &patch_level() { return _patch_level; };
+    static void patch_level(const int val) { _patch_level = val; };
+
+    static const auto &patch_lod() { return _patch_lod; };
+    static void patch_lod(const bool val) { _patch_lod = val; };
+
+    static const auto &patch_lod_min_level() { return _patch_lod_min_level; };
+    static void patch_lod_min_level(const int val) { _patch_lod_min_level = val; };
+
+    static const auto &patch_lod_max_level() { return _patch_lod_max_level; };
+    static void patch_lod_max_level(const int val) { _patch_lod_max_level = val; };
+
+    static const auto &patch_lod_distance() { return _patch_lod_distance; };
+    static void patch_lod_distance(const float val) { _patch_lod_distance = val; };
+
+    static const auto &visibility_cache_size() { return _visibility_cache_size; };
+    static void visibility_cache_size(const size_t val) { _visibility_cache_size = val; };
+
+    static const auto &frustum_cull() { return _frustum_cull; };
+    static void frustum_cull(const bool val) { _frustum_cull = val; };
+
+    static const auto &frustum_cull_faces() { return _frustum_cull_faces; };
+    static void frustum_cull_faces(const bool val) { _frustum_cull_faces = val; };
+
+    static const auto &frustum_walk_nodes() { return _frustum_walk_nodes; };
+    static void frustum_walk_nodes(const bool val) { _frustum_walk_nodes = val; };
+
+    static const auto &pvs_compress_clusters() { return _pvs_compress_clusters; };
+    static void pvs_compress_clusters(const int val) { _pvs_compress_clusters = val; };
+
+    static const auto &occlusion_cull() { return _occlusion_cull; };
+    static void occlusion_cull(const bool val) { _occlusion_cull = val; };
+
+    static const auto &occlusion_width() { return _occlusion_width; };
+    static void occlusion_width(const size_t val) { _occlusion_width = val; };
+
+    static const auto &occlusion_height() { return _occlusion_height; };
+    static void occlusion_height(const size_t val) { _occlusion_height = val; };
+
+    static const auto &occluder_max_faces() { return _occluder_max_faces; };
+    static void occluder_max_faces(const size_t val) { _occluder_max_faces = val; };
+
+    static const auto &occluder_min_size() { return _occluder_min_size; };
+    static void occluder_min_size(const float val) { _occluder_min_size = val; };
+
+    static const auto &render_backend() { return _render_backend; };
+    static void render_backend(const RenderBackend val) { _render_backend = val; };
+
+    // "legacy" or "glsl", false for any other name
+    static bool parse_render_backend(const std::string &name, RenderBackend &backend);
+    static const char *render_backend_name(RenderBackend backend);
+
+    static const auto &texture_streaming() { return _texture_streaming; };
+    static void texture_streaming(const bool val) { _texture_streaming = val; };
+
+    static const auto &texture_upload_ms() { return _texture_upload_ms; };
+    static void texture_upload_ms(const double val) { _texture_upload_ms = val; };
 };
 }
@@ -3,6 +3,7 @@
 #include <cstdint>
 #include <string>
 
+#include <game/config.h>
 #include <game/render/render.h>
 
 #include <spdlog/spdlog.h>
@@ -23,6 +24,9 @@ public:
     glm::vec3 trace_box(glm::vec3 start, glm::vec3 end);
     bool is_on_ground();
 
+    // The backend the level ended up with after loading
+    RenderBackend render_backend() const;
+
     ~BspRender() = default;
     void render(Viewport &view);
 
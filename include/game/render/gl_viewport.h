@@ -19,6 +19,8 @@ private:
     const char *_last_error = nullptr;
 
     std::shared_ptr<Camera> _camera;
+    RenderBackend _render_backend = RenderBackend::Legacy;
+    bool _is_core_profile = false;
 
     float _frame_interval = 0.0f;
 public:
@@ -35,8 +37,12 @@ public:
     std::shared_ptr<Camera> camera() const { return _camera; }
     void camera(const std::shared_ptr<Camera> &new_camera) {
         _camera = new_camera;
+        if(_camera) _camera->render_backend(_render_backend);
     }
 
+    RenderBackend render_backend() const { return _render_backend; }
+    void render_backend(RenderBackend backend);
+
     void update_frame_rate();
     float frame_interval() const { return _frame_interval; }
 };
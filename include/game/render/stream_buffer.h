@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+namespace game {
+namespace render {
+// Ring of buffer memory for the data written anew every frame, like
+// visible index lists or debug lines. The buffer is split into a section
+// for every frame in flight. A frame allocates its ranges from its own
+// section and fences it once its draws are issued, and the section is only
+// written again after the GPU passed that fence. With ARB_buffer_storage
+// the buffer stays mapped for its whole life and the writes land in it
+// directly. Without it they go to a copy in memory that commit() uploads
+// with glBufferSubData, still never to a section the GPU may be reading.
+class StreamBuffer {
+public:
+    enum class Mode {
+        Persistent, // persistently and coherently mapped, ARB_buffer_storage
+        SubData,    // written to memory, uploaded with glBufferSubData
+    };
+
+    // Part of the section of the current frame
+    struct Range {
+        uint8_t *data;        // Where to write, nullptr when the section is full
+        uint32_t buffer;      // The buffer to bind for drawing
+        size_t offset;        // The byte offset of the range in the buffer
+        size_t size;
+    };
+
+    struct Stats {
+        size_t frames;
+        size_t bytes;         // Handed out by allocate()
+        size_t overflows;     // Allocations that didn't fit their section
+        size_t waits;         // Frames that waited for the GPU to free their section
+        double wait_ms;
+    };
+
+private:
+    std::shared_ptr<spdlog::logger> _logger;
+    Mode _mode = Mode::SubData;
+    uint32_t _buffer = 0;
+    size_t _section_size = 0;
+    size_t _section = 0;             // The section of the current frame
+    size_t _used = 0;                // The bytes of it handed out
+    uint8_t *_memory = nullptr;      // The mapping, or the copy in memory
+    std::vector<uint8_t> _copy;
+    std::vector<void *> _fences;     // The GLsync of every section, nullptr when passed
+    Stats _stats = {};
+
+public:
+    StreamBuffer();
+    ~StreamBuffer();
+    StreamBuffer(const StreamBuffer &) = delete;
+    StreamBuffer &operator=(const StreamBuffer &) = delete;
+
+    // This creates the buffer with frames sections of section_size bytes,
+    // in the current context. Persistent falls back to SubData when the
+    // context can't map buffers persistently.
+    bool init(size_t section_size, size_t frames = 3, Mode mode = Mode::Persistent);
+    void destroy();
+
+    // This waits until the GPU is done with the section of the new frame
+    void begin_frame();
+
+    // This hands out size bytes of the section of the frame, aligned to alignment
+    Range allocate(size_t size, size_t alignment = 16);
+
+    // This makes what was written to the range visible to the GPU, it is
+    // called before drawing from it
+    void commit(const Range &range);
+
+    // This fences the section of the frame, after its draws were issued
+    void end_frame();
+
+    Mode mode() const { return _mode; }
+    uint32_t buffer() const { return _buffer; }
+    size_t section_size() const { return _section_size; }
+    size_t sections() const { return _fences.size(); }
+    const Stats &stats() const { return _stats; }
+};
+
+}
+}
@@ -3,6 +3,7 @@
 #include <memory>
 #include <glm/glm.hpp>
 
+#include <game/config.h>
 #include <game/render/window.h>
 #include <game/camera.h>
 
@@ -21,6 +22,11 @@ public:
     virtual std::shared_ptr<Camera> camera() const = 0;
     virtual void camera(const std::shared_ptr<Camera> &new_camera) = 0;
 
+    // The backend the level is drawn with, which is only known once it's
+    // loaded as the shaders may fail and leave it on the legacy one
+    virtual RenderBackend render_backend() const = 0;
+    virtual void render_backend(RenderBackend backend) = 0;
+
     virtual void update_frame_rate() = 0;
     virtual float frame_interval() const = 0;
 };
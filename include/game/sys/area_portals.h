@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+namespace game {
+namespace sys {
+// Connections between the areas of a level. The compiler splits a level
+// into areas at its area portals, usually doors, so that a closed door can
+// hide everything behind it even though the PVS lets the rooms see each
+// other. Two areas are connected when a chain of open portals joins them,
+// or when no chain of portals joins them at all: portals only know of the
+// areas they link, everything else is left to the PVS. Every portal starts
+// open, which leaves the visibility as the PVS has it.
+class AreaPortals {
+public:
+    struct Portal {
+        int area1, area2;     // area1 < area2
+        glm::vec3 min, max;   // Where the areas meet
+        bool is_open;
+    };
+
+private:
+    int _areas = 0;
+    std::vector<Portal> _portals;
+    std::vector<int> _groups;    // The connected group of every area
+    std::vector<int> _linked;    // Its group with every portal open
+    bool _is_split = false;      // Whether a closed portal separates some areas
+    size_t _version = 0;
+
+    // This joins the areas of every portal, or every open one, into groups
+    void flood(std::vector<int> &groups, bool open_only) const;
+    void flood();
+public:
+    AreaPortals() = default;
+
+    void reset(int areas_num);
+    int areas() const { return _areas; }
+
+    // Adds an open portal between the areas, or grows the one they already have
+    void add(int area1, int area2, const glm::vec3 &min, const glm::vec3 &max);
+
+    const std::vector<Portal> &portals() const { return _portals; }
+
+    // These open or close a portal, or every portal between two areas, and
+    // return whether anything changed
+    bool open(size_t index, bool is_open);
+    bool open(int area1, int area2, bool is_open);
+
+    // Whether area2 can be seen from area1. Leafs outside of the areas, a
+    // negative area, are connected to everything like they were before.
+    bool connected(int area1, int area2) const;
+
+    bool is_split() const { return _is_split; }
+
+    // Changes with every portal opened or closed
+    size_t version() const { return _version; }
+
+    // Sets bit i of leaf_bits, words_for(leafs_num) words, for every leaf
+    // whose area in leaf_areas is connected to from, clears the others,
+    // and returns how many are set
+    size_t connected_leafs(int from, const int *leaf_areas, size_t leafs_num, uint64_t *leaf_bits) const;
+};
+
+}
+}
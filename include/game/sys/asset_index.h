@@ -0,0 +1,67 @@
+#pragma once
+
+#include <spdlog/spdlog.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+
+namespace game {
+namespace sys {
+// Index of every file under the data directory, so assets are resolved with
+// a hash lookup instead of probing the filesystem. Built by scanning the
+// directory tree once, or from the manifest written by an earlier scan
+// when none of the indexed directories has changed since.
+class AssetIndex {
+public:
+    struct Asset {
+        std::string name;     // Path relative to the root, with extension
+        std::string path;     // Root joined with name, ready to be opened
+        uint64_t size;        // File size in bytes
+    };
+
+private:
+    struct Directory {
+        std::string name;     // Path relative to the root, empty for the root
+        int64_t mtime;        // Modification time in nanoseconds
+    };
+
+    std::shared_ptr<spdlog::logger> _logger;
+    std::string _root;
+    std::vector<std::string> _preferred;  // Extensions by lookup priority
+    std::vector<Asset> _assets;
+    std::vector<Directory> _directories;
+    std::unordered_map<std::string, size_t> _by_name;
+    std::unordered_map<std::string, size_t> _by_stem;
+
+    bool scan_directory(const std::string &name);
+    bool load_manifest(const std::string &filename);
+    bool save_manifest(const std::string &filename) const;
+    void add(const std::string &name, uint64_t size);
+    int rank(const std::string &name) const;
+public:
+    AssetIndex();
+
+    // Extensions tried in order when looking up an extension-less name,
+    // has to be set before open()
+    const auto &preferred() const { return _preferred; }
+    void preferred(const std::vector<std::string> &extensions) { _preferred = extensions; }
+
+    // Indexes root, reusing the manifest when it is up to date and writing
+    // a new one otherwise. An empty manifest name always scans.
+    bool open(const std::string &root, const std::string &manifest);
+
+    // Looks up an asset by its relative path, with or without the extension.
+    // Doesn't touch the filesystem, returns nullptr for unknown names.
+    const Asset *find(const std::string &name) const;
+
+    size_t size() const { return _assets.size(); }
+
+    // Index of Config::data_path(), opened on first use
+    static const AssetIndex &global();
+};
+
+}
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+namespace game {
+namespace sys {
+// Instruction sets the SIMD code paths are implemented for, in order, so
+// a CPU supporting one supports every one before it
+enum class Isa {
+    Scalar,
+    SSE2,
+    AVX2,
+};
+
+// The best instruction set supported by this CPU, detected once
+Isa best_isa();
+bool is_supported(Isa isa);
+const char *isa_name(Isa isa);
+
+}
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <game/sys/cpu_features.h>
+
+namespace game {
+namespace sys {
+// Axis aligned boxes stored one coordinate per array, so the SIMD tests
+// load the same coordinate of several boxes at once
+struct BoxArray {
+    std::vector<float> min_x, min_y, min_z;
+    std::vector<float> max_x, max_y, max_z;
+
+    size_t size() const { return min_x.size(); }
+    bool empty() const { return min_x.empty(); }
+
+    void clear();
+    void reserve(size_t count);
+    void resize(size_t count);
+    void set(size_t index, const glm::vec3 &min, const glm::vec3 &max);
+    void push_back(const glm::vec3 &min, const glm::vec3 &max);
+
+    // Appends box index of other
+    void push_back(const BoxArray &other, size_t index);
+};
+
+// The six planes of the camera's view volume, pointing inwards. Boxes are
+// tested against all of them, several boxes at a time with the same
+// instruction sets as the image operations.
+class Frustum {
+public:
+    enum Planes {
+        PLANE_LEFT = 0,
+        PLANE_RIGHT,
+        PLANE_BOTTOM,
+        PLANE_TOP,
+        PLANE_NEAR,
+        PLANE_FAR,
+        PLANES_NUM
+    };
+
+private:
+    glm::vec4 _planes[PLANES_NUM]; // Normal in xyz, distance in w
+
+public:
+    // Contains everything, every plane is 0 0 0 1
+    Frustum();
+
+    // Extracts the planes of projection * view, the rows of the matrix
+    // combined as in "Fast Extraction of Viewing Frustum Planes from the
+    // World-View-Projection Matrix" by Gribb and Hartmann
+    explicit Frustum(const glm::mat4 &view_projection);
+
+    const glm::vec4 &plane(int index) const { return _planes[index]; }
+
+    // Whether any part of the box may be inside. A box is only rejected when
+    // it is fully behind one of the planes, so a few boxes near the corners
+    // are kept although they are outside.
+    bool contains(const glm::vec3 &min, const glm::vec3 &max) const;
+
+    // contains() against the planes whose bits are set in planes, clearing
+    // the bits of the planes the whole box is in front of. Boxes inside
+    // this one then only need the planes left.
+    bool contains(const glm::vec3 &min, const glm::vec3 &max, unsigned &planes) const;
+    static constexpr unsigned ALL_PLANES = (1u << PLANES_NUM) - 1;
+
+    // Sets inside[i] to 1 for the boxes contains() keeps and to 0 for the
+    // others, and returns how many were kept. Gives exactly the same
+    // answers for every instruction set.
+    size_t test(const BoxArray &boxes, uint8_t *inside) const { return test(boxes, inside, best_isa()); }
+    size_t test(const BoxArray &boxes, uint8_t *inside, Isa isa) const;
+
+    bool operator==(const Frustum &other) const;
+    bool operator!=(const Frustum &other) const { return !(*this == other); }
+};
+
+}
+}
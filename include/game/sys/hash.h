@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace game {
+namespace sys {
+static const uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ULL;
+static const uint64_t FNV_PRIME = 0x100000001b3ULL;
+
+// 64-bit FNV-1a, pass the previous result as seed to hash several buffers
+inline uint64_t fnv1a(const void *data, size_t size, uint64_t seed = FNV_OFFSET_BASIS) {
+    const uint8_t *bytes = static_cast<const uint8_t*>(data);
+    uint64_t hash = seed;
+    for(size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+// FNV-1a variant consuming 8 bytes per step, much faster on large buffers
+// but with weaker mixing, good enough to detect changed files
+inline uint64_t fnv1a_words(const void *data, size_t size, uint64_t seed = FNV_OFFSET_BASIS) {
+    const uint8_t *bytes = static_cast<const uint8_t*>(data);
+    uint64_t hash = seed;
+    size_t words = size / sizeof(uint64_t);
+    for(size_t i = 0; i < words; i++) {
+        uint64_t word;
+        memcpy(&word, bytes + i * sizeof(uint64_t), sizeof(word));
+        hash ^= word;
+        hash *= FNV_PRIME;
+        hash ^= hash >> 29;
+    }
+    return fnv1a(bytes + words * sizeof(uint64_t), size % sizeof(uint64_t), hash);
+}
+
+}
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <game/sys/cpu_features.h>
+
+namespace game {
+namespace sys {
+// Colour operations over tightly packed RGB images, used on lightmaps and
+// textures while loading. Every operation has a scalar reference and SIMD
+// versions picked at runtime for the CPU, all of them giving exactly the
+// same bytes.
+class ImageOps {
+public:
+    // Scales the colours by factor, darkening over-saturated texels back
+    // into range while keeping their hue. This is the lightmap gamma of
+    // the original Quake 3 loaders.
+    static void gamma(uint8_t *rgb, size_t pixels, float factor) { gamma(rgb, pixels, factor, best_isa()); }
+    static void gamma(uint8_t *rgb, size_t pixels, float factor, Isa isa);
+
+    // Shifts the colours left by shift bits, scaling texels that overflow
+    // back by their brightest channel, like Quake 3 overbright lighting
+    static void overbright(uint8_t *rgb, size_t pixels, int shift) { overbright(rgb, pixels, shift, best_isa()); }
+    static void overbright(uint8_t *rgb, size_t pixels, int shift, Isa isa);
+
+    // Replaces the colours by their luma, (77 R + 150 G + 29 B) / 256
+    static void greyscale(uint8_t *rgb, size_t pixels) { greyscale(rgb, pixels, best_isa()); }
+    static void greyscale(uint8_t *rgb, size_t pixels, Isa isa);
+};
+
+}
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <spdlog/spdlog.h>
+
+#include <cstdint>
+#include <string>
+#include <memory>
+
+namespace game {
+namespace sys {
+// Read-only memory mapping of a whole file
+class MappedFile {
+private:
+    std::shared_ptr<spdlog::logger> _logger;
+    const uint8_t *_data = nullptr;
+    size_t _size = 0;
+public:
+    MappedFile();
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile();
+
+    bool open(const std::string &path);
+    void close();
+
+    bool is_open() const { return _data != nullptr; }
+    const uint8_t *data() const { return _data; }
+    size_t size() const { return _size; }
+
+    template<typename T>
+    const T *at(size_t offset) const {
+        return reinterpret_cast<const T*>(_data + offset);
+    }
+};
+
+}
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <game/sys/cpu_features.h>
+#include <game/sys/frustum.h>
+#include <game/sys/thread_pool.h>
+
+namespace game {
+namespace sys {
+// A small depth buffer drawn on the CPU with a few big occluders, usually
+// the walls and floors nearest to the camera, to find the boxes hidden
+// behind them before anything is sent to the GPU. Both sides are kept
+// conservative: an occluder only writes the pixels it covers completely,
+// with the farthest depth of its triangle, and a box is only hidden when
+// every pixel its projection touches is nearer than the box's nearest
+// corner. The depth is the clip space w, the distance along the view
+// direction, so it stays linear across the screen.
+//
+// The screen is split into tiles, which are rasterised in parallel with
+// the triangles binned to them, several pixels of a row at a time with the
+// same instruction sets as the image operations. Each block of 8x8 pixels
+// keeps its farthest depth, so most boxes are decided a block at a time.
+class OcclusionBuffer {
+public:
+    static constexpr size_t BLOCK_SIZE = 8;   // Pixels per side of a hierarchical Z block
+    static constexpr size_t TILE_WIDTH = 64;  // Pixels per side of a tile rasterised by one task
+    static constexpr size_t TILE_HEIGHT = 32;
+
+    struct Stats {
+        size_t triangles;       // Occluder triangles drawn
+        size_t triangles_clipped; // Dropped for crossing the near plane
+        size_t boxes_tested;
+        size_t boxes_occluded;
+        double raster_ms;
+    };
+
+private:
+    // Edge functions, positive inside, already moved in by half a pixel
+    // so that a pixel centre passing all three is fully covered
+    struct Triangle {
+        float a[3], b[3], c[3];
+        float depth;            // The farthest w of the corners
+        int min_x, min_y, max_x, max_y; // Pixels touched, inclusive
+    };
+
+    size_t _width = 0, _height = 0;
+    size_t _tiles_x = 0, _tiles_y = 0;
+    float _near = 1.0f;
+    glm::mat4 _view_projection = glm::mat4(1.0f);
+    std::vector<float> _depth;          // Row major, FLT_MAX where nothing was drawn
+    std::vector<float> _blocks;         // The farthest depth of every block
+    std::vector<Triangle> _triangles;
+    std::vector<std::vector<uint32_t>> _bins; // The triangles overlapping every tile
+    Stats _stats = {};
+
+    // This draws the triangles of a tile and updates its blocks
+    void rasterize_tile(size_t tile, Isa isa);
+
+    // Projects a corner to pixels, returns false when it is behind near
+    bool project(const glm::vec3 &point, glm::vec3 &pixel) const;
+public:
+    // The size is rounded up to whole blocks
+    OcclusionBuffer(size_t width = 256, size_t height = 128);
+
+    void resize(size_t width, size_t height);
+    size_t width() const { return _width; }
+    size_t height() const { return _height; }
+
+    // Anything nearer than this is never hidden nor hides anything
+    float near() const { return _near; }
+    void near(float value) { _near = value; }
+
+    // This clears the buffer and the occluders for a new view
+    void clear(const glm::mat4 &view_projection);
+
+    // Adds an occluder triangle in world space, returns false when it
+    // was dropped for crossing the near plane or being too thin
+    bool add_triangle(const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c);
+
+    // This draws the triangles added since clear(), every tile on its own
+    // task when pool is given. Gives exactly the same depths for every
+    // instruction set.
+    void rasterize(ThreadPool *pool = nullptr) { rasterize(pool, best_isa()); }
+    void rasterize(ThreadPool *pool, Isa isa);
+
+    // Whether any part of the box may be seen past the occluders
+    bool visible(const glm::vec3 &min, const glm::vec3 &max);
+
+    // Sets visible[i] to 0 for the boxes hidden by the occluders, leaves
+    // the others alone, and returns how many it hid
+    size_t test(const BoxArray &boxes, uint8_t *visible);
+
+    const float *depth() const { return _depth.data(); }
+    const Stats &stats() const { return _stats; }
+};
+
+}
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <spdlog/spdlog.h>
+
+#include <cstddef>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <functional>
+
+#include <glm/glm.hpp>
+
+#include <game/sys/thread_pool.h>
+#include <game/sys/quake3_bsp.h>
+
+namespace game {
+namespace sys {
+// Picks the tessellation level of every patch from its distance to the
+// camera, halving it each time the distance doubles. A level is tessellated
+// on the worker pool the first time a patch needs it and kept, so going
+// back over a threshold costs nothing. The render thread never waits: a
+// patch keeps its current level until the new one is ready.
+class PatchLod {
+public:
+    // Tessellated patch, indices are relative to the first vertex
+    struct Geometry {
+        std::vector<BSPVertex> verts;
+        std::vector<int> indices;
+    };
+
+    // Fills geometry with the patch tessellated at level, called on the
+    // worker threads
+    using Tessellator = std::function<void(size_t patch, int level, Geometry &geometry)>;
+
+    struct Stats {
+        size_t switches = 0;       // Level changes of any patch
+        size_t tessellated = 0;    // Levels tessellated, cached ones aren't counted
+        size_t triangles = 0;      // Triangles of all patches at their current level
+    };
+
+private:
+    struct Finished {
+        size_t patch;
+        int level;
+        std::shared_ptr<const Geometry> geometry;
+    };
+
+    struct Patch {
+        glm::vec3 min, max;
+        int level;                 // Level drawn now
+        int pending;               // Level being tessellated, 0 for none
+        size_t base_triangles;     // Triangles at the base level
+        const Geometry *current;   // nullptr at the base level
+        std::vector<std::shared_ptr<const Geometry>> levels; // Indexed by level step
+    };
+
+    std::shared_ptr<spdlog::logger> _logger;
+    ThreadPool *_pool = nullptr;
+    Tessellator _tessellator;
+
+    int _base_level = 0;           // Level of the geometry stored in the level arrays
+    int _min_level = 2;
+    int _max_level = 16;
+    float _distance = 256.0f;
+
+    std::vector<Patch> _patches;
+    std::vector<std::future<void>> _jobs;
+
+    std::mutex _mutex;
+    std::deque<Finished> _finished; // Guarded by _mutex
+    std::atomic<bool> _is_cancelled;
+    size_t _pending = 0;           // Patches waiting for a level
+
+    Stats _stats;
+
+    int level_for(float distance) const;
+    int step(int level) const;
+    void tessellate_job(size_t patch, int level);
+    void receive(Finished &finished);
+    void select(Patch &patch, int level);
+public:
+    PatchLod();
+    PatchLod(const PatchLod &) = delete;
+    PatchLod &operator=(const PatchLod &) = delete;
+    ~PatchLod();
+
+    // Pool the levels are tessellated on, nullptr tessellates them in update()
+    ThreadPool *pool() const { return _pool; }
+    void pool(ThreadPool *pool) { _pool = pool; }
+
+    // Patches are drawn at max_level up to distance from the camera, and
+    // at half the level for every doubling of the distance after that,
+    // down to min_level. Levels are rounded to powers of two.
+    void levels(int min_level, int max_level, float distance);
+    int min_level() const { return _min_level; }
+    int max_level() const { return _max_level; }
+    float distance() const { return _distance; }
+
+    // Starts over with the patches of a level, all drawn from the geometry
+    // tessellated at base_level while loading until the first update()
+    void reset(const BSPLumpArray<BSPPatch> &patches, int base_level, Tessellator tessellator);
+
+    // Picks the level of every patch for the camera at pos, starts the
+    // tessellation of the levels not cached yet and switches to the ones
+    // finished since the last call
+    void update(const glm::vec3 &pos);
+
+    // Waits for the pending tessellations and switches to them
+    void finish(const glm::vec3 &pos);
+
+    // Geometry to draw the patch with, nullptr for the base level
+    const Geometry *geometry(size_t patch) const { return _patches[patch].current; }
+    int level(size_t patch) const { return _patches[patch].level; }
+
+    size_t size() const { return _patches.size(); }
+    size_t pending() const { return _pending; }
+    const Stats &stats() const { return _stats; }
+
+    // Drops the pending tessellations and every cached level
+    void clear();
+};
+
+}
+}
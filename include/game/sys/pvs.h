@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace game {
+namespace sys {
+// Potentially visible set of a level: for every cluster, one bit per
+// cluster that may be seen from it. Rows are padded to whole 64 bit words,
+// so they are read and combined a word at a time. Levels with many
+// clusters can keep their rows compressed, every run of empty words is
+// then stored as one empty word followed by the length of the run.
+class Pvs {
+private:
+    int _clusters = 0;
+    size_t _words = 0;                 // Words per row
+    bool _is_compressed = false;
+    std::vector<uint64_t> _rows;       // Every row one after the other
+    std::vector<uint32_t> _offsets;    // Where every compressed row starts, and the end
+
+    // The word index of a row
+    uint64_t word(int from, size_t index) const;
+public:
+    Pvs() = default;
+
+    // Copies the bitsets of the vis lump, bytes_per_cluster bytes per
+    // cluster. With compress the rows are compressed if that makes them
+    // smaller. Without vis data every cluster sees every other one.
+    void reset(int clusters_num, int bytes_per_cluster, const uint8_t *bitsets, bool compress);
+    void clear();
+
+    bool empty() const { return _clusters == 0; }
+    int clusters() const { return _clusters; }
+    size_t words() const { return _words; }
+    bool is_compressed() const { return _is_compressed; }
+
+    // The bytes the rows take
+    size_t memory() const { return _rows.size() * sizeof(uint64_t) + _offsets.size() * sizeof(uint32_t); }
+
+    // Whether cluster to may be seen from cluster from. Outside of the
+    // clusters, or without vis data, everything is visible. Leafs outside
+    // of the clusters, to < 0, can't be seen from inside them.
+    bool visible(int from, int to) const;
+
+    // Copies the row of from into words() words at out
+    void row(int from, uint64_t *out) const;
+
+    // Sets bit i of leaf_bits, words_for(leafs_num) words, for every leaf
+    // whose cluster in leaf_clusters is visible from from, clears the
+    // others, and returns how many are set
+    size_t visible_leafs(int from, const int *leaf_clusters, size_t leafs_num, uint64_t *leaf_bits) const;
+
+    // Bitset helpers over whole words
+    static size_t words_for(size_t bits) { return (bits + 63) / 64; }
+    static bool test(const uint64_t *bits, size_t index) { return (bits[index / 64] >> (index % 64)) & 1; }
+    static size_t count(const uint64_t *bits, size_t words);
+    static size_t count_and(const uint64_t *a, const uint64_t *b, size_t words);
+
+    // Whether any bit from first to last, both included, is set
+    static bool any(const uint64_t *bits, size_t first, size_t last);
+};
+
+}
+}
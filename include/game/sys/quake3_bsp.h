@@ -1,13 +1,29 @@
 #pragma once
 
 #include <vector>
+#include <list>
+#include <unordered_map>
+#include <algorithm>
 #include <cstring>
 #include <cstdint>
+#include <memory>
+#include <functional>
 
 #include <glm/glm.hpp>
 
 #include <spdlog/spdlog.h>
 
+#include <game/config.h>
+#include <game/sys/cpu_features.h>
+#include <game/sys/mapped_file.h>
+#include <game/sys/thread_pool.h>
+#include <game/sys/texture_streamer.h>
+#include <game/sys/frustum.h>
+#include <game/sys/pvs.h>
+#include <game/sys/area_portals.h>
+#include <game/sys/occlusion_buffer.h>
+#include <game/render/stream_buffer.h>
+
 #define FACE_POLYGON    1
 #define FACE_PATCH      2
 
@@ -15,10 +31,93 @@
 #define TYPE_SPHERE     1 // This is the type for tracing a SPHERE
 #define TYPE_BOX        2 // This is the type for tracing a AABB (BOX)
 
+#define PLANE_X         0 // Planes facing along the x axis, either way
+#define PLANE_Y         1
+#define PLANE_Z         2
+#define PLANE_NON_AXIAL 3 // All the others
+
 #define MAX_TEXTURES 1000
 
 #define M_EPS 0.03125f
 
+#define CONTENTS_SOLID       1          // Brushes nothing can pass or see through
+#define CONTENTS_AREAPORTAL  0x8000     // Brushes splitting the level into areas
+#define CONTENTS_TRANSLUCENT 0x20000000 // Solid but see through, like grates
+#define SURF_SKY             0x4        // Surfaces showing the sky box
+#define SURF_NODRAW          0x80       // Surfaces that are never drawn
+
+#define LIGHTMAP_SIZE           128  // Lightmaps are always 128 by 128
+#define LIGHTMAP_ATLAS_MAX_SIZE 2048 // Largest atlas the lightmaps are packed into
+
+#define BSP_IDENT   "IBSP"
+#define BSP_VERSION 0x2e
+
+// Array of lump elements, which either owns its storage or is a read-only
+// view into a memory-mapped file. A view is copied on the first write access.
+template<typename T>
+class BSPLumpArray {
+private:
+    std::vector<T> _owned;
+    const T *_data = nullptr;
+    size_t _size = 0;
+
+    void sync() { _data = _owned.data(); _size = _owned.size(); }
+public:
+    BSPLumpArray() = default;
+    BSPLumpArray(const BSPLumpArray &other) { *this = other; }
+    BSPLumpArray(BSPLumpArray &&other) = default;
+    BSPLumpArray &operator=(BSPLumpArray &&other) = default;
+    BSPLumpArray &operator=(const BSPLumpArray &other) {
+        if(this == &other) return *this;
+        if(other.is_view()) {
+            view(other._data, other._size);
+        } else {
+            _owned = other._owned;
+            sync();
+        }
+        return *this;
+    }
+
+    // Refers to count elements at data, which must outlive this array
+    void view(const T *data, size_t count) {
+        _owned = std::vector<T>();
+        _data = data;
+        _size = count;
+    }
+
+    void assign(const T *data, size_t count) {
+        _owned.assign(data, data + count);
+        sync();
+    }
+
+    void resize(size_t count) {
+        own();
+        _owned.resize(count);
+        sync();
+    }
+
+    void clear() { view(nullptr, 0); }
+
+    // Makes a private copy of the viewed data
+    void own() {
+        if(!is_view()) return;
+        _owned.assign(_data, _data + _size);
+        sync();
+    }
+
+    T *mutable_data() { own(); return _owned.data(); }
+
+    bool is_view() const { return _data != nullptr && _data != _owned.data(); }
+
+    const T *data() const { return _data; }
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+
+    const T &operator[](size_t i) const { return _data[i]; }
+    const T *begin() const { return _data; }
+    const T *end() const { return _data + _size; }
+};
+
 // BSP header structure
 struct BSPHeader {
     char str_id[4];    // This should always be 'IBSP'
@@ -71,7 +170,14 @@ struct BSPTexture {
 
 // BSP lightmap structure which stores the 128x128 RGB values
 struct BSPLightmap {
-    uint8_t imageBits[128][128][3];   // The RGB data in a 128x128 image
+    uint8_t imageBits[LIGHTMAP_SIZE][LIGHTMAP_SIZE][3];   // The RGB data in a 128x128 image
+};
+
+// place of a lightmap in the atlases
+struct LightmapSlot {
+    int atlas;                // The index of the atlas texture
+    int x, y;                 // The lightmap corner in the atlas, in texels
+    int atlas_size;           // The width and height of the atlas
 };
 
 // node in the BSP tree
@@ -105,7 +211,7 @@ struct BSPPlane {
 struct BSPVisData {
     int clusters_num;        // The number of clusters
     int bytes_per_cluster;      // The amount of bytes (8 bits) in the cluster's bitset
-    std::vector<uint8_t> bitsets; // The array of bytes that holds the cluster bitsets
+    BSPLumpArray<uint8_t> bitsets; // The array of bytes that holds the cluster bitsets
 };
 
 // brush data
@@ -121,6 +227,100 @@ struct BSPBrushSide {
     int texture_id;            // The texture index
 };
 
+// counts of the last frame built by the renderer
+struct RenderStats {
+    int faces;                // Visible faces
+    int triangles;            // Triangles of the visible faces
+    int batches;              // Runs of faces drawn with the same textures
+    int ranges;               // Index ranges drawn, after merging neighbouring faces
+    int draw_calls;           // glDrawElements and glMultiDrawElements calls
+    int texture_binds;        // Texture and lightmap binds
+    int leafs_tested;         // Leafs checked against the PVS, 0 when the cluster was cached
+    int leafs_kept;           // PVS visible leafs inside the frustum and not occluded, all of them without one
+    int leafs_culled;         // PVS visible leafs outside the frustum
+    int faces_culled;         // Faces of kept leafs outside the frustum themselves
+    int nodes_visited;        // BSP nodes reached by the front to back walk
+    int nodes_culled;         // Nodes skipped with their whole subtree
+    int leafs_area_culled;    // PVS visible leafs behind closed area portals
+    int occluders;            // Faces drawn into the occlusion buffer
+    int leafs_occluded;       // Leafs inside the frustum hidden behind the occluders
+    float occlusion_ms;       // CPU time spent drawing and testing the occlusion buffer
+    float submit_ms;          // CPU time spent submitting the batches
+};
+
+// A volume swept from start to end through the brushes of the level
+struct TraceDesc {
+    int type;                 // TYPE_RAY, TYPE_SPHERE or TYPE_BOX
+    glm::vec3 start;
+    glm::vec3 end;
+    float radius;             // The sphere's radius
+    glm::vec3 mins;           // The box corners, relative to the position
+    glm::vec3 maxs;
+    int contents;             // The brushes stopping it, CONTENTS_SOLID ones for movement
+};
+
+// Where a trace stopped and what stopped it
+struct TraceResult {
+    float fraction;           // How far from start to end it got, 1 when nothing was hit
+    glm::vec3 end_pos;        // start + (end - start) * fraction
+    BSPPlane plane;           // The brush side it hit
+    bool start_solid;         // Started inside a brush
+    bool all_solid;           // Never left that brush
+    int contents;             // The contents of the brush it hit, 0 for none
+    int brush_tests;          // The brushes checked against it
+};
+
+// curved surface, one per patch face, filled in when tessellating
+struct BSPPatch {
+    int face;                 // The index of the patch face
+    int start_vert_index;     // The first control point in the vertex array
+    int size[2];              // The control point grid dimensions
+    glm::vec3 min;            // The bounding box of the control points,
+    glm::vec3 max;            // which holds the whole surface
+};
+
+#define COOKED_IDENT     "CBSP"
+#define COOKED_VERSION   3 // Bumped whenever the cooked data changes, like tessellated patches
+#define COOKED_EXTENSION ".cooked"
+#define COOKED_ALIGNMENT 16
+
+// sections of a cooked level, in the order they are stored
+enum eCookedSections {
+    COOKED_VERTICES = 0,
+    COOKED_INDICES,
+    COOKED_FACES,
+    COOKED_TEXTURES,
+    COOKED_LIGHTMAPS,
+    COOKED_NODES,
+    COOKED_LEAFS,
+    COOKED_LEAF_FACES,
+    COOKED_PLANES,
+    COOKED_BRUSHES,
+    COOKED_BRUSH_SIDES,
+    COOKED_LEAF_BRUSHES,
+    COOKED_VIS_DATA,
+    COOKED_PATCHES,
+    COOKED_MAX_SECTIONS
+};
+
+// cooked section, offsets are COOKED_ALIGNMENT aligned
+struct CookedSection {
+    uint64_t offset;          // The offset into the file for the start of the section
+    uint64_t length;          // The length in bytes for this section
+};
+
+// header of a cooked level, the post-processed arrays written after the
+// first load of a .bsp so later loads can map them directly
+struct CookedHeader {
+    char str_id[4];           // This should always be 'CBSP'
+    uint32_t version;         // COOKED_VERSION the file was written with
+    uint64_t source_key;      // Hash of the source .bsp contents and the load settings
+    uint64_t file_size;       // The size of the whole cooked file
+    int32_t clusters_num;     // The visibility cluster count of the vis data
+    int32_t bytes_per_cluster; // The size of one cluster bitset
+    CookedSection sections[COOKED_MAX_SECTIONS];
+};
+
 // lumps enumeration
 enum eLumps {
     LUMP_ENTITIES = 0,            // Stores player/object positions, etc...
@@ -143,12 +343,26 @@ enum eLumps {
     LUMP_MAX_LUMPS                 // A constant to store the number of lumps
 };
 
+namespace game {
+namespace sys {
+class PatchLod;
+}
+}
+
 // Quake3 BSP class
 class Quake3Bsp {
 private:
     std::shared_ptr<spdlog::logger> _logger;
 
 public:
+    // How the .bsp file is brought into memory
+    enum class LoadMode {
+        Stdio,      // read every lump into owned arrays with positioned reads
+        Mapped,     // mmap the file once and view the lumps in place
+        Sequential, // the original reader, fseek and fread one lump after another
+    };
+
+    using RenderBackend = game::RenderBackend;
 
     Quake3Bsp();
     ~Quake3Bsp();
@@ -156,9 +370,143 @@ public:
     // This loads a .bsp file by it's file name (Returns true if successful)
     bool load_bsp(const std::string &filename);
 
-    // This renders the level to the screen, currently the camera pos isn't being used
+    // This reads and converts the level data without touching OpenGL
+    bool read_bsp(const std::string &filename);
+
+    LoadMode load_mode() const { return _load_mode; }
+    void load_mode(LoadMode mode) { _load_mode = mode; }
+
+    // Picked before load_bsp(), which builds the vertex arrays for it. The
+    // shader backend falls back to the legacy one if the shaders fail.
+    RenderBackend render_backend() const { return _render_backend; }
+    void render_backend(RenderBackend backend) { _render_backend = backend; }
+
+    // The matrix the shader backend transforms the level with, the legacy
+    // backend uses the fixed function matrix stacks instead
+    void view_projection(const glm::mat4 &matrix) { _view_projection = matrix; }
+
+    // Pool used to decode and convert lumps while loading, nullptr loads
+    // everything on the calling thread
+    game::sys::ThreadPool *load_pool() const { return _pool; }
+    void load_pool(game::sys::ThreadPool *pool) { _pool = pool; }
+
+    // Hash of all the loaded level data, equal for equal levels
+    uint64_t data_hash() const;
+
+    // How many times each side of a patch's Bezier sub-patches is split,
+    // has to be set before reading the level
+    int bezier_level() const { return _bezier_level; }
+    void bezier_level(int level) { _bezier_level = std::max(1, level); }
+
+    // Whether to load from and write the cooked level next to the .bsp
+    bool use_cache() const { return _use_cache; }
+    void use_cache(bool value) { _use_cache = value; }
+
+    // This uploads the textures decoded since the last frame, within the
+    // Config::texture_upload_ms() budget. Faces are drawn with a placeholder
+    // until their texture arrives.
+    void update_textures();
+
+    // The number of textures still being loaded
+    size_t textures_pending() const { return _streamer.pending(); }
+
+    const BSPLumpArray<BSPTexture> &textures() const { return _textures; }
+    const BSPLumpArray<BSPLeaf> &leafs() const { return _leafs; }
+    const BSPVisData &vis_data() const { return _clusters; }
+
+    // This picks the tessellation level of every patch for the camera at
+    // pos, when Config::patch_lod() is on. New levels are tessellated in
+    // the background and drawn from a later frame.
+    void update_patches(const glm::vec3 &pos);
+
+    const BSPLumpArray<BSPPatch> &patches() const { return _patches; }
+    game::sys::PatchLod &patch_lod() { return *_patch_lod; }
+
+    // This renders the level to the screen as seen from pos
     void render(const glm::vec3 &pos);
 
+    // This renders only the visible leafs and faces inside the frustum
+    void render(const glm::vec3 &pos, const game::sys::Frustum &frustum);
+
+    // This finds the faces visible from pos and sorts them into batches
+    // without touching OpenGL, render() then only submits the batches
+    void build_frame(const glm::vec3 &pos);
+    void build_frame(const glm::vec3 &pos, const game::sys::Frustum &frustum);
+
+    // Whether the faces of the leafs inside the frustum are tested against
+    // it one by one as well
+    bool cull_faces() const { return _cull_faces; }
+    void cull_faces(bool value) { _cull_faces = value; _is_frame_built = false; }
+
+    // What the last frame drew and how many calls it took
+    const RenderStats &render_stats() const { return _stats; }
+
+    // The faces seen by the last frame, each one once. With a frustum they
+    // come nearest first, and so do the batches drawing them.
+    const std::vector<int> &visible_faces() const { return *_visible_faces; }
+
+    // The leafs drawn by the last frame, nearest first with a frustum
+    const std::vector<int> &visible_leafs() const { return *_visible_leafs; }
+
+    // Whether frames with a frustum walk the BSP nodes front to back,
+    // skipping whole subtrees, instead of testing every visible leaf
+    bool walk_nodes() const { return _walk_nodes; }
+    void walk_nodes(bool value) { _walk_nodes = value; _is_frame_built = false; }
+
+    // Whether frames with a frustum also drop the leafs hidden behind the
+    // nearest big walls, found in a small depth buffer drawn on the CPU
+    // from the view_projection() matrix
+    bool occlusion_cull() const { return _occlusion_cull; }
+    void occlusion_cull(bool value) { _occlusion_cull = value; _is_frame_built = false; }
+
+    // The occluders are the solid polygon faces of the kept leafs that
+    // look the biggest from the camera, their area over their squared
+    // distance. At most max_faces of them are drawn, and none smaller
+    // than min_size.
+    size_t occluder_max_faces() const { return _occluder_max_faces; }
+    float occluder_min_size() const { return _occluder_min_size; }
+    void occluders(size_t max_faces, float min_size);
+
+    game::sys::OcclusionBuffer &occlusion_buffer() { return _occlusion; }
+
+    // How many clusters keep their visible faces, the least recently
+    // used one is dropped first. Zero walks the leafs every frame.
+    size_t visibility_cache_size() const { return _visibility_cache_size; }
+    void visibility_cache_size(size_t size);
+
+    // This sweeps the ray, sphere or box of desc through the brushes and
+    // returns where it stops. It keeps nothing between calls, so any number
+    // of threads may trace at once while the level isn't changed. A brush
+    // the trace starts in doesn't stop it, letting movers stuck in one get
+    // out, start_solid and all_solid tell about it.
+    TraceResult trace(const TraceDesc &desc) const;
+
+    // This runs count traces of any type, writing results[i] for descs[i],
+    // spread over pool or on the calling thread without one. The results
+    // are the same as tracing them one by one, whatever the thread count.
+    void trace(const TraceDesc *descs, TraceResult *results, size_t count) const {
+        trace(descs, results, count, _pool);
+    }
+    void trace(const TraceDesc *descs, TraceResult *results, size_t count,
+               game::sys::ThreadPool *pool) const;
+
+    // Whether a trace checks a brush it reaches through several leafs only
+    // once. Each thread stamps the brushes with the number of its trace.
+    bool brush_mailbox() const { return _brush_mailbox; }
+    void brush_mailbox(bool value) { _brush_mailbox = value; }
+
+    // Whether a trace skips the brushes whose box it misses before testing
+    // their sides, and the instruction set testing the sides
+    bool brush_bounds() const { return _brush_bounds; }
+    void brush_bounds(bool value) { _brush_bounds = value; }
+    game::sys::Isa trace_isa() const { return _trace_isa; }
+    void trace_isa(game::sys::Isa isa);
+
+    // The calls below move through the level the way a player does,
+    // sliding along what they hit and stepping up stairs. They remember
+    // what happened for collided() and is_on_ground(), so only one of them
+    // may run at a time.
+
     // This traces a single ray and checks collision with brushes
     glm::vec3 trace_ray(glm::vec3 start, glm::vec3 end);
 
@@ -182,16 +530,266 @@ public:
 
     // This tells us if a cluster is visible or not
     int is_cluster_visible(int current, int test);
-    void render_face(int faceIndex);
+
+    // The cluster bitsets as whole words, for queries over many clusters
+    // or leafs at once
+    const game::sys::Pvs &pvs() const { return _pvs; }
+
+    // The cluster of every leaf, in leaf order
+    const std::vector<int> &leaf_clusters() const { return _leaf_clusters; }
+
+    // The areas of the level and the portals between them, found where
+    // leafs of different areas touch or meet at an area portal brush.
+    // Closing a portal hides the areas only reachable through it from
+    // the renderer and from in_pvs().
+    const game::sys::AreaPortals &area_portals() const { return _area_portals; }
+    const std::vector<int> &leaf_areas() const { return _leaf_areas; }
+
+    // These open or close a portal, every portal between two areas, or
+    // every portal touching a box like the bounds of a door, and return
+    // how many changed
+    int area_portal(size_t index, bool open);
+    int area_portal(int area1, int area2, bool open);
+    int area_portal(const glm::vec3 &min, const glm::vec3 &max, bool open);
+
+    // Whether b may be seen from a, it is in the PVS of a and no closed
+    // portal separates their areas
+    bool in_pvs(const glm::vec3 &a, const glm::vec3 &b);
 
 private:
-    bool create_texture(uint32_t &texture, const std::string &filename);
+    bool read_bsp_stdio(const std::string &filename);
+    bool read_bsp_sequential(const std::string &filename);
+    bool read_bsp_mapped(const std::string &filename);
+
+    // This checks the header and that every lump lies inside the file
+    bool validate_lumps(const BSPHeader &header, const BSPLump *lumps, size_t file_size);
+
+    // This checks the vis header read from the start of the vis lump, and
+    // gives the size of the cluster bitsets following it in the lump
+    bool validate_vis(const BSPLump &vis, const int *vis_header, size_t &size);
+
+    // This converts the raw lumps to the layout used by the game
+    void post_process();
+    void update_counts();
+
+    // Cooked level cache
+    bool source_key(const std::string &filename, uint64_t &key);
+    bool read_cooked(const std::string &filename, uint64_t key);
+    bool write_cooked(const std::string &filename, uint64_t key);
+
+    // These run on the load pool when there is one
+    void run_tasks(std::vector<std::function<void()>> &tasks);
+    void for_range(size_t count, size_t grain, const std::function<void(size_t, size_t)> &fn);
 
     // This manually changes the gamma levels of an image
     void change_gamma(uint8_t *pImage, int size, float factor);
 
-    // This creates a texture map from the lightmap image bits
-    void create_lightmap_texture(uint32_t &texture, uint8_t *pImageBits, int width, int height);
+    // Lightmaps are packed into square atlases, so faces with different
+    // lightmaps share the same texture. This gives the lightmap position,
+    // which depends only on its index and the lightmap count.
+    LightmapSlot lightmap_slot(int lightmap_id) const;
+    int lightmap_atlases_num() const;
+
+    // This moves the lightmap coordinates of every face into its atlas
+    void remap_lightmap_coords();
+
+    // This creates a texture map from the lightmaps packed into one atlas
+    void create_lightmap_atlas(uint32_t &texture, int atlas);
+
+    // Vertex array object with the buffers it draws from
+    struct VertexArray {
+        uint32_t array = 0;
+        uint32_t vertices = 0;
+        uint32_t indices = 0;
+    };
+
+    // This uploads the vertices and indices into new buffers and records
+    // the vertex layout in a vertex array object
+    void create_vertex_array(VertexArray &array, const BSPVertex *verts, size_t verts_num,
+                             const uint32_t *indices, size_t indices_num, bool is_static);
+    void delete_vertex_array(VertexArray &array);
+
+    // This points the attributes of the bound vertex array at the vertices
+    // from offset on in the bound vertex buffer
+    void vertex_layout(size_t offset);
+
+    // This uploads the whole level geometry once, every face is then drawn
+    // by its offset into the index buffer
+    void create_world_buffers();
+    void delete_world_buffers();
+
+    // Faces sharing a texture, a lightmap atlas and a vertex array, drawn
+    // with one call
+    struct DrawBatch {
+        int texture_id;
+        int lightmap_id;      // Any lightmap of the atlas, -1 for none
+        bool is_patch;        // Drawn from the LOD geometry of the frame's patches
+        size_t first_range;
+        size_t ranges_num;
+        int order;            // The first of its faces in the visible list
+    };
+
+    // Leafs and faces seen from a cluster, in the order the leaf walk
+    // found them
+    struct ClusterFaces {
+        int cluster;
+        int area;                        // The area of the camera, for the area portals
+        int area_culled;                 // PVS visible leafs in areas it can't reach
+        std::vector<int> faces;
+        std::vector<int> leafs;
+        game::sys::BoxArray leaf_boxes;  // The bounds of the leafs above
+        std::vector<uint64_t> leaf_bits; // One bit for every one of them
+    };
+
+    // This walks the leafs visible from the cluster and collects them and
+    // their faces
+    void collect_faces(int cluster, int area, ClusterFaces &visible);
+
+    // This returns the leafs and faces visible from the cluster, from the
+    // cache when it has them
+    const ClusterFaces &cluster_faces(int cluster, int area);
+    void clear_visibility_cache();
+
+    // This computes the bounds of every node, leaf and face for frustum
+    // culling, and the leafs below every node
+    void update_bounds();
+
+    // This copies the vis data into word rows, and the cluster of every leaf
+    void update_pvs();
+
+    // This finds the areas and the portals between them
+    void update_areas();
+
+    // This packs the nodes and leafs the way the traces walk them
+    void update_collision();
+
+    // Box of a leaf
+    struct Bounds {
+        glm::vec3 min, max;
+    };
+
+    // Node as the render walk reads it, its box, splitter plane and
+    // children in one place. The leafs below it lie between first_leaf
+    // and last_leaf, along with others when the compiler didn't number
+    // them in tree order.
+    struct RenderNode {
+        glm::vec3 min, max;
+        glm::vec3 normal;
+        float d;
+        int front, back;
+        int first_leaf, last_leaf;
+    };
+
+    // Node of the collision tree with its splitter plane inline. The nodes
+    // are stored depth first with the front child right after its parent,
+    // so a trace mostly walks forward through memory.
+    struct CollisionNode {
+        glm::vec3 normal;
+        float d;
+        int32_t children[2];  // Front and back, leaf i is -(i + 1)
+        uint8_t type;         // PLANE_X, PLANE_Y, PLANE_Z or PLANE_NON_AXIAL
+        uint8_t signbits;     // Bit i set when normal[i] is negative
+    };
+
+    // What the traces know of a plane from its normal, like cplane_t in
+    // Quake 3. Axial planes have a normal of 1 or -1 on one axis and 0 on
+    // the others, so the distance of a point from them is one coordinate.
+    struct PlaneClass {
+        uint8_t type;
+        uint8_t signbits;
+    };
+
+    // Axial side of a brush, its distance is one coordinate of the trace
+    struct CollisionAxialSide {
+        float d;
+        int32_t side;         // The order of the side in the brush
+        int32_t plane;        // Into _planes
+        uint8_t type;         // PLANE_X, PLANE_Y or PLANE_Z
+        uint8_t signbits;     // The axis bit set when the normal is -1
+    };
+
+    // The brushes of a leaf, a range of _leaf_brushes
+    struct CollisionLeaf {
+        int32_t first_brush;
+        int32_t brushes_num;
+    };
+
+    // Brush as the traces test it. The box comes from its axis aligned
+    // sides, which the compiler gives every brush, and is FLT_MAX wide on
+    // the sides it has none. A trace missing the box is in front of one of
+    // those sides, so the brush can't stop it. The axial sides are tested
+    // one coordinate at a time, the others a group at a time.
+    struct CollisionBrush {
+        glm::vec3 min, max;
+        int32_t first_axial;  // The first of its CollisionAxialSides
+        int32_t axial_num;
+        int32_t first_sides;  // The first of its CollisionSides
+        int32_t sides_num;    // Of the non axial sides
+        int32_t contents;     // Of its texture, 0 when it has no sides
+    };
+
+    // Side planes of a brush, one coordinate per array, so the SIMD tests
+    // load the same coordinate of several planes at once. The lanes past
+    // the last side have a plane no trace is in front of.
+    struct CollisionSides {
+        static constexpr int LANES = 8;
+        float x[LANES], y[LANES], z[LANES], d[LANES];
+        int32_t plane[LANES]; // Into _planes, for the plane a trace hits
+        int32_t side[LANES];  // The order of the side in the brush
+    };
+
+    // Part of a trace waiting for the walk to come back to it
+    struct TraceSpan {
+        int node;
+        glm::vec3 start, end;
+    };
+
+    // Node visited by descend_nodes(), with the frustum planes still to test
+    struct NodeVisit {
+        int index;
+        unsigned planes;
+    };
+
+    // This descends the nodes from the side of pos first, skipping the
+    // subtrees outside the frustum or without visible leafs, and gathers
+    // the visible leafs nearest first
+    void descend_nodes(const ClusterFaces &visible, const glm::vec3 &pos,
+                       const game::sys::Frustum &frustum, RenderStats &stats);
+
+    // The area of a face that can hide what is behind it, 0 for faces
+    // that can't
+    float occluder_area(size_t face_index) const;
+
+    // This draws the biggest faces of the kept leafs into the occlusion
+    // buffer and drops the kept leafs hidden behind them
+    void occlude_leafs(const glm::vec3 &pos, RenderStats &stats);
+
+    // This keeps the visible faces whose leafs, and with cull_faces() the
+    // faces themselves, are inside the frustum
+    void cull_faces(const ClusterFaces &visible, const glm::vec3 &pos,
+                    const game::sys::Frustum &frustum, RenderStats &stats);
+
+    // build_frame() for both, frustum is nullptr to draw everything visible
+    void prepare_frame(const glm::vec3 &pos, const game::sys::Frustum *frustum);
+
+    // This adds the visible faces to the batch list, merging index ranges
+    // that follow each other
+    void build_batches();
+
+    // This draws the batches of the last build_frame()
+    void submit_batches();
+
+    // This compiles the world shader and looks up its uniforms
+    bool create_world_program();
+    void delete_world_program();
+
+    // This writes the LOD geometry build_batches() gathered into the
+    // section of the frame of the patch stream. Returns false if it
+    // couldn't, the patch batches are skipped then.
+    bool upload_patches();
+
+    // This returns the vertex array a batch draws from
+    uint32_t batch_array(const DrawBatch &batch);
 
     // This checks to see if we can step up over a collision (like a step)
     glm::vec3 try_step(glm::vec3 start, glm::vec3 end);
@@ -199,51 +797,151 @@ private:
     // This traverses the BSP tree to check our movement vector with the brushes
     glm::vec3 trace(glm::vec3 start, glm::vec3 end);
 
-    // This recursively checks all the nodes until we find leafs that store the brushes
-    void check_node(int nodeIndex, float starRatio, float endRatio, glm::vec3 start, glm::vec3 end);
+    // The state of one trace(desc) while it walks the tree
+    struct TraceWork;
+
+    // This walks the collision tree down to the leafs the trace passes
+    // through and checks their brushes
+    void check_nodes(TraceWork &work) const;
 
-    // This checks our movement vector against the brush and it's sides
-    void check_brush(BSPBrush *pBrush, glm::vec3 start, glm::vec3 end);
+    // This checks our whole movement vector against the brush and it's sides
+    void check_brush(TraceWork &work, const CollisionBrush &brush) const;
 
     // This attaches the correct extension to the file name, if found
     void find_texture(char *filename);
-    void tesselate(int control_offset, int control_width, int vert_offset, int index_offset);
+
+    // Size of a patch tessellated as one grid of vertices
+    struct PatchSize {
+        int columns, rows;
+        int verts_num, indices_num;
+    };
+    // Zero sized for control grids that aren't made of 3x3 sub-patches
+    static PatchSize patch_size(int width, int height, int level);
+
+    // This evaluates the width by height control points of a patch made of
+    // 3x3 quadratic Bezier sub-patches, each split level times per side
+    static void tessellate_patch(const BSPVertex *controls, int width, int height,
+                                 int level, BSPVertex *verts, int *indices);
+
+    // This appends the tessellated patches to the vertex and index arrays
+    // and points the patch faces at them
+    void tessellate_patches();
+
+    // This hands the patches of the level to the LOD, which re-tessellates
+    // them from their control points
+    void reset_patch_lod();
 
     // This renders a single face to the screen
 
     int _textures_num = 0;      // The number of texture maps
     int _lightmaps_num = 0;     // The number of light maps
     int _leafs_num = 0;         // The number of leafs
-
-    int _traceType = 0;          // This stores if we are checking a ray, sphere or a box
-    float _traceRatio = 0;       // This stores the ratio from our start pos to the intersection pt.
-    float _traceRadius = 0;      // This stores the sphere's radius for a collision offset
+    bool _is_uploaded = false;  // Whether the textures were created in OpenGL
+
+    LoadMode _load_mode = LoadMode::Mapped;
+    RenderBackend _render_backend = RenderBackend::Legacy;
+    uint32_t _world_program = 0;               // The world shader of the Glsl backend
+    int32_t _mvp_location = -1;
+    glm::mat4 _view_projection = glm::mat4(1.0f);
+    bool _use_cache = true;
+    int _bezier_level = 3;
+    std::unique_ptr<game::sys::MappedFile> _map_file; // Backs the lump views in Mapped mode
+    game::sys::ThreadPool *_pool = nullptr;
+    game::sys::TextureStreamer _streamer; // Owns the textures in _textures_list
+    std::unique_ptr<game::sys::PatchLod> _patch_lod;
+
+    TraceDesc _move = {};        // The ray, sphere or box the player movement traces
 
     bool _is_collided = false;     // This tells if we just collided or not
 
     bool _is_grounded = false;     // This stores whether or not we are on the ground or falling
     bool _is_try_step = false;      // This tells us whether or not we should try to step over something
 
-    glm::vec3 _traceMins = {0, 0, 0};      // This stores the minimum values of the AABB (bottom corner)
-    glm::vec3 _traceMaxs = {0, 0, 0};      // This stores the maximum values of the AABB (top corner)
-    glm::vec3 _extents = {0, 0, 0};        // This stores the largest length of the box
     glm::vec3 _collisionNormal = {0, 0, 0};// This stores the normal of the plane we collided with
 
-    std::vector<int> _indices;
-    std::vector<BSPVertex> _verts;
-    std::vector<BSPNode> _nodes;
-    std::vector<BSPFace> _faces;
-    std::vector<BSPLeaf> _leafs;
-    std::vector<BSPPlane> _planes;
-    std::vector<int> _leaf_faces;
-    std::vector<BSPTexture> _textures;
-    std::vector<BSPBrush> _brushes;
-    std::vector<BSPBrushSide> _brush_sides;
-    std::vector<int> _leaf_brushes;
+    BSPLumpArray<int> _indices;
+    BSPLumpArray<BSPVertex> _verts;
+    BSPLumpArray<BSPNode> _nodes;
+    BSPLumpArray<BSPFace> _faces;
+    BSPLumpArray<BSPLeaf> _leafs;
+    BSPLumpArray<BSPPlane> _planes;
+    BSPLumpArray<int> _leaf_faces;
+    BSPLumpArray<BSPTexture> _textures;
+    BSPLumpArray<BSPLightmap> _lightmaps;
+    BSPLumpArray<BSPBrush> _brushes;
+    BSPLumpArray<BSPBrushSide> _brush_sides;
+    BSPLumpArray<int> _leaf_brushes;
+    BSPLumpArray<BSPPatch> _patches;
     BSPVisData   _clusters = {};
+    game::sys::Pvs _pvs;
+    std::vector<int> _leaf_clusters;
+    game::sys::AreaPortals _area_portals;
+    std::vector<int> _leaf_areas;
+    std::vector<uint64_t> _area_leaf_bits;    // The leafs in areas connected to the camera
+    std::vector<CollisionNode> _collision_nodes;
+    std::vector<CollisionLeaf> _collision_leafs;
+    std::vector<PlaneClass> _plane_classes;
+    std::vector<CollisionBrush> _collision_brushes;
+    std::vector<CollisionAxialSide> _collision_axial;
+    std::vector<CollisionSides> _collision_sides;
+    int _collision_depth = 0;                 // The most nodes from the root to a leaf
+    bool _brush_mailbox = true;
+    bool _brush_bounds = true;
+    game::sys::Isa _trace_isa = game::sys::best_isa();
 
     uint32_t _textures_list[MAX_TEXTURES];        // The texture array for the world
-    uint32_t _lightmaps_list[MAX_TEXTURES];       // The lightmap texture array
-
+    uint32_t _lightmaps_list[MAX_TEXTURES];       // The atlas texture of every lightmap
+    std::vector<uint32_t> _lightmap_atlases;      // The lightmap atlas textures
+    uint32_t _bound_lightmap = 0;                 // The atlas bound while rendering
+
+    VertexArray _world_array;                     // All the level vertices and indices
+    std::vector<uint32_t> _face_first_index;      // Where each face's indices start in the world array
+    game::render::StreamBuffer _patch_stream;     // The LOD geometry of the visible patches, every frame
+    uint32_t _patch_array = 0;                    // The vertex array drawing from its frame's section
+    size_t _patch_index_offset = 0;               // Where the frame's indices start in the stream
+    std::vector<BSPVertex> _patch_verts;          // What goes into it, gathered by build_batches()
+    std::vector<uint32_t> _patch_indices;
+    std::vector<const void *> _patch_offsets;     // The ranges of a patch batch in the stream
+    uint32_t _bound_array = 0;                    // The vertex array bound while rendering
+
+    std::vector<int> _face_patches;           // The patch of every face, -1 for other faces
     std::vector<bool> _faces_drawn;           // The bitset for the faces that have/haven't been drawn
+
+    ClusterFaces _uncached = {};              // The visible leafs and faces when the cache is off
+    const std::vector<int> *_visible_faces = &_uncached.faces; // The faces of the frame being built
+    const std::vector<int> *_visible_leafs = &_uncached.leafs; // The leafs of the frame being built
+    std::list<ClusterFaces> _cluster_faces;   // Most recently used first
+    std::unordered_map<uint64_t, std::list<ClusterFaces>::iterator> _cluster_lookup; // By cluster and area
+    size_t _visibility_cache_size = 64;
+    size_t _visibility_misses = 0;            // Leaf walks done so far
+    bool _is_frame_built = false;             // Whether the batches match the cluster below
+    int _frame_cluster = 0;                   // The cluster of the last built frame
+    int _frame_area = 0;                      // and the area
+    size_t _frame_lod_switches = 0;           // The patch LOD switches when it was built
+    bool _is_frame_culled = false;            // Whether it was built with the frustum below
+    game::sys::Frustum _frame_frustum;
+
+    bool _cull_faces = true;
+    bool _walk_nodes = true;
+    bool _occlusion_cull = true;
+    size_t _occluder_max_faces = 128;
+    float _occluder_min_size = 0.01f;
+    game::sys::OcclusionBuffer _occlusion;
+    std::vector<float> _face_areas;           // The area of every face that can hide others, 0 for the rest
+    std::vector<std::pair<float, int>> _occluder_scores; // The size and index of every candidate occluder
+    bool _is_front_to_back = false;           // Whether the visible faces come nearest first
+    std::vector<RenderNode> _render_nodes;
+    std::vector<Bounds> _leaf_bounds;
+    std::vector<NodeVisit> _node_stack;       // Nodes left to visit by descend_nodes()
+    std::vector<int> _face_order;             // The place of every visible face in the visible list
+    game::sys::BoxArray _face_boxes;          // The bounds of every face
+    game::sys::BoxArray _candidate_boxes;     // The bounds of the faces of the kept leafs
+    std::vector<uint8_t> _box_inside;         // The frustum test of the boxes above
+    std::vector<int> _culled_faces;           // The visible faces inside the frustum
+    std::vector<int> _culled_leafs;           // The visible leafs inside the frustum
+    std::vector<uint64_t> _sort_keys;         // Material and face of every visible face
+    std::vector<DrawBatch> _batches;
+    std::vector<int> _range_counts;           // Index count of every batch range
+    std::vector<const void *> _range_offsets; // Byte offset of every batch range
+    RenderStats _stats = {};
 };
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <spdlog/spdlog.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <chrono>
+
+#include <game/sys/thread_pool.h>
+
+namespace game {
+namespace sys {
+// Decodes texture images on worker threads and uploads them to OpenGL a few
+// at a time from the render thread, so a level can be drawn long before all
+// of its textures are loaded. Until its image arrives a requested texture
+// is the placeholder.
+class TextureStreamer {
+public:
+    // Decoded image with its mipmap chain, rows are tightly packed
+    struct Image {
+        int width = 0;
+        int height = 0;
+        int channels = 0;                        // 3 for RGB, 4 for RGBA
+        std::vector<std::vector<uint8_t>> levels; // Only level 0 for NPOT images
+    };
+
+private:
+    struct Decoded {
+        size_t slot;
+        bool is_loaded;
+        Image image;
+    };
+
+    std::shared_ptr<spdlog::logger> _logger;
+    ThreadPool *_pool = nullptr;
+    bool _is_core_profile = false;
+
+    uint32_t _placeholder = 0;
+    std::vector<uint32_t*> _targets;       // Where each request's texture goes
+    std::vector<uint32_t> _textures;       // Everything uploaded so far
+    std::vector<std::future<void>> _jobs;
+
+    std::mutex _mutex;
+    std::deque<Decoded> _decoded;          // Guarded by _mutex
+    std::atomic<bool> _is_cancelled;
+
+    size_t _finished = 0;
+    size_t _failed = 0;
+    std::chrono::steady_clock::time_point _start;
+
+    void decode_job(size_t slot, const std::string &path);
+    uint32_t upload(const Image &image);
+public:
+    TextureStreamer();
+    TextureStreamer(const TextureStreamer &) = delete;
+    TextureStreamer &operator=(const TextureStreamer &) = delete;
+    ~TextureStreamer();
+
+    // Pool the images are decoded on, nullptr decodes them in request()
+    ThreadPool *pool() const { return _pool; }
+    void pool(ThreadPool *pool) { _pool = pool; }
+
+    // A core profile context has no texture environment to set
+    bool is_core_profile() const { return _is_core_profile; }
+    void is_core_profile(bool is_core) { _is_core_profile = is_core; }
+
+    // Creates the placeholder texture, needs a current OpenGL context
+    bool init();
+    uint32_t placeholder() const { return _placeholder; }
+
+    // Starts decoding the image at path, *target is set to the placeholder
+    // now and to the texture once it is uploaded by update()
+    void request(const std::string &path, uint32_t *target);
+
+    // Uploads decoded images until budget_ms runs out, at least one per
+    // call so loading always makes progress. Returns the number uploaded.
+    size_t update(double budget_ms);
+
+    // Waits for every request and uploads the rest of the images
+    void finish();
+
+    size_t pending() const { return _targets.size() - _finished; }
+
+    // Drops the pending requests and deletes all the textures, including
+    // the placeholder
+    void clear();
+
+    // This loads an image from disk and builds its mipmaps, thread safe
+    static bool decode(const std::string &path, Image &image);
+};
+
+}
+}
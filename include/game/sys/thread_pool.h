@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <future>
+#include <functional>
+#include <condition_variable>
+
+namespace game {
+namespace sys {
+// Fixed set of worker threads running queued tasks in FIFO order
+class ThreadPool {
+private:
+    std::vector<std::thread> _workers;
+    std::deque<std::packaged_task<void()>> _tasks;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    bool _is_stopping = false;
+
+    struct ForState;
+
+    void worker();
+    bool run_pending();
+public:
+    // Zero threads means one per hardware thread
+    explicit ThreadPool(size_t threads = 0);
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+    ~ThreadPool();
+
+    size_t size() const { return _workers.size(); }
+
+    std::future<void> submit(std::function<void()> task);
+
+    // Waits for the future, running queued tasks meanwhile, so it is safe
+    // to call from inside a task
+    void wait(std::future<void> &future);
+    void wait(std::vector<std::future<void>> &futures);
+
+    // Calls fn(chunk_begin, chunk_end) over [begin, end) split into chunks
+    // of at least grain elements and returns once all of them are done.
+    // The calling thread only helps with these chunks, never with other
+    // queued tasks, so per frame work can use the shared pool. Rethrows the
+    // first exception of a chunk after all of them are done.
+    void parallel_for(size_t begin, size_t end, size_t grain,
+                      const std::function<void(size_t, size_t)> &fn);
+
+    // Pool shared by the whole game, sized by Config::worker_threads()
+    static ThreadPool &global();
+};
+
+}
+}
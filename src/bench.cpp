@@ -0,0 +1,1264 @@
+#include <chrono>
+#include <thread>
+#include <random>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+
+#include <spdlog/spdlog.h>
+
+#include <GL/glew.h>
+#include <SDL2/SDL.h>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <game/bench.h>
+#include <game/config.h>
+#include <game/sys/quake3_bsp.h>
+#include <game/sys/texture_streamer.h>
+#include <game/sys/asset_index.h>
+#include <game/sys/cpu_features.h>
+#include <game/sys/image_ops.h>
+#include <game/sys/patch_lod.h>
+#include <game/sys/frustum.h>
+#include <game/sys/occlusion_buffer.h>
+#include <game/render/stream_buffer.h>
+
+using namespace game;
+
+using bench_clock = std::chrono::steady_clock;
+using bench_ms = std::chrono::duration<double, std::milli>;
+
+static std::shared_ptr<spdlog::logger> logger() {
+    auto _logger = spdlog::get(Config::logger_name());
+    if(_logger == nullptr)
+        _logger = spdlog::stdout_color_mt(Config::logger_name());
+    return _logger;
+}
+
+static std::string map_path(const std::vector<std::string> &args, size_t index) {
+    auto name = args.size() > index ? args[index] : Config::map_name();
+    return Config::data_path() + std::string("maps/") + name + ".bsp";
+}
+
+// The middle of every leaf in a cluster, where the benches put the camera
+// or start their traces. Logs an error when the map has none.
+static std::vector<glm::vec3> leaf_centres(const Quake3Bsp &bsp) {
+    std::vector<glm::vec3> positions;
+    for(const auto &leaf : bsp.leafs()) {
+        if(leaf.cluster < 0) continue;
+        positions.emplace_back((leaf.min.x + leaf.max.x) * 0.5f, (leaf.min.y + leaf.max.y) * 0.5f,
+                               (leaf.min.z + leaf.max.z) * 0.5f);
+    }
+    if(positions.empty()) logger()->error("The map has no leaf in a cluster");
+    return positions;
+}
+
+static int arg_int(const std::vector<std::string> &args, size_t index, int def) {
+    return args.size() > index ? std::stoi(args[index]) : def;
+}
+
+// Compares reading the same map with the original sequential fseek and
+// fread reader, through pread and through the mapping, each on the calling
+// thread and on the worker pool, and reading the cooked level. Only the
+// CPU side of loading is measured, textures aren't created. All the
+// variants have to produce the same level data.
+static int bench_load(const std::vector<std::string> &args) {
+    auto _logger = logger();
+    auto path = map_path(args, 0);
+    int iterations = std::max(1, arg_int(args, 1, 10));
+
+    struct Variant {
+        Quake3Bsp::LoadMode mode;
+        bool is_parallel;
+        bool use_cache;
+        const char *name;
+    };
+    // The first cooked run writes the cache, the rest read it
+    const Variant variants[] = {
+        {Quake3Bsp::LoadMode::Sequential, false, false, "sequential fread"},
+        {Quake3Bsp::LoadMode::Stdio,      false, false, "pread serial"},
+        {Quake3Bsp::LoadMode::Stdio,      true,  false, "pread parallel"},
+        {Quake3Bsp::LoadMode::Mapped,     false, false, "mmap serial"},
+        {Quake3Bsp::LoadMode::Mapped,     true,  false, "mmap parallel"},
+        {Quake3Bsp::LoadMode::Mapped,     true,  true,  "cooked"},
+    };
+
+    uint64_t reference_hash = 0;
+    for(const auto &variant : variants) {
+        double total = 0.0, best = 0.0;
+        uint64_t hash = 0;
+        for(int i = 0; i < iterations; i++) {
+            Quake3Bsp bsp;
+            bsp.load_mode(variant.mode);
+            bsp.use_cache(variant.use_cache);
+            if(!variant.is_parallel) bsp.load_pool(nullptr);
+            auto start = bench_clock::now();
+            if(!bsp.read_bsp(path)) return 1;
+            double time = bench_ms(bench_clock::now() - start).count();
+            total += time;
+            if(i == 0 || time < best) best = time;
+            hash = bsp.data_hash();
+        }
+        _logger->info("load {}: {} runs, avg {:.3f} ms, best {:.3f} ms, data {:016x}",
+                      variant.name, iterations, total / iterations, best, hash);
+
+        if(reference_hash == 0) reference_hash = hash;
+        if(hash != reference_hash) {
+            _logger->error("load {}: level data differs from {}", variant.name, variants[0].name);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Decodes every texture of the map and builds its mipmaps, once on the
+// calling thread and once on the worker pool. This is the work the texture
+// streamer takes off the render thread, the GL upload isn't measured.
+static int bench_textures(const std::vector<std::string> &args) {
+    auto _logger = logger();
+    Quake3Bsp bsp;
+    if(!bsp.read_bsp(map_path(args, 0))) return 1;
+
+    std::vector<std::string> paths;
+    for(const auto &texture : bsp.textures()) {
+        const auto *asset = sys::AssetIndex::global().find(texture.name);
+        if(asset != nullptr) paths.emplace_back(asset->path);
+    }
+
+    auto decode_range = [&paths](size_t begin, size_t end, size_t &bytes) {
+        for(size_t i = begin; i < end; i++) {
+            sys::TextureStreamer::Image image;
+            if(!sys::TextureStreamer::decode(paths[i], image)) continue;
+            for(const auto &level : image.levels) bytes += level.size();
+        }
+    };
+
+    size_t serial_bytes = 0;
+    auto start = bench_clock::now();
+    decode_range(0, paths.size(), serial_bytes);
+    double serial = bench_ms(bench_clock::now() - start).count();
+
+    auto &pool = sys::ThreadPool::global();
+    std::vector<size_t> chunk_bytes(paths.size(), 0);
+    start = bench_clock::now();
+    pool.parallel_for(0, paths.size(), 1, [&](size_t begin, size_t end) {
+        decode_range(begin, end, chunk_bytes[begin]);
+    });
+    double parallel = bench_ms(bench_clock::now() - start).count();
+
+    size_t parallel_bytes = 0;
+    for(auto bytes : chunk_bytes) parallel_bytes += bytes;
+
+    _logger->info("textures: {} images, {} bytes with mipmaps", paths.size(), serial_bytes);
+    _logger->info("textures serial: {:.3f} ms", serial);
+    _logger->info("textures parallel: {:.3f} ms on {} threads", parallel, pool.size());
+    if(parallel_bytes != serial_bytes) {
+        _logger->error("textures: parallel decode produced {} bytes", parallel_bytes);
+        return 1;
+    }
+    return 0;
+}
+
+// Reads the map with patches tessellated at the given level, on the
+// calling thread and on the worker pool. The whole read is timed, the
+// difference between levels is the tessellation cost.
+static int bench_patches(const std::vector<std::string> &args) {
+    auto _logger = logger();
+    auto path = map_path(args, 0);
+    int level = std::max(1, arg_int(args, 1, 16));
+    int iterations = std::max(1, arg_int(args, 2, 10));
+
+    uint64_t reference_hash = 0;
+    for(int level_used : { 1, level }) {
+        for(bool is_parallel : { false, true }) {
+            double total = 0.0, best = 0.0;
+            uint64_t hash = 0;
+            for(int i = 0; i < iterations; i++) {
+                Quake3Bsp bsp;
+                bsp.use_cache(false);
+                bsp.bezier_level(level_used);
+                if(!is_parallel) bsp.load_pool(nullptr);
+                auto start = bench_clock::now();
+                if(!bsp.read_bsp(path)) return 1;
+                double time = bench_ms(bench_clock::now() - start).count();
+                total += time;
+                if(i == 0 || time < best) best = time;
+                hash = bsp.data_hash();
+            }
+            _logger->info("patches level {} {}: {} runs, avg {:.3f} ms, best {:.3f} ms, data {:016x}",
+                          level_used, is_parallel ? "parallel" : "serial", iterations,
+                          total / iterations, best, hash);
+
+            if(!is_parallel) reference_hash = hash;
+            if(hash != reference_hash) {
+                _logger->error("patches level {}: parallel tessellation differs", level_used);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Flies the camera from far away through the first patch of the map and
+// back, updating the patch LOD once per millisecond like frames would.
+// Reports the slowest update, which must not wait for tessellation, and the
+// patch triangles against drawing every patch at the highest level.
+static int bench_patch_lod(const std::vector<std::string> &args) {
+    auto _logger = logger();
+    int steps = std::max(2, arg_int(args, 1, 200));
+
+    Quake3Bsp bsp;
+    bsp.use_cache(false);
+    if(!bsp.read_bsp(map_path(args, 0))) return 1;
+    if(bsp.patches().empty()) {
+        _logger->error("patchlod: the map has no patches");
+        return 1;
+    }
+
+    auto &lod = bsp.patch_lod();
+    auto triangles_at = [&bsp](size_t patch, int level) {
+        const auto &p = bsp.patches()[patch];
+        return size_t((p.size[0] - 1) / 2 * level) * ((p.size[1] - 1) / 2 * level) * 2;
+    };
+    size_t max_triangles = 0;
+    for(size_t i = 0; i < lod.size(); i++) max_triangles += triangles_at(i, lod.max_level());
+
+    const auto &first = bsp.patches()[0];
+    glm::vec3 target = (first.min + first.max) * 0.5f;
+    glm::vec3 away = target + glm::vec3(1.0f, 0.25f, 0.5f) * (lod.distance() * 32.0f);
+
+    double total = 0.0, worst = 0.0;
+    size_t triangles = 0;
+    for(int i = 0; i < 2 * steps; i++) {
+        // There and back, so the way out only switches between cached levels
+        float t = float(i < steps ? i : 2 * steps - 1 - i) / (steps - 1);
+        glm::vec3 pos = away + (target - away) * t;
+
+        auto start = bench_clock::now();
+        lod.update(pos);
+        double time = bench_ms(bench_clock::now() - start).count();
+        total += time;
+        worst = std::max(worst, time);
+        triangles += lod.stats().triangles;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    lod.finish(target);
+
+    size_t expected = 0;
+    for(size_t i = 0; i < lod.size(); i++) expected += triangles_at(i, lod.level(i));
+
+    const auto &stats = lod.stats();
+    _logger->info("patchlod: {} patches, levels {} to {}, {} updates on {} threads",
+                  lod.size(), lod.min_level(), lod.max_level(), 2 * steps,
+                  sys::ThreadPool::global().size());
+    _logger->info("patchlod update: avg {:.4f} ms, worst {:.4f} ms", total / (2 * steps), worst);
+    _logger->info("patchlod: {} levels tessellated, {} switches", stats.tessellated, stats.switches);
+    _logger->info("patchlod: avg {} triangles against {} at level {}",
+                  triangles / (2 * steps), max_triangles, lod.max_level());
+    if(lod.level(0) != lod.max_level() || stats.triangles != expected) {
+        _logger->error("patchlod: patch at level {} with {} triangles in all, expected {}",
+                       lod.level(0), stats.triangles, expected);
+        return 1;
+    }
+    return 0;
+}
+
+// Builds the frame from the middle of every leaf of the map, or the given
+// number of them spread over the map, without drawing it. Compares the
+// draw calls of the material batches against one call per face.
+static int bench_batches(const std::vector<std::string> &args) {
+    auto _logger = logger();
+    Quake3Bsp bsp;
+    if(!bsp.read_bsp(map_path(args, 0))) return 1;
+
+    auto positions = leaf_centres(bsp);
+    if(positions.empty()) return 1;
+    size_t count = std::min(positions.size(), size_t(std::max(1, arg_int(args, 1, int(positions.size())))));
+
+    RenderStats total = {};
+    double time = 0.0;
+    for(size_t i = 0; i < count; i++) {
+        auto start = bench_clock::now();
+        bsp.build_frame(positions[i * positions.size() / count]);
+        time += bench_ms(bench_clock::now() - start).count();
+
+        const auto &stats = bsp.render_stats();
+        if(stats.draw_calls > stats.faces || stats.ranges > stats.faces) {
+            _logger->error("batches: {} draw calls and {} ranges for {} faces",
+                           stats.draw_calls, stats.ranges, stats.faces);
+            return 1;
+        }
+        total.faces += stats.faces;
+        total.triangles += stats.triangles;
+        total.batches += stats.batches;
+        total.ranges += stats.ranges;
+        total.draw_calls += stats.draw_calls;
+        total.texture_binds += stats.texture_binds;
+    }
+
+    double n = double(count);
+    _logger->info("batches: {} positions, build avg {:.3f} ms", count, time / n);
+    _logger->info("batches: avg {:.1f} faces, {:.1f} triangles", total.faces / n, total.triangles / n);
+    _logger->info("batches: avg {:.1f} draw calls ({:.1f} ranges), {:.1f} texture binds",
+                  total.draw_calls / n, total.ranges / n, total.texture_binds / n);
+    _logger->info("batches: {:.2f} faces per draw call", double(total.faces) / std::max(1, total.draw_calls));
+    return 0;
+}
+
+// Visits the middle of every leaf of the map twice, staying there for the
+// given number of frames, with the visible face cache off, too small for
+// the map and at its default size. Every variant has to see the same
+// faces from each leaf.
+static int bench_visibility(const std::vector<std::string> &args) {
+    auto _logger = logger();
+    int frames = std::max(1, arg_int(args, 1, 10));
+
+    Quake3Bsp bsp;
+    if(!bsp.read_bsp(map_path(args, 0))) return 1;
+
+    auto positions = leaf_centres(bsp);
+    if(positions.empty()) return 1;
+
+    struct Variant {
+        size_t cache_size;
+        const char *name;
+    };
+    const Variant variants[] = {
+        {0, "uncached"},
+        {4, "cache 4"},
+        {Config::visibility_cache_size(), "cache default"},
+    };
+
+    std::vector<std::vector<int>> reference(positions.size());
+    for(const auto &variant : variants) {
+        bsp.visibility_cache_size(variant.cache_size);
+        double time = 0.0;
+        size_t walks = 0;
+        for(int pass = 0; pass < 2; pass++) {
+            for(size_t i = 0; i < positions.size(); i++) {
+                for(int frame = 0; frame < frames; frame++) {
+                    auto start = bench_clock::now();
+                    bsp.build_frame(positions[i]);
+                    time += bench_ms(bench_clock::now() - start).count();
+                    if(bsp.render_stats().leafs_tested > 0) walks++;
+                }
+
+                auto faces = bsp.visible_faces();
+                std::sort(faces.begin(), faces.end());
+                if(variant.cache_size == 0 && pass == 0) reference[i] = faces;
+                if(faces != reference[i]) {
+                    _logger->error("visibility {}: leaf {} sees other faces", variant.name, i);
+                    return 1;
+                }
+            }
+        }
+        size_t total = 2 * positions.size() * frames;
+        _logger->info("visibility {}: {} frames, avg {:.4f} ms, {} leaf walks",
+                      variant.name, total, time / total, walks);
+    }
+    return 0;
+}
+
+// Projection and view of the game camera at pos, turned by yaw and pitch like Camera
+static glm::mat4 view_projection(const glm::vec3 &pos, float yaw, float pitch) {
+    float aspect = float(Config::window_width()) / float(Config::window_height());
+    glm::vec3 direction(std::cos(pitch) * std::sin(yaw), std::sin(pitch),
+                        std::cos(pitch) * std::cos(yaw));
+    glm::mat4 projection = glm::perspective(glm::radians(90.0f), aspect, 0.1f, 10000.0f);
+    glm::mat4 view = glm::lookAt(pos, pos + direction, glm::vec3(0.0f, 1.0f, 0.0f));
+    return projection * view;
+}
+
+static sys::Frustum view_frustum(const glm::vec3 &pos, float yaw, float pitch) {
+    return sys::Frustum(view_projection(pos, yaw, pitch));
+}
+
+// Checks the SIMD frustum tests against the scalar one on random boxes
+// and views and times them. Then looks around from the middle of every
+// leaf of the map in eight directions and counts how much of what the PVS
+// lets through the frustum removes.
+static int bench_frustum(const std::vector<std::string> &args) {
+    auto _logger = logger();
+    int iterations = std::max(1, arg_int(args, 1, 1000));
+
+    // An odd box count so the scalar tails run too
+    std::mt19937 random(1234);
+    std::uniform_real_distribution<float> coord(-4096.0f, 4096.0f), extent(1.0f, 512.0f);
+    std::uniform_real_distribution<float> yaw(0.0f, 6.2831853f), pitch(-1.2f, 1.2f);
+    sys::BoxArray boxes;
+    for(int i = 0; i < 1003; i++) {
+        glm::vec3 min(coord(random), coord(random), coord(random));
+        boxes.push_back(min, min + glm::vec3(extent(random), extent(random), extent(random)));
+    }
+
+    const sys::Isa isas[] = {
+        sys::Isa::Scalar, sys::Isa::SSE2, sys::Isa::AVX2,
+    };
+    std::vector<uint8_t> reference(boxes.size()), inside(boxes.size());
+    std::vector<sys::Frustum> frusta;
+    for(int view = 0; view < 64; view++) {
+        glm::vec3 pos(coord(random), coord(random), coord(random));
+        frusta.push_back(view_frustum(pos, yaw(random), pitch(random)));
+        const auto &frustum = frusta.back();
+
+        size_t kept = frustum.test(boxes, reference.data(), sys::Isa::Scalar);
+        for(size_t i = 0; i < boxes.size(); i++) {
+            glm::vec3 min(boxes.min_x[i], boxes.min_y[i], boxes.min_z[i]);
+            glm::vec3 max(boxes.max_x[i], boxes.max_y[i], boxes.max_z[i]);
+            if(frustum.contains(min, max) != bool(reference[i])) {
+                _logger->error("frustum: view {} box {} differs from contains()", view, i);
+                return 1;
+            }
+        }
+        for(auto isa : isas) {
+            if(!sys::is_supported(isa)) continue;
+            if(frustum.test(boxes, inside.data(), isa) != kept || inside != reference) {
+                _logger->error("frustum {}: view {} differs from the scalar version",
+                               sys::isa_name(isa), view);
+                return 1;
+            }
+        }
+    }
+
+    double scalar_time = 0.0;
+    for(auto isa : isas) {
+        if(!sys::is_supported(isa)) continue;
+        size_t kept = 0;
+        auto start = bench_clock::now();
+        for(int i = 0; i < iterations; i++) {
+            kept += frusta[i % frusta.size()].test(boxes, inside.data(), isa);
+        }
+        double total = bench_ms(bench_clock::now() - start).count();
+        if(isa == sys::Isa::Scalar) scalar_time = total;
+        _logger->info("frustum {}: {:.2f} ns per box, {:.2f}x scalar, {:.1f}% kept",
+                      sys::isa_name(isa), total * 1e6 / (double(iterations) * boxes.size()),
+                      scalar_time / total, 100.0 * kept / (double(iterations) * boxes.size()));
+    }
+
+    Quake3Bsp bsp;
+    if(!bsp.read_bsp(map_path(args, 0))) return 1;
+    bsp.occlusion_cull(false); // The frustum alone, the occlusion bench measures the rest
+
+    auto positions = leaf_centres(bsp);
+    if(positions.empty()) return 1;
+
+    // Everything the PVS lets through from each leaf, then the same frames
+    // with the frustum, which may only take faces away
+    double pvs_faces = 0, pvs_triangles = 0, pvs_leafs = 0;
+    double faces = 0, triangles = 0, leafs_culled = 0, faces_culled = 0, time = 0;
+    size_t frames = 0;
+    for(const auto &pos : positions) {
+        bsp.build_frame(pos);
+        auto pvs = bsp.visible_faces();
+        std::sort(pvs.begin(), pvs.end());
+        RenderStats pvs_stats = bsp.render_stats();
+
+        for(int direction = 0; direction < 8; direction++) {
+            auto frustum = view_frustum(pos, direction * 0.78539816f, 0.0f);
+            auto start = bench_clock::now();
+            bsp.build_frame(pos, frustum);
+            time += bench_ms(bench_clock::now() - start).count();
+
+            auto kept = bsp.visible_faces();
+            std::sort(kept.begin(), kept.end());
+            if(!std::includes(pvs.begin(), pvs.end(), kept.begin(), kept.end())) {
+                _logger->error("frustum: leaf {} draws faces outside the PVS", frames / 8);
+                return 1;
+            }
+
+            const auto &stats = bsp.render_stats();
+            pvs_faces += pvs_stats.faces;
+            pvs_triangles += pvs_stats.triangles;
+            pvs_leafs += pvs_stats.leafs_kept;
+            faces += stats.faces;
+            triangles += stats.triangles;
+            leafs_culled += stats.leafs_culled;
+            faces_culled += stats.faces_culled;
+            frames++;
+        }
+    }
+
+    double n = double(frames);
+    _logger->info("frustum: {} frames, build avg {:.4f} ms", frames, time / n);
+    _logger->info("frustum: avg {:.1f} of {:.1f} PVS leafs culled, {:.1f} more faces by their bounds",
+                  leafs_culled / n, pvs_leafs / n, faces_culled / n);
+    _logger->info("frustum: avg {:.1f} of {:.1f} faces kept, {:.1f}% culled",
+                  faces / n, pvs_faces / n, 100.0 * (1.0 - faces / std::max(1.0, pvs_faces)));
+    _logger->info("frustum: avg {:.1f} of {:.1f} triangles kept, {:.1f}% culled",
+                  triangles / n, pvs_triangles / n,
+                  100.0 * (1.0 - triangles / std::max(1.0, pvs_triangles)));
+    return 0;
+}
+
+// Looks around from the middle of every leaf of the map in eight
+// directions, testing every visible leaf against the frustum and walking
+// the nodes front to back. Both have to keep the same faces. The order is
+// measured as the share of kept leafs no nearer than the one before.
+static int bench_traversal(const std::vector<std::string> &args) {
+    auto _logger = logger();
+    Quake3Bsp bsp;
+    if(!bsp.read_bsp(map_path(args, 0))) return 1;
+    bsp.occlusion_cull(false);
+
+    std::vector<glm::vec3> mins, maxs;
+    for(const auto &leaf : bsp.leafs()) {
+        glm::vec3 a(leaf.min.x, leaf.min.y, leaf.min.z), b(leaf.max.x, leaf.max.y, leaf.max.z);
+        mins.push_back(glm::min(a, b));
+        maxs.push_back(glm::max(a, b));
+    }
+    auto positions = leaf_centres(bsp);
+    if(positions.empty()) return 1;
+    auto distance = [&](const glm::vec3 &pos, int leaf) {
+        glm::vec3 d = glm::max(glm::max(mins[leaf] - pos, pos - maxs[leaf]), glm::vec3(0.0f));
+        return glm::dot(d, d);
+    };
+
+    struct Variant {
+        bool walk_nodes;
+        const char *name;
+    };
+    const Variant variants[] = {
+        {false, "leafs"},
+        {true, "nodes"},
+    };
+    std::vector<std::vector<int>> reference;
+    for(const auto &variant : variants) {
+        bsp.walk_nodes(variant.walk_nodes);
+        RenderStats total = {};
+        double time = 0.0;
+        size_t frames = 0, pairs = 0, ordered = 0;
+        for(const auto &pos : positions) {
+            for(int direction = 0; direction < 8; direction++) {
+                auto frustum = view_frustum(pos, direction * 0.78539816f, 0.0f);
+                auto start = bench_clock::now();
+                bsp.build_frame(pos, frustum);
+                time += bench_ms(bench_clock::now() - start).count();
+
+                auto faces = bsp.visible_faces();
+                std::sort(faces.begin(), faces.end());
+                if(!variant.walk_nodes) reference.push_back(faces);
+                if(faces != reference[frames]) {
+                    _logger->error("traversal {}: frame {} keeps other faces", variant.name, frames);
+                    return 1;
+                }
+
+                const auto &leafs = bsp.visible_leafs();
+                for(size_t i = 1; i < leafs.size(); i++) {
+                    if(distance(pos, leafs[i]) >= distance(pos, leafs[i - 1])) ordered++;
+                }
+                pairs += leafs.empty() ? 0 : leafs.size() - 1;
+
+                const auto &stats = bsp.render_stats();
+                total.leafs_kept += stats.leafs_kept;
+                total.nodes_visited += stats.nodes_visited;
+                total.nodes_culled += stats.nodes_culled;
+                total.draw_calls += stats.draw_calls;
+                total.texture_binds += stats.texture_binds;
+                frames++;
+            }
+        }
+
+        double n = double(frames);
+        _logger->info("traversal {}: {} frames, build avg {:.4f} ms, {:.1f} leafs kept", variant.name,
+                      frames, time / n, total.leafs_kept / n);
+        _logger->info("traversal {}: avg {:.1f} nodes visited, {:.1f} culled with their subtree",
+                      variant.name, total.nodes_visited / n, total.nodes_culled / n);
+        _logger->info("traversal {}: {:.1f}% of leafs no nearer than the one before, "
+                      "{:.1f} draw calls, {:.1f} texture binds", variant.name,
+                      100.0 * ordered / std::max<size_t>(1, pairs), total.draw_calls / n,
+                      total.texture_binds / n);
+    }
+    return 0;
+}
+
+// Checks the SIMD occlusion rasterisers against the scalar one on random
+// triangles and times them. Then looks around from the middle of every leaf
+// of the map in eight directions with and without the occlusion buffer.
+// Fails if the occluders hide a face the frustum keeps alone, or a leaf
+// whose middle is on the screen with nothing solid in between.
+static int bench_occlusion(const std::vector<std::string> &args) {
+    auto _logger = logger();
+    const sys::Isa isas[] = { sys::Isa::Scalar, sys::Isa::SSE2, sys::Isa::AVX2 };
+
+    std::mt19937 random(1);
+    std::uniform_real_distribution<float> coord(-512.0f, 512.0f);
+    std::uniform_real_distribution<float> angle(0.0f, 6.2831853f);
+    sys::OcclusionBuffer buffer(Config::occlusion_width(), Config::occlusion_height());
+    const size_t views = 64, triangles = 256;
+    std::vector<std::vector<float>> reference(views);
+    for(auto isa : isas) {
+        if(!sys::is_supported(isa)) continue;
+        for(auto pool : { (sys::ThreadPool *)nullptr, &sys::ThreadPool::global() }) {
+            std::mt19937 scene(2);
+            double time = 0.0;
+            size_t drawn = 0;
+            for(size_t view = 0; view < views; view++) {
+                buffer.clear(view_projection(glm::vec3(0.0f), angle(scene), 0.0f));
+                for(size_t i = 0; i < triangles; i++) {
+                    glm::vec3 corner(coord(scene), coord(scene) * 0.25f, coord(scene));
+                    buffer.add_triangle(corner, corner + glm::vec3(coord(scene), 0.0f, 0.0f) * 0.5f,
+                                        corner + glm::vec3(0.0f, coord(scene), coord(scene)) * 0.5f);
+                }
+                buffer.rasterize(pool, isa);
+                time += buffer.stats().raster_ms;
+                drawn += buffer.stats().triangles;
+
+                std::vector<float> depth(buffer.depth(), buffer.depth() + buffer.width() * buffer.height());
+                if(reference[view].empty()) reference[view] = depth;
+                if(depth != reference[view]) {
+                    _logger->error("occlusion {}: view {} differs from the scalar version",
+                                   sys::isa_name(isa), view);
+                    return 1;
+                }
+            }
+            _logger->info("occlusion {}{}: {}x{} buffer, {:.4f} ms for {:.0f} triangles",
+                          sys::isa_name(isa), pool ? " pool" : "", buffer.width(), buffer.height(),
+                          time / views, double(drawn) / views);
+        }
+    }
+
+    Quake3Bsp bsp;
+    if(!bsp.read_bsp(map_path(args, 0))) return 1;
+    auto positions = leaf_centres(bsp);
+    if(positions.empty()) return 1;
+    const auto &leafs = bsp.leafs();
+
+    double frustum_time = 0, time = 0, occlusion_time = 0;
+    double frustum_faces = 0, faces = 0, frustum_leafs = 0, occluded = 0, occluders = 0;
+    size_t frames = 0;
+    for(const auto &pos : positions) {
+        for(int direction = 0; direction < 8; direction++) {
+            glm::mat4 matrix = view_projection(pos, direction * 0.78539816f, 0.0f);
+            sys::Frustum frustum(matrix);
+            bsp.view_projection(matrix);
+
+            bsp.occlusion_cull(false);
+            auto start = bench_clock::now();
+            bsp.build_frame(pos, frustum);
+            frustum_time += bench_ms(bench_clock::now() - start).count();
+            auto reference_faces = bsp.visible_faces();
+            auto reference_leafs = bsp.visible_leafs();
+            std::sort(reference_faces.begin(), reference_faces.end());
+            std::sort(reference_leafs.begin(), reference_leafs.end());
+            frustum_faces += reference_faces.size();
+            frustum_leafs += reference_leafs.size();
+
+            bsp.occlusion_cull(true);
+            start = bench_clock::now();
+            bsp.build_frame(pos, frustum);
+            time += bench_ms(bench_clock::now() - start).count();
+            auto kept = bsp.visible_faces();
+            std::sort(kept.begin(), kept.end());
+            if(!std::includes(reference_faces.begin(), reference_faces.end(), kept.begin(), kept.end())) {
+                _logger->error("occlusion: frame {} draws faces the frustum culls", frames);
+                return 1;
+            }
+
+            // The middle of a hidden leaf on the screen has to be behind a brush
+            auto kept_leafs = bsp.visible_leafs();
+            std::sort(kept_leafs.begin(), kept_leafs.end());
+            std::vector<int> hidden;
+            std::set_difference(reference_leafs.begin(), reference_leafs.end(), kept_leafs.begin(),
+                                kept_leafs.end(), std::back_inserter(hidden));
+            for(int leaf : hidden) {
+                glm::vec3 middle((leafs[leaf].min.x + leafs[leaf].max.x) * 0.5f,
+                                 (leafs[leaf].min.y + leafs[leaf].max.y) * 0.5f,
+                                 (leafs[leaf].min.z + leafs[leaf].max.z) * 0.5f);
+                glm::vec4 clip = matrix * glm::vec4(middle, 1.0f);
+                if(clip.w <= 0.0f || std::fabs(clip.x) > clip.w || std::fabs(clip.y) > clip.w) continue;
+                glm::vec3 end = bsp.trace_ray(pos, middle);
+                if(end.x == middle.x && end.y == middle.y && end.z == middle.z) {
+                    _logger->error("occlusion: frame {} hides leaf {} in plain sight", frames, leaf);
+                    return 1;
+                }
+            }
+
+            const auto &stats = bsp.render_stats();
+            faces += stats.faces;
+            occluded += stats.leafs_occluded;
+            occluders += stats.occluders;
+            occlusion_time += stats.occlusion_ms;
+            frames++;
+        }
+    }
+
+    double n = double(frames);
+    _logger->info("occlusion: {} frames, build avg {:.4f} ms with the frustum, {:.4f} ms with "
+                  "occlusion, of which {:.4f} ms drawing and testing", frames, frustum_time / n,
+                  time / n, occlusion_time / n);
+    _logger->info("occlusion: avg {:.1f} occluders hid {:.1f} of {:.1f} leafs in the frustum",
+                  occluders / n, occluded / n, frustum_leafs / n);
+    _logger->info("occlusion: avg {:.1f} of {:.1f} faces kept, {:.1f}% culled", faces / n,
+                  frustum_faces / n, 100.0 * (1.0 - faces / std::max(1.0, frustum_faces)));
+    return 0;
+}
+
+// Checks every cluster pair of the word rows, plain and compressed, against
+// the bytes of the vis lump, then times the visible leafs of every cluster
+// looked up one leaf at a time and gathered a word at a time
+static int bench_pvs(const std::vector<std::string> &args) {
+    auto _logger = logger();
+    int iterations = std::max(1, arg_int(args, 1, 20));
+    Quake3Bsp bsp;
+    if(!bsp.read_bsp(map_path(args, 0))) return 1;
+
+    const auto &vis = bsp.vis_data();
+    if(vis.bitsets.empty()) {
+        _logger->error("pvs: the map has no vis data");
+        return 1;
+    }
+    auto byte_visible = [&](int from, int to) {
+        if(from < 0) return true;
+        if(to < 0) return false;
+        return (vis.bitsets[from * vis.bytes_per_cluster + to / 8] & (1 << (to & 7))) != 0;
+    };
+
+    sys::Pvs plain, compressed;
+    plain.reset(vis.clusters_num, vis.bytes_per_cluster, vis.bitsets.data(), false);
+    compressed.reset(vis.clusters_num, vis.bytes_per_cluster, vis.bitsets.data(), true);
+    for(int from = -1; from < vis.clusters_num; from++) {
+        for(int to = -1; to < vis.clusters_num; to++) {
+            bool expected = byte_visible(from, to);
+            if(plain.visible(from, to) != expected || compressed.visible(from, to) != expected) {
+                _logger->error("pvs: cluster {} from {} differs", to, from);
+                return 1;
+            }
+        }
+    }
+    _logger->info("pvs: {} clusters, {} bytes per row, {} words per row", vis.clusters_num,
+                  vis.bytes_per_cluster, plain.words());
+    _logger->info("pvs: lump {} bytes, rows {} bytes, compressed {} bytes{}", vis.bitsets.size(),
+                  plain.memory(), compressed.memory(),
+                  compressed.is_compressed() ? "" : " (kept plain, it would grow)");
+
+    const auto &leaf_clusters = bsp.leaf_clusters();
+    size_t leafs_num = leaf_clusters.size();
+    std::vector<uint64_t> leaf_bits(sys::Pvs::words_for(leafs_num)), bulk_bits(leaf_bits.size());
+    struct Variant {
+        const sys::Pvs *pvs;
+        const char *name;
+    };
+    const Variant variants[] = {
+        {nullptr, "per leaf"},
+        {&plain, "words"},
+        {&compressed, "compressed words"},
+    };
+    for(const auto &variant : variants) {
+        size_t visible = 0;
+        auto start = bench_clock::now();
+        for(int pass = 0; pass < iterations; pass++) {
+            for(int from = 0; from < vis.clusters_num; from++) {
+                if(variant.pvs != nullptr) {
+                    visible += variant.pvs->visible_leafs(from, leaf_clusters.data(), leafs_num,
+                                                          bulk_bits.data());
+                    continue;
+                }
+                std::fill(leaf_bits.begin(), leaf_bits.end(), 0);
+                for(size_t i = 0; i < leafs_num; i++) {
+                    if(!byte_visible(from, leaf_clusters[i])) continue;
+                    leaf_bits[i / 64] |= uint64_t(1) << (i % 64);
+                    visible++;
+                }
+            }
+        }
+        double time = bench_ms(bench_clock::now() - start).count();
+
+        // The last row of both must agree bit for bit
+        if(variant.pvs != nullptr && bulk_bits != leaf_bits) {
+            _logger->error("pvs {}: the visible leafs differ", variant.name);
+            return 1;
+        }
+        size_t queries = size_t(iterations) * vis.clusters_num;
+        _logger->info("pvs {}: {} clusters x {} leafs, avg {:.4f} ms per cluster, {:.1f} leafs visible",
+                      variant.name, queries, leafs_num, time / queries, double(visible) / queries);
+    }
+    return 0;
+}
+
+// Closes every area portal of the map in turn and builds the frames seen
+// from its leafs. Fails if a frame keeps a leaf the PVS or the open portals
+// hide, or loses one they don't.
+static int bench_areas(const std::vector<std::string> &args) {
+    auto _logger = logger();
+    Quake3Bsp bsp;
+    if(!bsp.read_bsp(map_path(args, 0))) return 1;
+
+    const auto &areas = bsp.area_portals();
+    const auto &leafs = bsp.leafs();
+    _logger->info("areas: {} areas, {} portals", areas.areas(), areas.portals().size());
+    for(const auto &portal : areas.portals()) {
+        _logger->info("areas: portal between {} and {} at ({:.0f} {:.0f} {:.0f}) ({:.0f} {:.0f} {:.0f})",
+                      portal.area1, portal.area2, portal.min.x, portal.min.y, portal.min.z,
+                      portal.max.x, portal.max.y, portal.max.z);
+    }
+
+    std::vector<int> cameras;
+    std::vector<glm::vec3> positions;
+    for(size_t i = 0; i < leafs.size(); i++) {
+        if(leafs[i].cluster < 0) continue;
+        glm::vec3 a(leafs[i].min.x, leafs[i].min.y, leafs[i].min.z);
+        glm::vec3 b(leafs[i].max.x, leafs[i].max.y, leafs[i].max.z);
+        cameras.push_back(i);
+        positions.push_back((glm::min(a, b) + glm::max(a, b)) * 0.5f);
+    }
+
+    // Leaving every portal open first, then closing one at a time
+    bsp.visibility_cache_size(0);
+    for(int closed = -1; closed < int(areas.portals().size()); closed++) {
+        if(closed >= 0) {
+            const auto &portal = areas.portals()[closed];
+            bsp.area_portal(portal.min, portal.max, false);
+        }
+
+        double time = 0.0, faces = 0.0, triangles = 0.0, area_culled = 0.0;
+        size_t in_pvs = 0;
+        for(size_t i = 0; i < positions.size(); i++) {
+            auto start = bench_clock::now();
+            bsp.build_frame(positions[i]);
+            time += bench_ms(bench_clock::now() - start).count();
+
+            const BSPLeaf &camera = leafs[bsp.find_leaf(positions[i])];
+            std::vector<int> expected;
+            for(size_t leaf = 0; leaf < leafs.size(); leaf++) {
+                if(bsp.pvs().visible(camera.cluster, leafs[leaf].cluster) &&
+                   areas.connected(camera.area, leafs[leaf].area)) {
+                    expected.push_back(leaf);
+                }
+            }
+            auto kept = bsp.visible_leafs();
+            std::sort(kept.begin(), kept.end());
+            if(kept != expected) {
+                _logger->error("areas: leaf {} keeps {} leafs instead of {}", cameras[i], kept.size(),
+                               expected.size());
+                return 1;
+            }
+
+            const auto &stats = bsp.render_stats();
+            faces += stats.faces;
+            triangles += stats.triangles;
+            area_culled += stats.leafs_area_culled;
+
+            const glm::vec3 &other = positions[(i * 7 + 3) % positions.size()];
+            if(bsp.in_pvs(positions[i], other)) in_pvs++;
+        }
+
+        double n = double(positions.size());
+        std::string name = closed < 0 ? std::string("all open")
+                                      : "portal " + std::to_string(closed) + " closed";
+        _logger->info("areas {}: build avg {:.4f} ms, avg {:.1f} faces, {:.1f} triangles, "
+                      "{:.1f} leafs behind closed portals, {:.1f}% of point pairs in the PVS",
+                      name, time / n, faces / n, triangles / n, area_culled / n, 100.0 * in_pvs / n);
+        if(closed >= 0) bsp.area_portal(size_t(closed), true);
+    }
+    return 0;
+}
+
+// Streams kilobytes of vertices every frame and draws them as points in a
+// hidden window, through one buffer updated with glBufferSubData, one
+// orphaned with glBufferData, and the stream buffer ring both ways. The
+// single buffer has to wait for the draws of the frame before. Reports the
+// CPU time of a frame.
+static int bench_streaming(const std::vector<std::string> &args) {
+    using render::StreamBuffer;
+    auto _logger = logger();
+    int frames = std::max(1, arg_int(args, 0, 1000));
+    size_t bytes = size_t(std::max(1, arg_int(args, 1, 1024))) * 1024;
+
+    if(SDL_Init(SDL_INIT_EVERYTHING) != 0) {
+        _logger->error("streaming: SDL_Init failed: {}", SDL_GetError());
+        return 1;
+    }
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+    SDL_Window *window = SDL_CreateWindow("bench", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+                                          256, 256, SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
+    SDL_GLContext context = window != nullptr ? SDL_GL_CreateContext(window) : nullptr;
+    glewExperimental = GL_TRUE;
+    if(context == nullptr || glewInit() != GLEW_OK) {
+        _logger->error("streaming: no OpenGL context: {}", SDL_GetError());
+        if(window != nullptr) SDL_DestroyWindow(window);
+        SDL_Quit();
+        return 1;
+    }
+    SDL_GL_SetSwapInterval(0);
+
+    size_t points = bytes / sizeof(glm::vec3);
+    std::vector<glm::vec3> source(points), staging(points);
+    std::mt19937 random(7);
+    std::uniform_real_distribution<float> coordinate(-1.0f, 1.0f);
+    for(auto &point : source) point = glm::vec3(coordinate(random), coordinate(random), 0.0f);
+
+    // The data is new every frame, like a visible index list
+    auto fill = [&](glm::vec3 *out, int frame) {
+        float shift = (frame % 100) * 0.001f;
+        for(size_t i = 0; i < points; i++) {
+            out[i] = glm::vec3(source[i].x + shift, source[i].y, source[i].z);
+        }
+    };
+
+    GLuint array = 0;
+    glGenVertexArrays(1, &array);
+    glBindVertexArray(array);
+    glEnableClientState(GL_VERTEX_ARRAY);
+
+    enum Method { SubData, Orphan, RingSubData, RingPersistent };
+    const std::pair<Method, const char *> methods[] = {
+        {SubData, "glBufferSubData"},
+        {Orphan, "orphaned glBufferData"},
+        {RingSubData, "ring glBufferSubData"},
+        {RingPersistent, "ring persistent"},
+    };
+    int result = 0;
+    for(const auto &method : methods) {
+        GLuint plain = 0;
+        StreamBuffer ring;
+        bool is_ring = method.first == RingSubData || method.first == RingPersistent;
+        if(is_ring) {
+            auto mode = method.first == RingPersistent ? StreamBuffer::Mode::Persistent
+                                                       : StreamBuffer::Mode::SubData;
+            if(!ring.init(bytes, 3, mode)) {
+                result = 1;
+                break;
+            }
+            if(ring.mode() != mode) {
+                _logger->info("streaming {}: not supported by the context", method.second);
+                continue;
+            }
+        } else {
+            glGenBuffers(1, &plain);
+            glBindBuffer(GL_ARRAY_BUFFER, plain);
+            glBufferData(GL_ARRAY_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+        }
+        glFinish();
+
+        double total = 0.0, slowest = 0.0;
+        for(int frame = 0; frame < frames; frame++) {
+            auto start = bench_clock::now();
+            size_t offset = 0;
+            if(is_ring) {
+                ring.begin_frame();
+                auto range = ring.allocate(points * sizeof(glm::vec3));
+                fill(reinterpret_cast<glm::vec3 *>(range.data), frame);
+                ring.commit(range);
+                glBindBuffer(GL_ARRAY_BUFFER, range.buffer);
+                offset = range.offset;
+            } else {
+                fill(staging.data(), frame);
+                glBindBuffer(GL_ARRAY_BUFFER, plain);
+                if(method.first == Orphan) glBufferData(GL_ARRAY_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+                glBufferSubData(GL_ARRAY_BUFFER, 0, points * sizeof(glm::vec3), staging.data());
+            }
+            glVertexPointer(3, GL_FLOAT, 0, reinterpret_cast<const void *>(offset));
+            glClear(GL_COLOR_BUFFER_BIT);
+            glDrawArrays(GL_POINTS, 0, points);
+            if(is_ring) ring.end_frame();
+            SDL_GL_SwapWindow(window);
+
+            double time = bench_ms(bench_clock::now() - start).count();
+            total += time;
+            slowest = std::max(slowest, time);
+        }
+        glFinish();
+
+        _logger->info("streaming {}: {} frames of {} KiB, avg {:.3f} ms, slowest {:.3f} ms per frame",
+                      method.second, frames, bytes / 1024, total / frames, slowest);
+        if(is_ring) {
+            const auto &stats = ring.stats();
+            _logger->info("streaming {}: {} waits for the GPU, {:.3f} ms, {} overflows",
+                          method.second, stats.waits, stats.wait_ms, stats.overflows);
+        }
+        if(plain != 0) glDeleteBuffers(1, &plain);
+    }
+
+    glBindVertexArray(0);
+    glDeleteVertexArrays(1, &array);
+    SDL_GL_DeleteContext(context);
+    SDL_DestroyWindow(window);
+    SDL_Quit();
+    return result;
+}
+
+// Traces of every type, from the middle of random leafs of the map in
+// random directions, the same ones for every run
+static std::vector<TraceDesc> random_traces(const Quake3Bsp &bsp, size_t count,
+                                            float min_length = 64.0f, float max_length = 1024.0f) {
+    auto positions = leaf_centres(bsp);
+    std::vector<TraceDesc> descs;
+    if(positions.empty()) return descs;
+
+    std::mt19937 random(7);
+    std::uniform_int_distribution<size_t> leaf(0, positions.size() - 1);
+    std::uniform_real_distribution<float> axis(-1.0f, 1.0f);
+    std::uniform_real_distribution<float> length(min_length, max_length);
+    descs.resize(count);
+    for(size_t i = 0; i < count; i++) {
+        TraceDesc &desc = descs[i];
+        desc = {};
+        desc.type = int(i % 3);
+        desc.start = positions[leaf(random)];
+        glm::vec3 direction(axis(random), axis(random) * 0.25f, axis(random));
+        desc.end = desc.start + glm::normalize(direction + glm::vec3(0.0f, 0.0f, 1e-3f)) * length(random);
+        desc.radius = 16.0f;
+        desc.mins = glm::vec3(-15, -40, -15);
+        desc.maxs = glm::vec3(15, 40, 15);
+        desc.contents = CONTENTS_SOLID;
+    }
+    return descs;
+}
+
+static bool same_result(const TraceResult &a, const TraceResult &b) {
+    return a.fraction == b.fraction && a.end_pos == b.end_pos && a.plane.normal == b.plane.normal &&
+           a.plane.d == b.plane.d && a.start_solid == b.start_solid && a.all_solid == b.all_solid &&
+           a.contents == b.contents;
+}
+
+// Moves count rays, spheres and boxes through the map with the old calls,
+// which slide along what they hit, then traces them one by one and in
+// batches on 1 to threads threads. Last it counts the brushes long traces
+// check with and without the brush mailbox, and times them testing the
+// brush sides with every instruction set, with and without brush boxes.
+// Fails if a batch gives other results than the traces one by one, or a
+// long trace other results than with the mailbox, boxes and best SIMD.
+static int bench_traces(const std::vector<std::string> &args) {
+    auto _logger = logger();
+    size_t count = size_t(std::max(1, arg_int(args, 1, 100000)));
+    size_t threads = size_t(std::max(1, arg_int(args, 2, int(std::max(4u, std::thread::hardware_concurrency())))));
+
+    Quake3Bsp bsp;
+    if(!bsp.read_bsp(map_path(args, 0))) return 1;
+    auto descs = random_traces(bsp, count);
+    if(descs.empty()) return 1;
+
+    auto start = bench_clock::now();
+    for(const auto &desc : descs) {
+        if(desc.type == TYPE_RAY) bsp.trace_ray(desc.start, desc.end);
+        else if(desc.type == TYPE_SPHERE) bsp.trace_sphere(desc.start, desc.end, desc.radius);
+        else bsp.trace_box(desc.start, desc.end, desc.mins, desc.maxs);
+    }
+    double moves = bench_ms(bench_clock::now() - start).count();
+    _logger->info("traces: {} moves with trace_ray, trace_sphere and trace_box in {:.2f} ms, "
+                  "{:.3f} us each", count, moves, moves * 1e3 / count);
+
+    std::vector<TraceResult> reference(count), results(count);
+    start = bench_clock::now();
+    for(size_t i = 0; i < count; i++) reference[i] = bsp.trace(descs[i]);
+    double single = bench_ms(bench_clock::now() - start).count();
+    size_t hits = 0, solid = 0;
+    double fractions = 0.0;
+    for(const auto &result : reference) {
+        hits += result.fraction < 1.0f;
+        solid += result.start_solid;
+        fractions += result.fraction;
+    }
+    _logger->info("traces: {} traces one by one in {:.2f} ms, {:.3f} us each, {:.1f}% hit, "
+                  "{:.1f}% start solid, fractions add up to {:.6f}", count, single, single * 1e3 / count,
+                  100.0 * hits / count, 100.0 * solid / count, fractions);
+
+    // Every type on its own, boxes are what moving things trace
+    const char *type_names[] = { "rays", "spheres", "boxes" };
+    for(int type = TYPE_RAY; type <= TYPE_BOX; type++) {
+        size_t traced = 0;
+        start = bench_clock::now();
+        for(size_t i = type; i < count; i += 3) {
+            results[i] = bsp.trace(descs[i]);
+            traced++;
+        }
+        double time = bench_ms(bench_clock::now() - start).count();
+        _logger->info("traces: {} {} one by one in {:.2f} ms, {:.3f} us each", traced, type_names[type],
+                      time, time * 1e3 / std::max<size_t>(traced, 1));
+    }
+
+    // The calling thread works too, so n threads take n - 1 workers
+    double one_thread = 0.0;
+    for(size_t n = 1; n <= threads; n++) {
+        std::unique_ptr<sys::ThreadPool> pool(n > 1 ? new sys::ThreadPool(n - 1) : nullptr);
+        std::fill(results.begin(), results.end(), TraceResult{});
+        start = bench_clock::now();
+        bsp.trace(descs.data(), results.data(), count, pool.get());
+        double time = bench_ms(bench_clock::now() - start).count();
+        if(n == 1) one_thread = time;
+
+        for(size_t i = 0; i < count; i++) {
+            if(!same_result(results[i], reference[i])) {
+                _logger->error("traces: trace {} on {} threads differs from tracing it alone", i, n);
+                return 1;
+            }
+        }
+        _logger->info("traces: batch on {} threads in {:.2f} ms, {:.2f}x one thread, {:.2f}x the moves",
+                      n, time, one_thread / time, moves / time);
+    }
+
+    // Long traces cross many leafs, and the brushes on the planes between
+    // them are in all of them
+    auto long_descs = random_traces(bsp, count, 1024.0f, 8192.0f);
+    std::vector<TraceResult> mailboxed(count);
+    for(bool mailbox : { false, true }) {
+        bsp.brush_mailbox(mailbox);
+        std::vector<TraceResult> &long_results = mailbox ? mailboxed : results;
+        start = bench_clock::now();
+        for(size_t i = 0; i < count; i++) long_results[i] = bsp.trace(long_descs[i]);
+        double time = bench_ms(bench_clock::now() - start).count();
+
+        size_t tests = 0, most = 0;
+        for(const auto &result : long_results) {
+            tests += size_t(result.brush_tests);
+            most = std::max(most, size_t(result.brush_tests));
+        }
+        _logger->info("traces: {} long traces {} the brush mailbox in {:.2f} ms, {:.3f} us each, "
+                      "{:.1f} brush tests each, {} at most", count, mailbox ? "with" : "without",
+                      time, time * 1e3 / count, double(tests) / count, most);
+    }
+    for(size_t i = 0; i < count; i++) {
+        if(!same_result(mailboxed[i], results[i])) {
+            _logger->error("traces: long trace {} differs with the brush mailbox", i);
+            return 1;
+        }
+    }
+
+    // The brush sides tested by every instruction set, with and without
+    // rejecting the brushes whose box the trace misses
+    const sys::Isa isas[] = {
+        sys::Isa::Scalar, sys::Isa::SSE2, sys::Isa::AVX2,
+    };
+    double scalar_time = 0.0;
+    for(bool bounds : { false, true }) {
+        bsp.brush_bounds(bounds);
+        for(auto isa : isas) {
+            if(!sys::is_supported(isa)) continue;
+            bsp.trace_isa(isa);
+            start = bench_clock::now();
+            for(size_t i = 0; i < count; i++) results[i] = bsp.trace(long_descs[i]);
+            double time = bench_ms(bench_clock::now() - start).count();
+            if(!bounds && isa == sys::Isa::Scalar) scalar_time = time;
+
+            for(size_t i = 0; i < count; i++) {
+                if(!same_result(results[i], mailboxed[i])) {
+                    _logger->error("traces: long trace {} differs testing the sides with {}{}", i,
+                                   sys::isa_name(isa), bounds ? " and brush boxes" : "");
+                    return 1;
+                }
+            }
+            _logger->info("traces: long traces testing the sides with {}{} in {:.2f} ms, {:.3f} us each, "
+                          "{:.2f}x scalar", sys::isa_name(isa), bounds ? " and brush boxes" : "",
+                          time, time * 1e3 / count, scalar_time / time);
+        }
+    }
+    bsp.trace_isa(sys::best_isa());
+    return 0;
+}
+
+// Checks every SIMD version of the image operations against the scalar
+// reference on all 2^24 colours, then times them on lightmap sized images.
+// Fails if any byte differs.
+static int bench_image(const std::vector<std::string> &args) {
+    using sys::ImageOps;
+    auto _logger = logger();
+    int iterations = std::max(1, arg_int(args, 0, 100));
+
+    struct Operation {
+        const char *name;
+        std::function<void(uint8_t*, size_t, sys::Isa)> run;
+    };
+    const Operation operations[] = {
+        {"gamma 3", [](uint8_t *rgb, size_t pixels, sys::Isa isa) {
+            ImageOps::gamma(rgb, pixels, 3.0f, isa);
+        }},
+        {"gamma 1.7", [](uint8_t *rgb, size_t pixels, sys::Isa isa) {
+            ImageOps::gamma(rgb, pixels, 1.7f, isa);
+        }},
+        {"gamma 0.5", [](uint8_t *rgb, size_t pixels, sys::Isa isa) {
+            ImageOps::gamma(rgb, pixels, 0.5f, isa);
+        }},
+        {"overbright 1", [](uint8_t *rgb, size_t pixels, sys::Isa isa) {
+            ImageOps::overbright(rgb, pixels, 1, isa);
+        }},
+        {"overbright 2", [](uint8_t *rgb, size_t pixels, sys::Isa isa) {
+            ImageOps::overbright(rgb, pixels, 2, isa);
+        }},
+        {"greyscale", [](uint8_t *rgb, size_t pixels, sys::Isa isa) {
+            ImageOps::greyscale(rgb, pixels, isa);
+        }},
+    };
+    const sys::Isa isas[] = {
+        sys::Isa::Scalar, sys::Isa::SSE2, sys::Isa::AVX2,
+    };
+
+    // Every colour once, with an odd pixel count so the scalar tails run too
+    const size_t colours = 1 << 24;
+    std::vector<uint8_t> source((colours + 7) * 3);
+    for(size_t i = 0; i < source.size() / 3; i++) {
+        source[i * 3 + 0] = i & 0xff;
+        source[i * 3 + 1] = (i >> 8) & 0xff;
+        source[i * 3 + 2] = (i >> 16) & 0xff;
+    }
+
+    // The same amount of texels as 64 lightmaps
+    const size_t lightmap_pixels = 64 * 128 * 128;
+    std::vector<uint8_t> lightmaps(source.begin(), source.begin() + lightmap_pixels * 3);
+
+    _logger->info("image: best instruction set {}", sys::isa_name(sys::best_isa()));
+    for(const auto &operation : operations) {
+        std::vector<uint8_t> reference = source;
+        operation.run(reference.data(), reference.size() / 3, sys::Isa::Scalar);
+
+        double scalar_time = 0.0;
+        for(auto isa : isas) {
+            if(!sys::is_supported(isa)) continue;
+
+            std::vector<uint8_t> result = source;
+            operation.run(result.data(), result.size() / 3, isa);
+            if(result != reference) {
+                auto mismatch = std::mismatch(result.begin(), result.end(), reference.begin());
+                size_t pixel = (mismatch.first - result.begin()) / 3;
+                _logger->error("image {} {}: pixel {} differs from the scalar version",
+                               operation.name, sys::isa_name(isa), pixel);
+                return 1;
+            }
+
+            std::vector<uint8_t> image;
+            double total = 0.0;
+            for(int i = 0; i < iterations; i++) {
+                image = lightmaps;
+                auto start = bench_clock::now();
+                operation.run(image.data(), lightmap_pixels, isa);
+                total += bench_ms(bench_clock::now() - start).count();
+            }
+            if(isa == sys::Isa::Scalar) scalar_time = total;
+            _logger->info("image {} {}: avg {:.3f} ms, {:.2f}x scalar",
+                          operation.name, sys::isa_name(isa), total / iterations,
+                          scalar_time / total);
+        }
+    }
+    return 0;
+}
+
+std::vector<Bench::Entry> Bench::_benches = {
+    {"load", "[map] [iterations]", bench_load},
+    {"textures", "[map]", bench_textures},
+    {"image", "[iterations]", bench_image},
+    {"patches", "[map] [level] [iterations]", bench_patches},
+    {"patchlod", "[map] [steps]", bench_patch_lod},
+    {"batches", "[map] [positions]", bench_batches},
+    {"visibility", "[map] [frames]", bench_visibility},
+    {"frustum", "[map] [iterations]", bench_frustum},
+    {"traversal", "[map]", bench_traversal},
+    {"pvs", "[map] [iterations]", bench_pvs},
+    {"areas", "[map]", bench_areas},
+    {"streaming", "[frames] [kilobytes]", bench_streaming},
+    {"occlusion", "[map]", bench_occlusion},
+    {"traces", "[map] [count] [threads]", bench_traces},
+};
+
+int Bench::run(const std::string &name, const std::vector<std::string> &args) {
+    for(const auto &bench : _benches) {
+        if(bench.name == name) return bench.run(args);
+    }
+
+    auto _logger = logger();
+    _logger->error("Unknown benchmark {}, available:", name);
+    for(const auto &bench : _benches) {
+        _logger->error("  {} {}", bench.name, bench.usage);
+    }
+    return 1;
+}
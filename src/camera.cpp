@@ -78,11 +78,17 @@ void Camera::update(float mx, float my, float frame_interval) {
     glm::vec3 up = glm::cross( _right, _direction );
 
     // Projection matrix : 45° Field of View, 4:3 ratio, display range : 0.1 unit <-> 100 units
-    gluPerspective(90.0f, width / height, 0.1f, 10000.0f);
-
-    gluLookAt(_position.x, _position.y, _position.z,
-    _position.x + _direction.x, _position.y + _direction.y, _position.z + _direction.z,
-    up.x, up.y, up.z);
-
-
+    // Only the legacy renderer reads the fixed function matrix stacks
+    if(_render_backend == RenderBackend::Legacy) {
+        gluPerspective(90.0f, width / height, 0.1f, 10000.0f);
+
+        gluLookAt(_position.x, _position.y, _position.z,
+        _position.x + _direction.x, _position.y + _direction.y, _position.z + _direction.z,
+        up.x, up.y, up.z);
+    }
+
+    // The same matrices for the CPU side, the renderer culls with them and
+    // the shaders transform the level with them
+    _projection = glm::perspective(glm::radians(90.0f), width / height, 0.1f, 10000.0f);
+    _view = glm::lookAt(_position, _position + _direction, up);
 }
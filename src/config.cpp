@@ -16,9 +16,50 @@ std::string Config::_logger_name = "game";
 std::string Config::_window_title = "game";
 std::string Config::_data_path = "data/";
 std::string Config::_map_name = "q3dm1";
+std::string Config::_asset_manifest = "assets.manifest";
 std::string Config::_shader_path = Config::_data_path + "shaders/";
 size_t Config::_window_width = 1280;
 size_t Config::_window_height = 720;
+bool Config::_map_use_mmap = true;
+bool Config::_map_use_cache = true;
+size_t Config::_worker_threads = 0;
+int Config::_patch_level = 3;
+bool Config::_patch_lod = true;
+int Config::_patch_lod_min_level = 2;
+int Config::_patch_lod_max_level = 16;
+float Config::_patch_lod_distance = 256.0f;
+size_t Config::_visibility_cache_size = 64;
+bool Config::_frustum_cull = true;
+bool Config::_frustum_cull_faces = true;
+bool Config::_frustum_walk_nodes = true;
+int Config::_pvs_compress_clusters = 4096;
+bool Config::_occlusion_cull = true;
+size_t Config::_occlusion_width = 256;
+size_t Config::_occlusion_height = 128;
+size_t Config::_occluder_max_faces = 128;
+float Config::_occluder_min_size = 0.01f;
+RenderBackend Config::_render_backend = RenderBackend::Legacy;
+bool Config::_texture_streaming = true;
+double Config::_texture_upload_ms = 2.0;
+
+bool Config::parse_render_backend(const std::string &name, RenderBackend &backend) {
+    if(name == "legacy") {
+        backend = RenderBackend::Legacy;
+    } else if(name == "glsl") {
+        backend = RenderBackend::Glsl;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+const char *Config::render_backend_name(RenderBackend backend) {
+    switch(backend) {
+        case RenderBackend::Legacy: return "legacy";
+        case RenderBackend::Glsl:   return "glsl";
+    }
+    return "unknown";
+}
 
 bool Config::load(const std::string &filename) {
     std::ifstream f(filename);
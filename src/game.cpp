@@ -87,6 +87,9 @@ void Game::main_loop() {
 
     BspRender *r = dynamic_cast<decltype(r)>(e.renderer().get());
     assert(r != nullptr);
+
+    // The camera and the viewport follow the backend the level got
+    _view->render_backend(r->render_backend());
     bool noclip = true;
 
     glm::vec3 velocity = {0,0,0};
@@ -1,5 +1,9 @@
 #include <spdlog/spdlog.h>
 
+#include <string>
+#include <vector>
+
+#include <game/bench.h>
 #include <game/config.h>
 #include <game/game.h>
 
@@ -8,8 +12,21 @@ using namespace game;
 int main(int argc, char *argv[]){
     auto _logger = spdlog::stdout_color_mt(Config::logger_name());
     spdlog::set_level(spdlog::level::trace);
+    if(argc > 2 && std::string(argv[1]) == "--bench") {
+        return Bench::run(argv[2], std::vector<std::string>(argv + 3, argv + argc));
+    }
     Game game;
     if(argc > 1 && argv[1]) Config::map_name(argv[1]);
 
+    // "legacy" draws with the fixed function pipeline, "glsl" with shaders
+    if(argc > 2 && argv[2]) {
+        RenderBackend backend;
+        if(!Config::parse_render_backend(argv[2], backend)) {
+            _logger->critical("Unknown render backend {}, use legacy or glsl", argv[2]);
+            return 1;
+        }
+        Config::render_backend(backend);
+    }
+
     return game.start();
 }
@@ -11,16 +11,14 @@
 #include <game/render/bsp_render.h>
 #include <game/sys/glsl.h>
 #include <game/sys/quake3_bsp.h>
+#include <game/sys/frustum.h>
 
 using namespace game::render;
 
 static Quake3Bsp qbsp;
-
-// This will identify our vertex buffer
-static GLuint vertexbuffer;
-static GLuint elementbuffer;
-static GLuint uvbuffer;
-static GLuint normalbuffer;
+static RenderStats last_stats = {};
+static double submit_ms = 0.0;
+static int submit_frames = 0;
 
 static GLuint matrix_id;
 static GLuint texture_id;
@@ -37,31 +35,19 @@ bool BspRender::is_on_ground() {
     return qbsp.is_on_ground();
 }
 
+game::RenderBackend BspRender::render_backend() const {
+    return qbsp.render_backend();
+}
+
 void BspRender::prepare() {
     auto str = Config::data_path() + std::string("maps/") + _map_name + ".bsp";
+    qbsp.load_mode(Config::map_use_mmap() ? Quake3Bsp::LoadMode::Mapped
+                                          : Quake3Bsp::LoadMode::Stdio);
+    qbsp.render_backend(Config::render_backend());
     auto done = qbsp.load_bsp(str);
     _logger->debug("done {}", done);
 
-
-    //GLuint VertexArrayID;
-    //glGenVertexArrays(1, &VertexArrayID);
-    //glBindVertexArray(VertexArrayID);
-    /*
-    // Generate 1 buffer, put the resulting identifier in vertexbuffer
-    glGenBuffers(1, &vertexbuffer);
-    // The following commands will talk about our 'vertexbuffer' buffer
-    glBindBuffer(GL_ARRAY_BUFFER, vertexbuffer);
-    // Give our vertices to OpenGL.
-    glBufferData(GL_ARRAY_BUFFER, sizeof(g_vertex_buffer_data), g_vertex_buffer_data, GL_STATIC_DRAW);
-
-    glGenBuffers(1, &colorbuffer);
-    glBindBuffer(GL_ARRAY_BUFFER, colorbuffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(g_color_buffer_data), g_color_buffer_data, GL_STATIC_DRAW);
-    */
-    //glGenBuffers(1, &elementbuffer);
-    //glGenBuffers(1, &vertexbuffer);
-    //glGenBuffers(1, &uvbuffer);
-    //glGenBuffers(1, &normalbuffer);
+    // The level geometry was uploaded into static buffers by load_bsp()
 
     //matrix_id = glGetUniformLocation(sys::GLSL::program_id(), "MVP");
     //texture_id = glGetUniformLocation(sys::GLSL::program_id(), "texture_sampler");
@@ -77,9 +63,42 @@ BspRender::BspRender(std::string map_name) {
 }
 
 void BspRender::render(Viewport &view) {
-    // Model matrix : an identity matrix (model will be at the origin)
-    //qbsp.render(view.camera()->view(), view.camera()->position());
-    qbsp.render(view.camera()->position());
+    qbsp.update_textures();
+    qbsp.update_patches(view.camera()->position());
+
+    // The model matrix is an identity matrix, so the frustum planes are in
+    // world space too
+    auto camera = view.camera();
+    qbsp.view_projection(camera->projection() * camera->view());
+    if(Config::frustum_cull()) {
+        qbsp.render(camera->position(), sys::Frustum(camera->projection() * camera->view()));
+    } else {
+        qbsp.render(camera->position());
+    }
+
+    // The counts only change when the camera sees something else, so
+    // they are logged then instead of every frame
+    const auto &stats = qbsp.render_stats();
+    if(stats.faces != last_stats.faces || stats.draw_calls != last_stats.draw_calls) {
+        _logger->debug("Drew {} faces, {} triangles in {} draw calls ({} ranges) with {} texture binds",
+                       stats.faces, stats.triangles, stats.draw_calls, stats.ranges,
+                       stats.texture_binds);
+        _logger->debug("Frustum kept {} leafs and culled {}, culled {} more faces",
+                       stats.leafs_kept, stats.leafs_culled, stats.faces_culled);
+        _logger->debug("{} occluders hid {} more leafs in {:.3f} ms", stats.occluders,
+                       stats.leafs_occluded, stats.occlusion_ms);
+    }
+    last_stats = stats;
+
+    // The submit time is what the backends differ in, averaged to compare them
+    submit_ms += stats.submit_ms;
+    if(++submit_frames == 600) {
+        _logger->debug("The {} renderer took {:.3f} ms to submit a frame, averaged over {} frames",
+                       Config::render_backend_name(qbsp.render_backend()), submit_ms / submit_frames,
+                       submit_frames);
+        submit_ms = 0.0;
+        submit_frames = 0;
+    }
 
     // Our ModelViewProjection : multiplication of our 3 matrices
     //glm::mat4 mvp = Projection * View * Model; // Remember, matrix multiplication is the other way around
@@ -24,24 +24,33 @@ GLViewport::~GLViewport() {
 }
 
 bool GLViewport::init() {
-    _logger->info("Creating OpenGL context");
-    _context = SDL_GL_CreateContext(_window.window());
-    if(_context == nullptr) {
-        _last_error = SDL_GetError();
-        return false;
-    }
+    // The backend asked for, until the level says which one it got
+    _render_backend = Config::render_backend();
 
+    // The attributes only apply to contexts created after them. The
+    // shaders get a 3.3 core profile, the legacy renderer needs the fixed
+    // function pipeline of the default compatibility one.
     SDL_GL_LoadLibrary(NULL);
     SDL_GL_SetAttribute(SDL_GL_ACCELERATED_VISUAL, 1);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+    _is_core_profile = _render_backend == RenderBackend::Glsl;
+    if(_is_core_profile) {
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+    }
     SDL_GL_SetAttribute( SDL_GL_RED_SIZE, 5 );
     SDL_GL_SetAttribute( SDL_GL_GREEN_SIZE, 5 );
     SDL_GL_SetAttribute( SDL_GL_BLUE_SIZE, 5 );
     SDL_GL_SetAttribute( SDL_GL_DOUBLEBUFFER, 1 );
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
-
     SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 24);
+
+    _logger->info("Creating OpenGL context");
+    _context = SDL_GL_CreateContext(_window.window());
+    if(_context == nullptr) {
+        _last_error = SDL_GetError();
+        return false;
+    }
+
     _logger->info("GL info:");
     _logger->info("Version: {}", glGetString(GL_VERSION));
     _logger->info("Vendor: {}", glGetString(GL_VENDOR));
@@ -63,7 +72,8 @@ bool GLViewport::init() {
     glEnable(GL_DEPTH_TEST);
     // Accept fragment if it closer to the camera than the former one
     glDepthFunc(GL_LESS);
-    glEnable(GL_TEXTURE_2D);
+    bool is_legacy = _render_backend == RenderBackend::Legacy;
+    if(is_legacy) glEnable(GL_TEXTURE_2D);
 
     // Enable front face culling, since that's what Quake3 does
     glCullFace(GL_FRONT);
@@ -74,11 +84,14 @@ bool GLViewport::init() {
 
     glViewport(0, 0, _size.x, _size.y);
 
-    glMatrixMode(GL_PROJECTION);                        // Select The Projection Matrix
-    glLoadIdentity();                                   // Reset The Projection Matrix
+    // The shaders get their matrices as uniforms instead
+    if(is_legacy) {
+        glMatrixMode(GL_PROJECTION);                        // Select The Projection Matrix
+        glLoadIdentity();                                   // Reset The Projection Matrix
 
-    glMatrixMode(GL_MODELVIEW);                         // Select The Modelview Matrix
-    glLoadIdentity();                                   // Reset The Modelview Matrix
+        glMatrixMode(GL_MODELVIEW);                         // Select The Modelview Matrix
+        glLoadIdentity();                                   // Reset The Modelview Matrix
+    }
 
     //GLuint programID = sys::GLSL::load_shaders(Config::project_name() + ".vert", Config::project_name() + ".frag");
     //if(programID == 0) {
@@ -93,10 +106,26 @@ bool GLViewport::init() {
 
 void GLViewport::start_render() {
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glLoadIdentity();
+    if(_render_backend == RenderBackend::Legacy) glLoadIdentity();
 
 }
 
+void GLViewport::render_backend(RenderBackend backend) {
+    // Falling back from the shaders needs the fixed function state init()
+    // skipped for them, which their core profile context doesn't have
+    if(backend == RenderBackend::Legacy && _is_core_profile) {
+        _logger->error("The legacy renderer needs a compatibility context, run it with legacy instead");
+    } else if(backend == RenderBackend::Legacy && _render_backend != RenderBackend::Legacy) {
+        glEnable(GL_TEXTURE_2D);
+        glMatrixMode(GL_PROJECTION);
+        glLoadIdentity();
+        glMatrixMode(GL_MODELVIEW);
+        glLoadIdentity();
+    }
+    _render_backend = backend;
+    if(_camera) _camera->render_backend(backend);
+}
+
 void GLViewport::update_frame_rate() {
     static double fps   = 0.0f;
     static double last_time  = 0.0f;
@@ -0,0 +1,151 @@
+#include <chrono>
+
+#include <GL/glew.h>
+#ifdef __APPLE__
+#include <OpenGL/gl.h>
+#else
+#include <GL/gl.h>
+#endif
+
+#include <game/config.h>
+#include <game/render/stream_buffer.h>
+
+using namespace game;
+using namespace game::render;
+
+// One second, any longer and the GPU is most likely lost
+#define FENCE_TIMEOUT_NS 1000000000ull
+
+StreamBuffer::StreamBuffer() {
+}
+
+StreamBuffer::~StreamBuffer() {
+    destroy();
+}
+
+bool StreamBuffer::init(size_t section_size, size_t frames, Mode mode) {
+    // The logger is looked up here rather than when constructed, a static
+    // level would otherwise create it before main() does
+    if(_logger == nullptr) _logger = spdlog::get(Config::logger_name());
+    if(_logger == nullptr) _logger = spdlog::stdout_color_mt(Config::logger_name());
+
+    destroy();
+    if(section_size == 0 || frames == 0) return false;
+
+    _section_size = section_size;
+    _stats = {};
+    _fences.assign(frames, nullptr);
+    size_t size = section_size * frames;
+    glGenBuffers(1, &_buffer);
+    if(_buffer == 0) {
+        _logger->error("Failed to create a stream buffer of {} bytes", size);
+        return false;
+    }
+
+    // The copy target leaves the bindings of the vertex arrays alone
+    glBindBuffer(GL_COPY_WRITE_BUFFER, _buffer);
+    bool has_storage = GLEW_ARB_buffer_storage || GLEW_VERSION_4_4;
+    if(mode == Mode::Persistent && has_storage) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_COPY_WRITE_BUFFER, size, nullptr, flags);
+        _memory = static_cast<uint8_t *>(glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, size, flags));
+        if(_memory != nullptr) {
+            _mode = Mode::Persistent;
+            glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+            _logger->debug("Stream buffer of {} sections of {} bytes, persistently mapped",
+                           frames, section_size);
+            return true;
+        }
+
+        // Immutable storage can't be respecified, it takes a new buffer
+        _logger->warn("Failed to map the stream buffer persistently, uploading with glBufferSubData");
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        glDeleteBuffers(1, &_buffer);
+        glGenBuffers(1, &_buffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, _buffer);
+    } else if(mode == Mode::Persistent) {
+        _logger->info("No ARB_buffer_storage, the stream buffer is uploaded with glBufferSubData");
+    }
+
+    _mode = Mode::SubData;
+    glBufferData(GL_COPY_WRITE_BUFFER, size, nullptr, GL_STREAM_DRAW);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    _copy.assign(size, 0);
+    _memory = _copy.data();
+    _logger->debug("Stream buffer of {} sections of {} bytes, uploaded with glBufferSubData",
+                   frames, section_size);
+    return true;
+}
+
+void StreamBuffer::destroy() {
+    for(auto &fence : _fences) {
+        if(fence != nullptr) glDeleteSync(static_cast<GLsync>(fence));
+        fence = nullptr;
+    }
+    if(_buffer != 0) {
+        if(_mode == Mode::Persistent && _memory != nullptr) {
+            glBindBuffer(GL_COPY_WRITE_BUFFER, _buffer);
+            glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+            glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        }
+        glDeleteBuffers(1, &_buffer);
+    }
+    _buffer = 0;
+    _memory = nullptr;
+    _copy = std::vector<uint8_t>();
+    _fences.clear();
+    _section = 0;
+    _used = 0;
+}
+
+void StreamBuffer::begin_frame() {
+    _used = 0;
+    if(_fences.empty() || _fences[_section] == nullptr) return;
+
+    // Most of the time the GPU is frames ahead and the fence has long
+    // passed, only then the commands are flushed and the CPU blocks
+    auto fence = static_cast<GLsync>(_fences[_section]);
+    GLenum result = glClientWaitSync(fence, 0, 0);
+    if(result == GL_TIMEOUT_EXPIRED) {
+        auto start = std::chrono::steady_clock::now();
+        result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, FENCE_TIMEOUT_NS);
+        std::chrono::duration<double, std::milli> wait = std::chrono::steady_clock::now() - start;
+        _stats.waits++;
+        _stats.wait_ms += wait.count();
+        if(result == GL_TIMEOUT_EXPIRED || result == GL_WAIT_FAILED) {
+            _logger->warn("Stream buffer section {} is still in use after {:.0f} ms",
+                          _section, wait.count());
+        }
+    }
+    glDeleteSync(fence);
+    _fences[_section] = nullptr;
+}
+
+StreamBuffer::Range StreamBuffer::allocate(size_t size, size_t alignment) {
+    size_t offset = alignment > 1 ? (_used + alignment - 1) / alignment * alignment : _used;
+    if(_memory == nullptr || offset + size > _section_size) {
+        _stats.overflows++;
+        return { nullptr, _buffer, 0, 0 };
+    }
+
+    _used = offset + size;
+    _stats.bytes += size;
+    size_t start = _section * _section_size + offset;
+    return { _memory + start, _buffer, start, size };
+}
+
+void StreamBuffer::commit(const Range &range) {
+    // Coherent mappings are seen by the commands issued after the writes
+    if(_mode == Mode::Persistent || range.data == nullptr || range.size == 0) return;
+
+    glBindBuffer(GL_COPY_WRITE_BUFFER, _buffer);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, range.offset, range.size, range.data);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+void StreamBuffer::end_frame() {
+    if(_fences.empty()) return;
+    _fences[_section] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    _section = (_section + 1) % _fences.size();
+    _stats.frames++;
+}
@@ -0,0 +1,107 @@
+#include <algorithm>
+#include <numeric>
+
+#include <game/sys/area_portals.h>
+#include <game/sys/pvs.h>
+
+using namespace game::sys;
+
+void AreaPortals::reset(int areas_num) {
+    _areas = std::max(0, areas_num);
+    _portals.clear();
+    _version++;
+    flood();
+}
+
+void AreaPortals::add(int area1, int area2, const glm::vec3 &min, const glm::vec3 &max) {
+    if(area1 == area2 || area1 < 0 || area2 < 0 || area1 >= _areas || area2 >= _areas) return;
+    if(area1 > area2) std::swap(area1, area2);
+
+    for(auto &portal : _portals) {
+        if(portal.area1 == area1 && portal.area2 == area2) {
+            portal.min = glm::min(portal.min, min);
+            portal.max = glm::max(portal.max, max);
+            return;
+        }
+    }
+    _portals.push_back({ area1, area2, min, max, true });
+    _version++;
+    flood();
+}
+
+bool AreaPortals::open(size_t index, bool is_open) {
+    if(index >= _portals.size() || _portals[index].is_open == is_open) return false;
+    _portals[index].is_open = is_open;
+    _version++;
+    flood();
+    return true;
+}
+
+bool AreaPortals::open(int area1, int area2, bool is_open) {
+    if(area1 > area2) std::swap(area1, area2);
+    bool changed = false;
+    for(auto &portal : _portals) {
+        if(portal.area1 != area1 || portal.area2 != area2 || portal.is_open == is_open) continue;
+        portal.is_open = is_open;
+        changed = true;
+    }
+    if(!changed) return false;
+    _version++;
+    flood();
+    return true;
+}
+
+void AreaPortals::flood(std::vector<int> &groups, bool open_only) const {
+    // Union find over the portals, every group ends up named by its lowest area
+    groups.resize(_areas);
+    std::iota(groups.begin(), groups.end(), 0);
+    auto root = [&groups](int area) {
+        while(groups[area] != area) area = groups[area] = groups[groups[area]];
+        return area;
+    };
+    for(const auto &portal : _portals) {
+        if(open_only && !portal.is_open) continue;
+        int a = root(portal.area1), b = root(portal.area2);
+        if(a != b) groups[std::max(a, b)] = std::min(a, b);
+    }
+    for(int i = 0; i < _areas; i++) groups[i] = root(i);
+}
+
+void AreaPortals::flood() {
+    // The open portals only split the groups every portal makes, areas
+    // never linked by a portal stay as the PVS has them
+    flood(_linked, false);
+    flood(_groups, true);
+
+    _is_split = false;
+    for(int i = 0; i < _areas; i++) {
+        if(_groups[i] != _linked[i]) _is_split = true;
+    }
+}
+
+bool AreaPortals::connected(int area1, int area2) const {
+    if(area1 < 0 || area2 < 0 || area1 >= _areas || area2 >= _areas) return true;
+    return _linked[area1] != _linked[area2] || _groups[area1] == _groups[area2];
+}
+
+size_t AreaPortals::connected_leafs(int from, const int *leaf_areas, size_t leafs_num, uint64_t *leaf_bits) const {
+    size_t words = Pvs::words_for(leafs_num);
+    bool everything = !_is_split || from < 0 || from >= _areas;
+    int group = everything ? -1 : _groups[from];
+    int linked = everything ? -1 : _linked[from];
+
+    size_t connected = 0;
+    for(size_t w = 0; w < words; w++) {
+        uint64_t bits = 0;
+        size_t end = std::min(leafs_num, (w + 1) * 64);
+        for(size_t i = w * 64; i < end; i++) {
+            int area = leaf_areas[i];
+            bool is_connected = everything || area < 0 || area >= _areas || _linked[area] != linked ||
+                                _groups[area] == group;
+            bits |= uint64_t(is_connected) << (i % 64);
+        }
+        leaf_bits[w] = bits;
+        connected += __builtin_popcountll(bits);
+    }
+    return connected;
+}
@@ -0,0 +1,229 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <game/config.h>
+#include <game/sys/asset_index.h>
+
+#define MANIFEST_HEADER "ASSETS 1"
+#define MANIFEST_FOOTER "END"
+
+using namespace game;
+using namespace game::sys;
+
+static int64_t mtime_ns(const struct stat &st) {
+#ifdef __APPLE__
+    const auto &time = st.st_mtimespec;
+#else
+    const auto &time = st.st_mtim;
+#endif
+    return static_cast<int64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
+static std::string extension(const std::string &name) {
+    size_t slash = name.rfind('/');
+    size_t dot = name.rfind('.');
+    if(dot == std::string::npos || (slash != std::string::npos && dot < slash)) return "";
+    return name.substr(dot);
+}
+
+AssetIndex::AssetIndex() {
+    _logger = spdlog::get(Config::logger_name());
+    if(_logger == nullptr)
+        _logger = spdlog::stdout_color_mt(Config::logger_name());
+}
+
+int AssetIndex::rank(const std::string &name) const {
+    auto ext = extension(name);
+    for(size_t i = 0; i < _preferred.size(); i++) {
+        if(_preferred[i] == ext) return i;
+    }
+    return _preferred.size();
+}
+
+void AssetIndex::add(const std::string &name, uint64_t size) {
+    size_t index = _assets.size();
+    _assets.push_back({ name, _root + name, size });
+    _by_name[name] = index;
+
+    auto ext = extension(name);
+    if(ext.empty()) return;
+
+    // Several files may share a name without extension, the one with the
+    // most preferred extension wins
+    auto stem = name.substr(0, name.size() - ext.size());
+    auto found = _by_stem.find(stem);
+    if(found == _by_stem.end() || rank(name) < rank(_assets[found->second].name)) {
+        _by_stem[stem] = index;
+    }
+}
+
+bool AssetIndex::scan_directory(const std::string &name) {
+    std::string path = _root + name;
+    DIR *dir = opendir(path.empty() ? "." : path.c_str());
+    if(dir == nullptr) {
+        _logger->error("Failed to open directory {}: {}", path, strerror(errno));
+        return false;
+    }
+
+    struct stat st = {};
+    if(fstat(dirfd(dir), &st) == 0) _directories.push_back({ name, mtime_ns(st) });
+
+    std::vector<std::string> subdirectories;
+    while(struct dirent *entry = readdir(dir)) {
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        if(fstatat(dirfd(dir), entry->d_name, &st, 0) != 0) continue;
+
+        std::string child = name + entry->d_name;
+        if(S_ISDIR(st.st_mode)) {
+            subdirectories.emplace_back(child + "/");
+        } else if(S_ISREG(st.st_mode)) {
+            add(child, st.st_size);
+        }
+    }
+    closedir(dir);
+
+    for(const auto &subdirectory : subdirectories) scan_directory(subdirectory);
+    return true;
+}
+
+bool AssetIndex::load_manifest(const std::string &filename) {
+    std::ifstream f(filename);
+    if(!f.is_open()) return false;
+
+    std::string line;
+    if(!std::getline(f, line) || line != MANIFEST_HEADER) {
+        _logger->info("Asset manifest {} has an old format, rescanning", filename);
+        return false;
+    }
+
+    bool is_complete = false;
+    while(std::getline(f, line)) {
+        if(line == MANIFEST_FOOTER) {
+            is_complete = true;
+            break;
+        }
+        // Each line is "<kind> <number> <name>", names may contain spaces
+        std::istringstream fields(line);
+        char kind = 0;
+        long long number = 0;
+        if(!(fields >> kind >> number) || fields.get() != ' ') return false;
+        std::string name;
+        std::getline(fields, name);
+        if(name == ".") name.clear();
+
+        if(kind == 'D') {
+            _directories.push_back({ name, number });
+        } else if(kind == 'F') {
+            add(name, number);
+        } else {
+            return false;
+        }
+    }
+    if(!is_complete) {
+        _logger->warn("Asset manifest {} is truncated, rescanning", filename);
+        return false;
+    }
+
+    // Adding, removing or renaming a file changes the time of the directory
+    // holding it, so checking the directories is enough to trust the files
+    for(const auto &directory : _directories) {
+        struct stat st = {};
+        std::string path = _root + directory.name;
+        if(stat(path.empty() ? "." : path.c_str(), &st) != 0 || mtime_ns(st) != directory.mtime) {
+            _logger->info("Asset manifest {} is out of date, rescanning", filename);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool AssetIndex::save_manifest(const std::string &filename) const {
+    FILE *fp = fopen(filename.c_str(), "w");
+    if(fp == NULL) {
+        _logger->warn("Couldn't write asset manifest {}: {}", filename, strerror(errno));
+        return false;
+    }
+
+    fprintf(fp, "%s\n", MANIFEST_HEADER);
+    for(const auto &directory : _directories) {
+        fprintf(fp, "D %lld %s\n", static_cast<long long>(directory.mtime),
+                directory.name.empty() ? "." : directory.name.c_str());
+    }
+    for(const auto &asset : _assets) {
+        fprintf(fp, "F %llu %s\n", static_cast<unsigned long long>(asset.size), asset.name.c_str());
+    }
+    fprintf(fp, "%s\n", MANIFEST_FOOTER);
+
+    if(fclose(fp) != 0) {
+        _logger->warn("Couldn't write asset manifest {}: {}", filename, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool AssetIndex::open(const std::string &root, const std::string &manifest) {
+    _root = root;
+    if(!_root.empty() && _root.back() != '/') _root += '/';
+
+    auto reset = [this] {
+        _assets.clear();
+        _directories.clear();
+        _by_name.clear();
+        _by_stem.clear();
+    };
+    reset();
+
+    auto start = std::chrono::steady_clock::now();
+    std::string manifest_path = _root + manifest;
+    bool is_loaded = !manifest.empty() && load_manifest(manifest_path);
+    if(!is_loaded) {
+        reset();
+        if(!scan_directory("")) return false;
+
+        if(!manifest.empty() && save_manifest(manifest_path)) {
+            // Creating the manifest changed the root directory, record the
+            // new time so the next start doesn't rescan. Rewriting it in
+            // place doesn't change the directory again.
+            struct stat st = {};
+            std::string path = _root.empty() ? "." : _root;
+            if(!_directories.empty() && stat(path.c_str(), &st) == 0 &&
+               _directories[0].mtime != mtime_ns(st)) {
+                _directories[0].mtime = mtime_ns(st);
+                save_manifest(manifest_path);
+            }
+        }
+    }
+
+    std::chrono::duration<double, std::milli> time = std::chrono::steady_clock::now() - start;
+    _logger->info("Indexed {} assets in {} directories from {} in {:.2f} ms",
+                  _assets.size(), _directories.size(),
+                  is_loaded ? manifest_path : _root, time.count());
+    return true;
+}
+
+const AssetIndex::Asset *AssetIndex::find(const std::string &name) const {
+    auto found = _by_name.find(name);
+    if(found != _by_name.end()) return &_assets[found->second];
+
+    found = _by_stem.find(name);
+    if(found != _by_stem.end()) return &_assets[found->second];
+    return nullptr;
+}
+
+const AssetIndex &AssetIndex::global() {
+    static AssetIndex index;
+    static bool is_opened = [] {
+        index.preferred({ ".jpg", ".tga" });
+        return index.open(Config::data_path(), Config::asset_manifest());
+    }();
+    (void)is_opened;
+    return index;
+}
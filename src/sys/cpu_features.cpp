@@ -0,0 +1,33 @@
+#include <game/sys/cpu_features.h>
+
+namespace game {
+namespace sys {
+static Isa detect_isa() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) return Isa::AVX2;
+    if(__builtin_cpu_supports("sse2")) return Isa::SSE2;
+#endif
+    return Isa::Scalar;
+}
+
+Isa best_isa() {
+    static const Isa isa = detect_isa();
+    return isa;
+}
+
+bool is_supported(Isa isa) {
+    return static_cast<int>(isa) <= static_cast<int>(best_isa());
+}
+
+const char *isa_name(Isa isa) {
+    switch(isa) {
+        case Isa::Scalar: return "scalar";
+        case Isa::SSE2:   return "sse2";
+        case Isa::AVX2:   return "avx2";
+    }
+    return "unknown";
+}
+
+}
+}
@@ -0,0 +1,217 @@
+#include <cmath>
+
+#include <game/sys/frustum.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FRUSTUM_X86
+#include <immintrin.h>
+// AVX2 code is compiled per function, like the image operations
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+using namespace game::sys;
+
+void BoxArray::clear() {
+    min_x.clear(); min_y.clear(); min_z.clear();
+    max_x.clear(); max_y.clear(); max_z.clear();
+}
+
+void BoxArray::reserve(size_t count) {
+    min_x.reserve(count); min_y.reserve(count); min_z.reserve(count);
+    max_x.reserve(count); max_y.reserve(count); max_z.reserve(count);
+}
+
+void BoxArray::resize(size_t count) {
+    min_x.resize(count); min_y.resize(count); min_z.resize(count);
+    max_x.resize(count); max_y.resize(count); max_z.resize(count);
+}
+
+void BoxArray::set(size_t index, const glm::vec3 &min, const glm::vec3 &max) {
+    min_x[index] = min.x; min_y[index] = min.y; min_z[index] = min.z;
+    max_x[index] = max.x; max_y[index] = max.y; max_z[index] = max.z;
+}
+
+void BoxArray::push_back(const glm::vec3 &min, const glm::vec3 &max) {
+    min_x.push_back(min.x); min_y.push_back(min.y); min_z.push_back(min.z);
+    max_x.push_back(max.x); max_y.push_back(max.y); max_z.push_back(max.z);
+}
+
+void BoxArray::push_back(const BoxArray &other, size_t index) {
+    min_x.push_back(other.min_x[index]); min_y.push_back(other.min_y[index]);
+    min_z.push_back(other.min_z[index]); max_x.push_back(other.max_x[index]);
+    max_y.push_back(other.max_y[index]); max_z.push_back(other.max_z[index]);
+}
+
+Frustum::Frustum() {
+    for(auto &plane : _planes) plane = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+}
+
+Frustum::Frustum(const glm::mat4 &m) {
+    // glm matrices are column major, row i is m[0][i] m[1][i] m[2][i] m[3][i].
+    // A point is inside when -w <= x, y, z <= w in clip space, and each of
+    // those six inequalities is a plane in world space.
+    glm::vec4 rows[4];
+    for(int i = 0; i < 4; i++) rows[i] = glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+
+    _planes[PLANE_LEFT] = rows[3] + rows[0];
+    _planes[PLANE_RIGHT] = rows[3] - rows[0];
+    _planes[PLANE_BOTTOM] = rows[3] + rows[1];
+    _planes[PLANE_TOP] = rows[3] - rows[1];
+    _planes[PLANE_NEAR] = rows[3] + rows[2];
+    _planes[PLANE_FAR] = rows[3] - rows[2];
+
+    // Unit normals make the plane distances real distances
+    for(auto &plane : _planes) {
+        float length = std::sqrt(plane.x * plane.x + plane.y * plane.y + plane.z * plane.z);
+        if(length > 0.0f) plane = plane * (1.0f / length);
+    }
+}
+
+bool Frustum::operator==(const Frustum &other) const {
+    for(int i = 0; i < PLANES_NUM; i++) {
+        if(_planes[i] != other._planes[i]) return false;
+    }
+    return true;
+}
+
+// Every plane is tested against the box corner farthest along its normal,
+// the box is outside when even that corner is behind the plane. The corner
+// only depends on the signs of the normal, so each plane picks the min or
+// max array of every axis once for a whole batch of boxes.
+struct PlaneCorner {
+    const float *x, *y, *z;
+    float a, b, c, d;
+};
+
+static void plane_corners(const glm::vec4 *planes, const BoxArray &boxes, PlaneCorner *corners) {
+    for(int i = 0; i < Frustum::PLANES_NUM; i++) {
+        const glm::vec4 &p = planes[i];
+        corners[i].x = p.x >= 0.0f ? boxes.max_x.data() : boxes.min_x.data();
+        corners[i].y = p.y >= 0.0f ? boxes.max_y.data() : boxes.min_y.data();
+        corners[i].z = p.z >= 0.0f ? boxes.max_z.data() : boxes.min_z.data();
+        corners[i].a = p.x;
+        corners[i].b = p.y;
+        corners[i].c = p.z;
+        corners[i].d = p.w;
+    }
+}
+
+// Scalar reference, the SIMD versions add the products in the same order
+// and treat NaN distances as outside too
+static inline bool box_inside(const PlaneCorner *corners, size_t i) {
+    for(int p = 0; p < Frustum::PLANES_NUM; p++) {
+        const PlaneCorner &s = corners[p];
+        float distance = s.a * s.x[i] + s.b * s.y[i] + s.c * s.z[i] + s.d;
+        if(!(distance >= 0.0f)) return false;
+    }
+    return true;
+}
+
+static size_t test_scalar(const PlaneCorner *corners, size_t begin, size_t end, uint8_t *inside) {
+    size_t kept = 0;
+    for(size_t i = begin; i < end; i++) {
+        inside[i] = box_inside(corners, i);
+        kept += inside[i];
+    }
+    return kept;
+}
+
+#ifdef FRUSTUM_X86
+
+// 4 boxes per pass, returns the kept count of the boxes it tested, the
+// ones after the last whole pass are left to the scalar version
+static size_t test_sse2(const PlaneCorner *corners, size_t count, uint8_t *inside) {
+    const __m128 zero = _mm_setzero_ps();
+    size_t kept = 0;
+    for(size_t i = 0; i + 4 <= count; i += 4) {
+        __m128 keep = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for(int p = 0; p < Frustum::PLANES_NUM; p++) {
+            const PlaneCorner &s = corners[p];
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+                _mm_mul_ps(_mm_set1_ps(s.a), _mm_loadu_ps(s.x + i)),
+                _mm_mul_ps(_mm_set1_ps(s.b), _mm_loadu_ps(s.y + i))),
+                _mm_mul_ps(_mm_set1_ps(s.c), _mm_loadu_ps(s.z + i))),
+                _mm_set1_ps(s.d));
+            keep = _mm_and_ps(keep, _mm_cmpge_ps(distance, zero));
+        }
+        int mask = _mm_movemask_ps(keep);
+        for(int k = 0; k < 4; k++) inside[i + k] = (mask >> k) & 1;
+        kept += __builtin_popcount(mask);
+    }
+    return kept;
+}
+
+// 8 boxes per pass
+TARGET_AVX2
+static size_t test_avx2(const PlaneCorner *corners, size_t count, uint8_t *inside) {
+    const __m256 zero = _mm256_setzero_ps();
+    size_t kept = 0;
+    for(size_t i = 0; i + 8 <= count; i += 8) {
+        __m256 keep = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for(int p = 0; p < Frustum::PLANES_NUM; p++) {
+            const PlaneCorner &s = corners[p];
+            __m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(
+                _mm256_mul_ps(_mm256_set1_ps(s.a), _mm256_loadu_ps(s.x + i)),
+                _mm256_mul_ps(_mm256_set1_ps(s.b), _mm256_loadu_ps(s.y + i))),
+                _mm256_mul_ps(_mm256_set1_ps(s.c), _mm256_loadu_ps(s.z + i))),
+                _mm256_set1_ps(s.d));
+            keep = _mm256_and_ps(keep, _mm256_cmp_ps(distance, zero, _CMP_GE_OQ));
+        }
+        int mask = _mm256_movemask_ps(keep);
+        for(int k = 0; k < 8; k++) inside[i + k] = (mask >> k) & 1;
+        kept += __builtin_popcount(mask);
+    }
+    return kept;
+}
+
+#endif
+
+bool Frustum::contains(const glm::vec3 &min, const glm::vec3 &max) const {
+    for(const auto &p : _planes) {
+        float x = p.x >= 0.0f ? max.x : min.x;
+        float y = p.y >= 0.0f ? max.y : min.y;
+        float z = p.z >= 0.0f ? max.z : min.z;
+        if(!(p.x * x + p.y * y + p.z * z + p.w >= 0.0f)) return false;
+    }
+    return true;
+}
+
+bool Frustum::contains(const glm::vec3 &min, const glm::vec3 &max, unsigned &planes) const {
+    // Every plane is tested, which costs less than mispredicting where the
+    // loop stops for boxes walked one after the other
+    unsigned outside = 0, inside = 0;
+    for(int i = 0; i < PLANES_NUM; i++) {
+        const glm::vec4 &p = _planes[i];
+        float far = p.x * (p.x >= 0.0f ? max.x : min.x) + p.y * (p.y >= 0.0f ? max.y : min.y) +
+                    p.z * (p.z >= 0.0f ? max.z : min.z) + p.w;
+        float near = p.x * (p.x >= 0.0f ? min.x : max.x) + p.y * (p.y >= 0.0f ? min.y : max.y) +
+                     p.z * (p.z >= 0.0f ? min.z : max.z) + p.w;
+        outside |= unsigned(!(far >= 0.0f)) << i;
+        inside |= unsigned(near >= 0.0f) << i;
+    }
+    if(outside & planes) return false;
+
+    // The planes the whole box is in front of
+    planes &= ~inside;
+    return true;
+}
+
+size_t Frustum::test(const BoxArray &boxes, uint8_t *inside, Isa isa) const {
+    if(!is_supported(isa)) isa = best_isa();
+
+    PlaneCorner corners[PLANES_NUM];
+    plane_corners(_planes, boxes, corners);
+
+    size_t count = boxes.size();
+    size_t done = 0, kept = 0;
+#ifdef FRUSTUM_X86
+    if(isa == Isa::AVX2) {
+        kept = test_avx2(corners, count, inside);
+        done = count / 8 * 8;
+    } else if(isa == Isa::SSE2) {
+        kept = test_sse2(corners, count, inside);
+        done = count / 4 * 4;
+    }
+#endif
+    return kept + test_scalar(corners, done, count, inside);
+}
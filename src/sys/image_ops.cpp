@@ -0,0 +1,369 @@
+#include <algorithm>
+#include <cstring>
+
+#include <game/sys/image_ops.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define IMAGE_OPS_X86
+#include <immintrin.h>
+// AVX2 code is compiled per function, so the rest of the game keeps
+// running on CPUs without it
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+using namespace game::sys;
+
+// Overbright shifts up to this many bits keep every intermediate value
+// exact in a float, which the SIMD versions rely on
+#define MAX_OVERBRIGHT_SHIFT 8
+
+// Scalar reference versions, one pixel at a time. The SIMD versions do the
+// same float operations in the same order, which is what makes their
+// output identical.
+
+static inline void gamma_pixel(uint8_t *pImage, float factor) {
+    float scale = 1.0f, temp = 0.0f;
+    float r = 0, g = 0, b = 0;
+
+    // extract the current RGB values
+    r = (float)pImage[0];
+    g = (float)pImage[1];
+    b = (float)pImage[2];
+
+    // Multiply the factor by the RGB values, while keeping it to a 255 ratio
+    r = r * factor / 255.0f;
+    g = g * factor / 255.0f;
+    b = b * factor / 255.0f;
+
+    // Check if the the values went past the highest value
+    if(r > 1.0f && (temp = (1.0f/r)) < scale) scale=temp;
+    if(g > 1.0f && (temp = (1.0f/g)) < scale) scale=temp;
+    if(b > 1.0f && (temp = (1.0f/b)) < scale) scale=temp;
+
+    // Get the scale for this pixel and multiply it by our pixel values
+    scale*=255.0f;
+    r*=scale;   g*=scale;   b*=scale;
+
+    // Assign the new gamma'nized RGB values to our image
+    pImage[0] = (uint8_t)r;
+    pImage[1] = (uint8_t)g;
+    pImage[2] = (uint8_t)b;
+}
+
+static inline void overbright_pixel(uint8_t *pImage, int shift) {
+    int r = pImage[0] << shift;
+    int g = pImage[1] << shift;
+    int b = pImage[2] << shift;
+
+    // Normalize by the brightest channel, so the colour stays the same
+    if((r | g | b) > 255) {
+        int max = std::max(r, std::max(g, b));
+        r = r * 255 / max;
+        g = g * 255 / max;
+        b = b * 255 / max;
+    }
+
+    pImage[0] = (uint8_t)r;
+    pImage[1] = (uint8_t)g;
+    pImage[2] = (uint8_t)b;
+}
+
+static inline void greyscale_pixel(uint8_t *pImage) {
+    int luma = (pImage[0] * 77 + pImage[1] * 150 + pImage[2] * 29) >> 8;
+    pImage[0] = pImage[1] = pImage[2] = (uint8_t)luma;
+}
+
+#ifdef IMAGE_OPS_X86
+
+// SSE2 versions work on 4 pixels, converted to one float vector per
+// channel. The conversions read 16 bytes for the 12 used, so the last
+// pixels of an image always go through the scalar version.
+#define SSE2_PIXELS 4
+#define SSE2_READ_PIXELS 6
+
+static inline void load_rgb_sse2(const uint8_t *p, __m128 &r, __m128 &g, __m128 &b) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i words_lo = _mm_unpacklo_epi8(bytes, zero);
+    __m128i words_hi = _mm_unpackhi_epi8(bytes, zero);
+
+    // r0 g0 b0 r1 | g1 b1 r2 g2 | b2 r3 g3 b3
+    __m128 v0 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(words_lo, zero));
+    __m128 v1 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(words_lo, zero));
+    __m128 v2 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(words_hi, zero));
+
+    r = _mm_shuffle_ps(_mm_shuffle_ps(v0, v0, _MM_SHUFFLE(3, 3, 0, 0)),
+                       _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 2, 0));
+    g = _mm_shuffle_ps(_mm_shuffle_ps(v0, v1, _MM_SHUFFLE(0, 0, 1, 1)),
+                       _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+    b = _mm_shuffle_ps(_mm_shuffle_ps(v0, v1, _MM_SHUFFLE(1, 1, 2, 2)),
+                       _mm_shuffle_ps(v2, v2, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+}
+
+// Truncates the channels to bytes like the scalar casts and writes 12 bytes
+static inline void store_rgb_sse2(uint8_t *p, __m128 r, __m128 g, __m128 b) {
+    __m128 v0 = _mm_shuffle_ps(_mm_shuffle_ps(r, g, _MM_SHUFFLE(0, 0, 0, 0)),
+                               _mm_shuffle_ps(b, r, _MM_SHUFFLE(1, 1, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 v1 = _mm_shuffle_ps(_mm_shuffle_ps(g, b, _MM_SHUFFLE(1, 1, 1, 1)),
+                               _mm_shuffle_ps(r, g, _MM_SHUFFLE(2, 2, 2, 2)), _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 v2 = _mm_shuffle_ps(_mm_shuffle_ps(b, r, _MM_SHUFFLE(3, 3, 2, 2)),
+                               _mm_shuffle_ps(g, b, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+
+    __m128i i2 = _mm_cvttps_epi32(v2);
+    __m128i words_lo = _mm_packs_epi32(_mm_cvttps_epi32(v0), _mm_cvttps_epi32(v1));
+    __m128i words_hi = _mm_packs_epi32(i2, i2);
+    __m128i bytes = _mm_packus_epi16(words_lo, words_hi);
+
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(p), bytes);
+    uint32_t last = _mm_cvtsi128_si32(_mm_srli_si128(bytes, 8));
+    memcpy(p + 8, &last, sizeof(last));
+}
+
+template<typename Kernel, typename Pixel>
+static void run_sse2(uint8_t *rgb, size_t pixels, const Kernel &kernel, const Pixel &pixel) {
+    size_t i = 0;
+    for(; i + SSE2_READ_PIXELS <= pixels; i += SSE2_PIXELS) {
+        __m128 r, g, b;
+        load_rgb_sse2(rgb + i * 3, r, g, b);
+        kernel(r, g, b);
+        store_rgb_sse2(rgb + i * 3, r, g, b);
+    }
+    for(; i < pixels; i++) pixel(rgb + i * 3);
+}
+
+// The AVX2 versions do 8 pixels, 4 in each 128 bit lane, reading 28 bytes
+// for the 24 used.
+#define AVX2_PIXELS 8
+#define AVX2_READ_PIXELS 10
+
+TARGET_AVX2
+static inline void load_rgb_avx2(const uint8_t *p, __m256 &r, __m256 &g, __m256 &b) {
+    __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 12));
+    __m256i bytes = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+
+    // Picks one channel of each pixel into the low byte of a 32 bit lane
+    const __m256i r_mask = _mm256_setr_epi8(
+        0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1, 9, -1, -1, -1,
+        0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1, 9, -1, -1, -1);
+    const __m256i g_mask = _mm256_setr_epi8(
+        1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1,
+        1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1);
+    const __m256i b_mask = _mm256_setr_epi8(
+        2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1,
+        2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1);
+
+    r = _mm256_cvtepi32_ps(_mm256_shuffle_epi8(bytes, r_mask));
+    g = _mm256_cvtepi32_ps(_mm256_shuffle_epi8(bytes, g_mask));
+    b = _mm256_cvtepi32_ps(_mm256_shuffle_epi8(bytes, b_mask));
+}
+
+TARGET_AVX2
+static inline void store_rgb_avx2(uint8_t *p, __m256 r, __m256 g, __m256 b) {
+    __m256i pixels = _mm256_or_si256(_mm256_cvttps_epi32(r),
+                     _mm256_or_si256(_mm256_slli_epi32(_mm256_cvttps_epi32(g), 8),
+                                     _mm256_slli_epi32(_mm256_cvttps_epi32(b), 16)));
+
+    // Drops the fourth byte of every pixel, 12 bytes per lane
+    const __m256i pack_mask = _mm256_setr_epi8(
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    __m256i packed = _mm256_shuffle_epi8(pixels, pack_mask);
+
+    // The low lane writes 4 bytes too many, the high lane overwrites them
+    __m128i hi = _mm256_extracti128_si256(packed, 1);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(p), _mm256_castsi256_si128(packed));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(p + 12), hi);
+    uint32_t last = _mm_cvtsi128_si32(_mm_srli_si128(hi, 8));
+    memcpy(p + 20, &last, sizeof(last));
+}
+
+template<typename Kernel, typename Pixel>
+TARGET_AVX2
+static void run_avx2(uint8_t *rgb, size_t pixels, const Kernel &kernel, const Pixel &pixel) {
+    size_t i = 0;
+    for(; i + AVX2_READ_PIXELS <= pixels; i += AVX2_PIXELS) {
+        __m256 r, g, b;
+        load_rgb_avx2(rgb + i * 3, r, g, b);
+        kernel(r, g, b);
+        store_rgb_avx2(rgb + i * 3, r, g, b);
+    }
+    for(; i < pixels; i++) pixel(rgb + i * 3);
+}
+
+// The gamma scale is the smallest 1 / c over the channels above 1, which
+// is 1 / max(c) because rounded division keeps the order of its divisors.
+// One division per pixel instead of three.
+struct GammaSSE2 {
+    __m128 factor;
+    void operator()(__m128 &r, __m128 &g, __m128 &b) const {
+        const __m128 one = _mm_set1_ps(1.0f);
+        const __m128 full = _mm_set1_ps(255.0f);
+        r = _mm_div_ps(_mm_mul_ps(r, factor), full);
+        g = _mm_div_ps(_mm_mul_ps(g, factor), full);
+        b = _mm_div_ps(_mm_mul_ps(b, factor), full);
+
+        __m128 max = _mm_max_ps(r, _mm_max_ps(g, b));
+        __m128 is_over = _mm_cmpgt_ps(max, one);
+        __m128 scale = _mm_or_ps(_mm_and_ps(is_over, _mm_div_ps(one, max)),
+                                 _mm_andnot_ps(is_over, one));
+        scale = _mm_mul_ps(scale, full);
+
+        r = _mm_mul_ps(r, scale);
+        g = _mm_mul_ps(g, scale);
+        b = _mm_mul_ps(b, scale);
+    }
+};
+
+struct GammaAVX2 {
+    __m256 factor;
+    TARGET_AVX2 void operator()(__m256 &r, __m256 &g, __m256 &b) const {
+        const __m256 one = _mm256_set1_ps(1.0f);
+        const __m256 full = _mm256_set1_ps(255.0f);
+        r = _mm256_div_ps(_mm256_mul_ps(r, factor), full);
+        g = _mm256_div_ps(_mm256_mul_ps(g, factor), full);
+        b = _mm256_div_ps(_mm256_mul_ps(b, factor), full);
+
+        __m256 max = _mm256_max_ps(r, _mm256_max_ps(g, b));
+        __m256 is_over = _mm256_cmp_ps(max, one, _CMP_GT_OQ);
+        __m256 scale = _mm256_blendv_ps(one, _mm256_div_ps(one, max), is_over);
+        scale = _mm256_mul_ps(scale, full);
+
+        r = _mm256_mul_ps(r, scale);
+        g = _mm256_mul_ps(g, scale);
+        b = _mm256_mul_ps(b, scale);
+    }
+};
+
+// Integer overbright in floats: the shifted channels and c * 255 stay below
+// 2^24, so they are exact, and the rounded quotient never crosses the next
+// integer, so truncating it matches the integer division.
+struct OverbrightSSE2 {
+    __m128 multiplier;
+    void operator()(__m128 &r, __m128 &g, __m128 &b) const {
+        const __m128 full = _mm_set1_ps(255.0f);
+        r = _mm_mul_ps(r, multiplier);
+        g = _mm_mul_ps(g, multiplier);
+        b = _mm_mul_ps(b, multiplier);
+
+        __m128 max = _mm_max_ps(r, _mm_max_ps(g, b));
+        __m128 is_over = _mm_cmpgt_ps(max, full);
+        auto normalize = [&](__m128 c) {
+            __m128 scaled = _mm_div_ps(_mm_mul_ps(c, full), max);
+            return _mm_or_ps(_mm_and_ps(is_over, scaled), _mm_andnot_ps(is_over, c));
+        };
+        r = normalize(r);
+        g = normalize(g);
+        b = normalize(b);
+    }
+};
+
+struct OverbrightAVX2 {
+    __m256 multiplier;
+    TARGET_AVX2 void operator()(__m256 &r, __m256 &g, __m256 &b) const {
+        const __m256 full = _mm256_set1_ps(255.0f);
+        r = _mm256_mul_ps(r, multiplier);
+        g = _mm256_mul_ps(g, multiplier);
+        b = _mm256_mul_ps(b, multiplier);
+
+        __m256 max = _mm256_max_ps(r, _mm256_max_ps(g, b));
+        __m256 is_over = _mm256_cmp_ps(max, full, _CMP_GT_OQ);
+        r = _mm256_blendv_ps(r, _mm256_div_ps(_mm256_mul_ps(r, full), max), is_over);
+        g = _mm256_blendv_ps(g, _mm256_div_ps(_mm256_mul_ps(g, full), max), is_over);
+        b = _mm256_blendv_ps(b, _mm256_div_ps(_mm256_mul_ps(b, full), max), is_over);
+    }
+};
+
+// The weighted sum is an exact integer in a float and the division by 256
+// is exact too, so truncating matches the shift
+struct GreyscaleSSE2 {
+    void operator()(__m128 &r, __m128 &g, __m128 &b) const {
+        __m128 sum = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(77.0f)),
+                                           _mm_mul_ps(g, _mm_set1_ps(150.0f))),
+                                _mm_mul_ps(b, _mm_set1_ps(29.0f)));
+        r = g = b = _mm_mul_ps(sum, _mm_set1_ps(1.0f / 256.0f));
+    }
+};
+
+struct GreyscaleAVX2 {
+    TARGET_AVX2 void operator()(__m256 &r, __m256 &g, __m256 &b) const {
+        __m256 sum = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r, _mm256_set1_ps(77.0f)),
+                                                 _mm256_mul_ps(g, _mm256_set1_ps(150.0f))),
+                                   _mm256_mul_ps(b, _mm256_set1_ps(29.0f)));
+        r = g = b = _mm256_mul_ps(sum, _mm256_set1_ps(1.0f / 256.0f));
+    }
+};
+
+TARGET_AVX2
+static void gamma_avx2(uint8_t *rgb, size_t pixels, float factor) {
+    run_avx2(rgb, pixels, GammaAVX2{ _mm256_set1_ps(factor) },
+             [factor](uint8_t *p) { gamma_pixel(p, factor); });
+}
+
+TARGET_AVX2
+static void overbright_avx2(uint8_t *rgb, size_t pixels, int shift) {
+    run_avx2(rgb, pixels, OverbrightAVX2{ _mm256_set1_ps(float(1 << shift)) },
+             [shift](uint8_t *p) { overbright_pixel(p, shift); });
+}
+
+TARGET_AVX2
+static void greyscale_avx2(uint8_t *rgb, size_t pixels) {
+    run_avx2(rgb, pixels, GreyscaleAVX2(), greyscale_pixel);
+}
+
+#endif
+
+void ImageOps::gamma(uint8_t *rgb, size_t pixels, float factor, Isa isa) {
+    if(!is_supported(isa)) isa = best_isa();
+    switch(isa) {
+#ifdef IMAGE_OPS_X86
+        case Isa::AVX2:
+            gamma_avx2(rgb, pixels, factor);
+            return;
+        case Isa::SSE2:
+            run_sse2(rgb, pixels, GammaSSE2{ _mm_set1_ps(factor) },
+                     [factor](uint8_t *p) { gamma_pixel(p, factor); });
+            return;
+#endif
+        default:
+            for(size_t i = 0; i < pixels; i++) gamma_pixel(rgb + i * 3, factor);
+            return;
+    }
+}
+
+void ImageOps::overbright(uint8_t *rgb, size_t pixels, int shift, Isa isa) {
+    shift = std::min(std::max(shift, 0), MAX_OVERBRIGHT_SHIFT);
+    if(shift == 0) return;
+    if(!is_supported(isa)) isa = best_isa();
+    switch(isa) {
+#ifdef IMAGE_OPS_X86
+        case Isa::AVX2:
+            overbright_avx2(rgb, pixels, shift);
+            return;
+        case Isa::SSE2:
+            run_sse2(rgb, pixels, OverbrightSSE2{ _mm_set1_ps(float(1 << shift)) },
+                     [shift](uint8_t *p) { overbright_pixel(p, shift); });
+            return;
+#endif
+        default:
+            for(size_t i = 0; i < pixels; i++) overbright_pixel(rgb + i * 3, shift);
+            return;
+    }
+}
+
+void ImageOps::greyscale(uint8_t *rgb, size_t pixels, Isa isa) {
+    if(!is_supported(isa)) isa = best_isa();
+    switch(isa) {
+#ifdef IMAGE_OPS_X86
+        case Isa::AVX2:
+            greyscale_avx2(rgb, pixels);
+            return;
+        case Isa::SSE2:
+            run_sse2(rgb, pixels, GreyscaleSSE2(), greyscale_pixel);
+            return;
+#endif
+        default:
+            for(size_t i = 0; i < pixels; i++) greyscale_pixel(rgb + i * 3);
+            return;
+    }
+}
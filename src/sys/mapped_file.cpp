@@ -0,0 +1,64 @@
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <game/config.h>
+#include <game/sys/mapped_file.h>
+
+using namespace game;
+using namespace game::sys;
+
+MappedFile::MappedFile() {
+    _logger = spdlog::get(Config::logger_name());
+    if(_logger == nullptr)
+        _logger = spdlog::stdout_color_mt(Config::logger_name());
+}
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+bool MappedFile::open(const std::string &path) {
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+        _logger->error("Failed to open file {}: {}", path, strerror(errno));
+        return false;
+    }
+
+    struct stat st = {};
+    if(fstat(fd, &st) != 0 || st.st_size <= 0) {
+        _logger->error("Failed to stat file {}: {}", path,
+                       st.st_size == 0 ? "empty file" : strerror(errno));
+        ::close(fd);
+        return false;
+    }
+
+    void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping stays valid after the descriptor is closed
+    ::close(fd);
+    if(addr == MAP_FAILED) {
+        _logger->error("Failed to map file {}: {}", path, strerror(errno));
+        return false;
+    }
+
+    // The whole file is going to be touched while loading, ask the kernel to
+    // start reading it in ahead of the page faults.
+    madvise(addr, st.st_size, MADV_WILLNEED);
+
+    _data = static_cast<const uint8_t*>(addr);
+    _size = static_cast<size_t>(st.st_size);
+    return true;
+}
+
+void MappedFile::close() {
+    if(_data == nullptr) return;
+    munmap(const_cast<uint8_t*>(_data), _size);
+    _data = nullptr;
+    _size = 0;
+}
@@ -0,0 +1,304 @@
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+
+#include <game/sys/occlusion_buffer.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define OCCLUSION_X86
+#include <immintrin.h>
+// AVX2 code is compiled per function, like the image operations
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+using namespace game::sys;
+
+constexpr size_t OcclusionBuffer::BLOCK_SIZE;
+constexpr size_t OcclusionBuffer::TILE_WIDTH;
+constexpr size_t OcclusionBuffer::TILE_HEIGHT;
+
+OcclusionBuffer::OcclusionBuffer(size_t width, size_t height) {
+    resize(width, height);
+}
+
+void OcclusionBuffer::resize(size_t width, size_t height) {
+    _width = std::max<size_t>(1, (width + BLOCK_SIZE - 1) / BLOCK_SIZE) * BLOCK_SIZE;
+    _height = std::max<size_t>(1, (height + BLOCK_SIZE - 1) / BLOCK_SIZE) * BLOCK_SIZE;
+    _tiles_x = (_width + TILE_WIDTH - 1) / TILE_WIDTH;
+    _tiles_y = (_height + TILE_HEIGHT - 1) / TILE_HEIGHT;
+    _depth.assign(_width * _height, FLT_MAX);
+    _blocks.assign((_width / BLOCK_SIZE) * (_height / BLOCK_SIZE), FLT_MAX);
+    _bins.assign(_tiles_x * _tiles_y, {});
+    _triangles.clear();
+}
+
+void OcclusionBuffer::clear(const glm::mat4 &view_projection) {
+    _view_projection = view_projection;
+    std::fill(_depth.begin(), _depth.end(), FLT_MAX);
+    std::fill(_blocks.begin(), _blocks.end(), FLT_MAX);
+    for(auto &bin : _bins) bin.clear();
+    _triangles.clear();
+    _stats = {};
+}
+
+// Corners just past the near plane land millions of pixels off the
+// screen, so coordinates are clamped to [0, size] before becoming ints
+static int clamp_pixel(float value, size_t size) {
+    return int(std::min(float(size), std::max(0.0f, value)));
+}
+
+bool OcclusionBuffer::project(const glm::vec3 &point, glm::vec3 &pixel) const {
+    glm::vec4 clip = _view_projection * glm::vec4(point, 1.0f);
+    if(!(clip.w > _near)) return false;
+    pixel.x = (clip.x / clip.w * 0.5f + 0.5f) * float(_width);
+    pixel.y = (clip.y / clip.w * 0.5f + 0.5f) * float(_height);
+    pixel.z = clip.w;
+    return true;
+}
+
+bool OcclusionBuffer::add_triangle(const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c) {
+    // Clipping against the near plane would make new corners, and an
+    // occluder that close fills the screen anyway, so it is left out
+    glm::vec3 p[3];
+    if(!project(a, p[0]) || !project(b, p[1]) || !project(c, p[2])) {
+        _stats.triangles_clipped++;
+        return false;
+    }
+
+    // Counter clockwise on the screen, which makes the edge functions
+    // positive inside. Both sides of a wall hide what is behind it.
+    float area = (p[1].x - p[0].x) * (p[2].y - p[0].y) - (p[2].x - p[0].x) * (p[1].y - p[0].y);
+    if(!(std::fabs(area) > 1e-6f)) return false;
+    if(area < 0.0f) std::swap(p[1], p[2]);
+
+    Triangle tri;
+    float min_x = FLT_MAX, min_y = FLT_MAX, max_x = -FLT_MAX, max_y = -FLT_MAX;
+    tri.depth = 0.0f;
+    for(int i = 0; i < 3; i++) {
+        const glm::vec3 &v0 = p[i], &v1 = p[(i + 1) % 3];
+        tri.a[i] = v0.y - v1.y;
+        tri.b[i] = v1.x - v0.x;
+        // Moving the edge in by the half pixel that sticks out the most
+        // leaves only the pixels whose every point is inside
+        tri.c[i] = v0.x * v1.y - v1.x * v0.y - 0.5f * (std::fabs(tri.a[i]) + std::fabs(tri.b[i]));
+        tri.depth = std::max(tri.depth, v0.z);
+        min_x = std::min(min_x, v0.x); max_x = std::max(max_x, v0.x);
+        min_y = std::min(min_y, v0.y); max_y = std::max(max_y, v0.y);
+    }
+
+    // Only pixels wholly inside the corners can be covered
+    tri.min_x = clamp_pixel(std::ceil(min_x), _width);
+    tri.min_y = clamp_pixel(std::ceil(min_y), _height);
+    tri.max_x = clamp_pixel(std::floor(max_x), _width) - 1;
+    tri.max_y = clamp_pixel(std::floor(max_y), _height) - 1;
+    if(tri.min_x > tri.max_x || tri.min_y > tri.max_y) return false;
+
+    uint32_t index = uint32_t(_triangles.size());
+    _triangles.push_back(tri);
+    for(size_t ty = tri.min_y / TILE_HEIGHT; ty <= tri.max_y / TILE_HEIGHT; ty++) {
+        for(size_t tx = tri.min_x / TILE_WIDTH; tx <= tri.max_x / TILE_WIDTH; tx++) {
+            _bins[ty * _tiles_x + tx].push_back(index);
+        }
+    }
+    return true;
+}
+
+// The pixels begin to end of a row, with rows[i] = b[i] * y + c[i] for the
+// centre y of the row
+static void span_scalar(float *depth, size_t begin, size_t end, const float *a,
+                        const float *rows, float tri_depth) {
+    for(size_t x = begin; x < end; x++) {
+        float centre = float(x) + 0.5f;
+        float e0 = a[0] * centre + rows[0];
+        float e1 = a[1] * centre + rows[1];
+        float e2 = a[2] * centre + rows[2];
+        if(e0 >= 0.0f && e1 >= 0.0f && e2 >= 0.0f) depth[x] = std::min(depth[x], tri_depth);
+    }
+}
+
+#ifdef OCCLUSION_X86
+
+// 4 pixels per pass, begin and end are multiples of 4
+static void span_sse2(float *depth, size_t begin, size_t end, const float *a,
+                      const float *rows, float tri_depth) {
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 d = _mm_set1_ps(tri_depth);
+    const __m128 a0 = _mm_set1_ps(a[0]), a1 = _mm_set1_ps(a[1]), a2 = _mm_set1_ps(a[2]);
+    const __m128 r0 = _mm_set1_ps(rows[0]), r1 = _mm_set1_ps(rows[1]), r2 = _mm_set1_ps(rows[2]);
+    __m128 centre = _mm_add_ps(_mm_set1_ps(float(begin)), _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f));
+    const __m128 step = _mm_set1_ps(4.0f);
+    for(size_t x = begin; x < end; x += 4, centre = _mm_add_ps(centre, step)) {
+        __m128 inside = _mm_and_ps(_mm_and_ps(
+            _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a0, centre), r0), zero),
+            _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a1, centre), r1), zero)),
+            _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a2, centre), r2), zero));
+        if(_mm_movemask_ps(inside) == 0) continue;
+        __m128 old = _mm_loadu_ps(depth + x);
+        __m128 nearer = _mm_min_ps(old, d);
+        _mm_storeu_ps(depth + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, old)));
+    }
+}
+
+// 8 pixels per pass, begin and end are multiples of 8
+TARGET_AVX2
+static void span_avx2(float *depth, size_t begin, size_t end, const float *a,
+                      const float *rows, float tri_depth) {
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 d = _mm256_set1_ps(tri_depth);
+    const __m256 a0 = _mm256_set1_ps(a[0]), a1 = _mm256_set1_ps(a[1]), a2 = _mm256_set1_ps(a[2]);
+    const __m256 r0 = _mm256_set1_ps(rows[0]), r1 = _mm256_set1_ps(rows[1]), r2 = _mm256_set1_ps(rows[2]);
+    __m256 centre = _mm256_add_ps(_mm256_set1_ps(float(begin)),
+                                  _mm256_setr_ps(0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f));
+    const __m256 step = _mm256_set1_ps(8.0f);
+    for(size_t x = begin; x < end; x += 8, centre = _mm256_add_ps(centre, step)) {
+        __m256 inside = _mm256_and_ps(_mm256_and_ps(
+            _mm256_cmp_ps(_mm256_add_ps(_mm256_mul_ps(a0, centre), r0), zero, _CMP_GE_OQ),
+            _mm256_cmp_ps(_mm256_add_ps(_mm256_mul_ps(a1, centre), r1), zero, _CMP_GE_OQ)),
+            _mm256_cmp_ps(_mm256_add_ps(_mm256_mul_ps(a2, centre), r2), zero, _CMP_GE_OQ));
+        if(_mm256_movemask_ps(inside) == 0) continue;
+        __m256 old = _mm256_loadu_ps(depth + x);
+        _mm256_storeu_ps(depth + x, _mm256_blendv_ps(old, _mm256_min_ps(old, d), inside));
+    }
+}
+
+#endif
+
+void OcclusionBuffer::rasterize_tile(size_t tile, Isa isa) {
+    const std::vector<uint32_t> &bin = _bins[tile];
+    if(bin.empty()) return;
+
+    size_t x0 = (tile % _tiles_x) * TILE_WIDTH, x1 = std::min(_width, x0 + TILE_WIDTH);
+    size_t y0 = (tile / _tiles_x) * TILE_HEIGHT, y1 = std::min(_height, y0 + TILE_HEIGHT);
+    for(uint32_t index : bin) {
+        const Triangle &tri = _triangles[index];
+        // Whole blocks wide, the edge functions leave out the extra pixels
+        size_t begin = std::max(x0, size_t(tri.min_x) / BLOCK_SIZE * BLOCK_SIZE);
+        size_t end = std::min(x1, (size_t(tri.max_x) / BLOCK_SIZE + 1) * BLOCK_SIZE);
+        size_t top = std::min(y1, size_t(tri.max_y) + 1);
+        for(size_t y = std::max(y0, size_t(tri.min_y)); y < top; y++) {
+            float centre = float(y) + 0.5f;
+            float rows[3] = { tri.b[0] * centre + tri.c[0], tri.b[1] * centre + tri.c[1],
+                              tri.b[2] * centre + tri.c[2] };
+            // Where each edge crosses the row narrows the span to the
+            // covered pixels, give or take one, so long thin triangles
+            // don't test their whole bounds
+            float left = float(begin), right = float(end);
+            for(int i = 0; i < 3; i++) {
+                if(tri.a[i] > 0.0f) {
+                    left = std::max(left, -rows[i] / tri.a[i] - 1.5f);
+                } else if(tri.a[i] < 0.0f) {
+                    right = std::min(right, -rows[i] / tri.a[i] + 1.5f);
+                } else if(rows[i] < 0.0f) {
+                    right = left;
+                }
+            }
+            if(!(left < right)) continue;
+            size_t from = std::max(begin, size_t(left) / BLOCK_SIZE * BLOCK_SIZE);
+            size_t to = std::min(end, (size_t(right) / BLOCK_SIZE + 1) * BLOCK_SIZE);
+            if(from >= to) continue;
+
+            float *row = _depth.data() + y * _width;
+#ifdef OCCLUSION_X86
+            if(isa == Isa::AVX2) {
+                span_avx2(row, from, to, tri.a, rows, tri.depth);
+                continue;
+            } else if(isa == Isa::SSE2) {
+                span_sse2(row, from, to, tri.a, rows, tri.depth);
+                continue;
+            }
+#endif
+            span_scalar(row, from, to, tri.a, rows, tri.depth);
+        }
+    }
+
+    // The farthest depth of every block of the tile
+    size_t blocks_x = _width / BLOCK_SIZE;
+    for(size_t by = y0 / BLOCK_SIZE; by < y1 / BLOCK_SIZE; by++) {
+        for(size_t bx = x0 / BLOCK_SIZE; bx < x1 / BLOCK_SIZE; bx++) {
+            float farthest = 0.0f;
+            for(size_t y = by * BLOCK_SIZE; y < (by + 1) * BLOCK_SIZE; y++) {
+                const float *row = _depth.data() + y * _width + bx * BLOCK_SIZE;
+                for(size_t x = 0; x < BLOCK_SIZE; x++) farthest = std::max(farthest, row[x]);
+            }
+            _blocks[by * blocks_x + bx] = farthest;
+        }
+    }
+}
+
+void OcclusionBuffer::rasterize(ThreadPool *pool, Isa isa) {
+    if(!is_supported(isa)) isa = best_isa();
+    auto start = std::chrono::steady_clock::now();
+
+    // Tiles don't share pixels, so each one is drawn without locking
+    size_t tiles = _bins.size();
+    auto draw = [this, isa](size_t begin, size_t end) {
+        for(size_t tile = begin; tile < end; tile++) rasterize_tile(tile, isa);
+    };
+    if(pool != nullptr && !_triangles.empty()) {
+        pool->parallel_for(0, tiles, 1, draw);
+    } else {
+        draw(0, tiles);
+    }
+
+    _stats.triangles = _triangles.size();
+    std::chrono::duration<double, std::milli> time = std::chrono::steady_clock::now() - start;
+    _stats.raster_ms += time.count();
+}
+
+bool OcclusionBuffer::visible(const glm::vec3 &min, const glm::vec3 &max) {
+    _stats.boxes_tested++;
+
+    // A box reaching past the near plane may be all around the camera
+    float min_x = FLT_MAX, min_y = FLT_MAX, max_x = -FLT_MAX, max_y = -FLT_MAX;
+    float nearest = FLT_MAX;
+    for(int i = 0; i < 8; i++) {
+        glm::vec3 corner(i & 1 ? max.x : min.x, i & 2 ? max.y : min.y, i & 4 ? max.z : min.z);
+        glm::vec3 pixel;
+        if(!project(corner, pixel)) return true;
+        min_x = std::min(min_x, pixel.x); max_x = std::max(max_x, pixel.x);
+        min_y = std::min(min_y, pixel.y); max_y = std::max(max_y, pixel.y);
+        nearest = std::min(nearest, pixel.z);
+    }
+
+    // Every pixel the projection touches, a box off the screen is left to the frustum
+    int x0 = clamp_pixel(std::floor(min_x), _width);
+    int y0 = clamp_pixel(std::floor(min_y), _height);
+    int x1 = clamp_pixel(std::ceil(max_x), _width);
+    int y1 = clamp_pixel(std::ceil(max_y), _height);
+    if(x0 >= x1 || y0 >= y1) return true;
+
+    // Whole blocks nearer than the box are skipped, the others are
+    // checked a pixel at a time where they overlap the box
+    size_t blocks_x = _width / BLOCK_SIZE;
+    for(int by = y0 / int(BLOCK_SIZE); by <= (y1 - 1) / int(BLOCK_SIZE); by++) {
+        for(int bx = x0 / int(BLOCK_SIZE); bx <= (x1 - 1) / int(BLOCK_SIZE); bx++) {
+            if(_blocks[by * blocks_x + bx] < nearest) continue;
+
+            int top = std::min(y1, (by + 1) * int(BLOCK_SIZE));
+            int right = std::min(x1, (bx + 1) * int(BLOCK_SIZE));
+            for(int y = std::max(y0, by * int(BLOCK_SIZE)); y < top; y++) {
+                const float *row = _depth.data() + y * _width;
+                for(int x = std::max(x0, bx * int(BLOCK_SIZE)); x < right; x++) {
+                    if(!(row[x] < nearest)) return true;
+                }
+            }
+        }
+    }
+    _stats.boxes_occluded++;
+    return false;
+}
+
+size_t OcclusionBuffer::test(const BoxArray &boxes, uint8_t *visible) {
+    size_t hidden = 0;
+    for(size_t i = 0; i < boxes.size(); i++) {
+        if(!visible[i]) continue;
+        glm::vec3 min(boxes.min_x[i], boxes.min_y[i], boxes.min_z[i]);
+        glm::vec3 max(boxes.max_x[i], boxes.max_y[i], boxes.max_z[i]);
+        if(!this->visible(min, max)) {
+            visible[i] = 0;
+            hidden++;
+        }
+    }
+    return hidden;
+}
@@ -0,0 +1,181 @@
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+
+#include <game/sys/patch_lod.h>
+
+// A patch only goes to a coarser level once it is this much farther than
+// the threshold, so a camera standing on a threshold doesn't make it flicker
+#define PATCH_LOD_HYSTERESIS 1.25f
+
+using namespace game;
+using namespace game::sys;
+
+static int floor_power_of_two(int value) {
+    int power = 1;
+    while(power * 2 <= value) power *= 2;
+    return power;
+}
+
+// Distance from pos to the closest point of the box, zero inside it
+static float box_distance(const glm::vec3 &pos, const glm::vec3 &min, const glm::vec3 &max) {
+    float dx = std::max(std::max(min.x - pos.x, pos.x - max.x), 0.0f);
+    float dy = std::max(std::max(min.y - pos.y, pos.y - max.y), 0.0f);
+    float dz = std::max(std::max(min.z - pos.z, pos.z - max.z), 0.0f);
+    return std::sqrt(dx * dx + dy * dy + dz * dz);
+}
+
+PatchLod::PatchLod() : _is_cancelled(false) {
+    _logger = spdlog::get("bsp");
+    if(_logger == nullptr)
+        _logger = spdlog::stdout_color_mt("bsp");
+}
+
+PatchLod::~PatchLod() {
+    clear();
+}
+
+void PatchLod::levels(int min_level, int max_level, float distance) {
+    _min_level = floor_power_of_two(std::max(1, min_level));
+    _max_level = std::max(_min_level, floor_power_of_two(std::max(1, max_level)));
+    _distance = std::max(1.0f, distance);
+}
+
+int PatchLod::level_for(float distance) const {
+    int level = _max_level;
+    float limit = _distance;
+    while(level > _min_level && distance > limit) {
+        level /= 2;
+        limit *= 2.0f;
+    }
+    return level;
+}
+
+int PatchLod::step(int level) const {
+    int step = 0;
+    while((_min_level << step) < level) step++;
+    return step;
+}
+
+void PatchLod::reset(const BSPLumpArray<BSPPatch> &patches, int base_level, Tessellator tessellator) {
+    clear();
+    _tessellator = std::move(tessellator);
+    _base_level = base_level;
+
+    size_t steps = step(_max_level) + 1;
+    _patches.resize(patches.size());
+    for(size_t i = 0; i < patches.size(); i++) {
+        Patch &patch = _patches[i];
+        patch.min = patches[i].min;
+        patch.max = patches[i].max;
+        patch.level = base_level;
+        patch.pending = 0;
+        patch.current = nullptr;
+        patch.levels.assign(steps, nullptr);
+
+        size_t columns = (patches[i].size[0] - 1) / 2 * base_level;
+        size_t rows = (patches[i].size[1] - 1) / 2 * base_level;
+        patch.base_triangles = columns * rows * 2;
+        _stats.triangles += patch.base_triangles;
+    }
+    if(!_patches.empty()) {
+        _logger->debug("Patch LOD over {} patches, levels {} to {} from {} units", _patches.size(),
+                       _min_level, _max_level, _distance);
+    }
+}
+
+void PatchLod::tessellate_job(size_t patch, int level) {
+    if(_is_cancelled) return;
+
+    auto geometry = std::make_shared<Geometry>();
+    _tessellator(patch, level, *geometry);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _finished.push_back({ patch, level, std::move(geometry) });
+}
+
+void PatchLod::select(Patch &patch, int level) {
+    _stats.triangles -= patch.current ? patch.current->indices.size() / 3 : patch.base_triangles;
+    patch.level = level;
+    patch.current = level == _base_level ? nullptr : patch.levels[step(level)].get();
+    _stats.triangles += patch.current ? patch.current->indices.size() / 3 : patch.base_triangles;
+    _stats.switches++;
+}
+
+void PatchLod::receive(Finished &finished) {
+    Patch &patch = _patches[finished.patch];
+    patch.levels[step(finished.level)] = std::move(finished.geometry);
+    if(patch.pending == finished.level) {
+        patch.pending = 0;
+        _pending--;
+    }
+    _stats.tessellated++;
+}
+
+void PatchLod::update(const glm::vec3 &pos) {
+    if(_patches.empty()) return;
+
+    // Take in what the workers finished since the last frame, the patches
+    // that still want those levels switch to them below
+    std::deque<Finished> finished;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        finished.swap(_finished);
+    }
+    for(auto &f : finished) receive(f);
+
+    _jobs.erase(std::remove_if(_jobs.begin(), _jobs.end(), [](std::future<void> &job) {
+        return job.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }), _jobs.end());
+
+    for(size_t i = 0; i < _patches.size(); i++) {
+        Patch &patch = _patches[i];
+        float distance = box_distance(pos, patch.min, patch.max);
+        int level = level_for(distance);
+
+        // Coarser only once the patch is clearly past the threshold
+        if(level < patch.level && level_for(distance / PATCH_LOD_HYSTERESIS) >= patch.level) continue;
+        if(level == patch.level) continue;
+
+        if(level == _base_level || patch.levels[step(level)] != nullptr) {
+            select(patch, level);
+            continue;
+        }
+
+        // Keep drawing the current level until the new one is ready. If the
+        // camera moved on meanwhile the next update asks for the right one.
+        if(patch.pending != 0) continue;
+        patch.pending = level;
+        _pending++;
+        if(_pool == nullptr) {
+            tessellate_job(i, level);
+            std::lock_guard<std::mutex> lock(_mutex);
+            receive(_finished.back());
+            _finished.pop_back();
+            select(patch, level);
+        } else {
+            _jobs.emplace_back(_pool->submit([this, i, level] { tessellate_job(i, level); }));
+        }
+    }
+}
+
+void PatchLod::finish(const glm::vec3 &pos) {
+    while(_pending != 0) {
+        if(_pool != nullptr) _pool->wait(_jobs);
+        _jobs.clear();
+        update(pos);
+    }
+    update(pos);
+}
+
+void PatchLod::clear() {
+    _is_cancelled = true;
+    if(_pool != nullptr) _pool->wait(_jobs);
+    _jobs.clear();
+    _is_cancelled = false;
+
+    _finished.clear();
+    _patches.clear();
+    _pending = 0;
+    _stats = Stats();
+}
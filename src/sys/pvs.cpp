@@ -0,0 +1,162 @@
+#include <algorithm>
+#include <cstring>
+
+#include <game/sys/pvs.h>
+
+using namespace game::sys;
+
+void Pvs::clear() {
+    _clusters = 0;
+    _words = 0;
+    _is_compressed = false;
+    _rows = std::vector<uint64_t>();
+    _offsets = std::vector<uint32_t>();
+}
+
+void Pvs::reset(int clusters_num, int bytes_per_cluster, const uint8_t *bitsets, bool compress) {
+    clear();
+    if(clusters_num <= 0 || bytes_per_cluster <= 0 || bitsets == nullptr) return;
+
+    // A row never has more bits than the bytes given, clusters past them
+    // are not visible from anywhere
+    _clusters = clusters_num;
+    _words = words_for(size_t(bytes_per_cluster) * 8);
+    _rows.assign(size_t(_clusters) * _words, 0);
+    for(int i = 0; i < _clusters; i++) {
+        // Bit n of the row is bit n % 8 of byte n / 8, which is the same
+        // bit of the little endian words
+        const uint8_t *bytes = bitsets + size_t(i) * bytes_per_cluster;
+        uint64_t *words = &_rows[size_t(i) * _words];
+        for(int b = 0; b < bytes_per_cluster; b++) {
+            words[b / 8] |= uint64_t(bytes[b]) << (8 * (b % 8));
+        }
+    }
+    if(!compress) return;
+
+    std::vector<uint64_t> packed;
+    std::vector<uint32_t> offsets;
+    packed.reserve(_rows.size() / 4);
+    for(int i = 0; i < _clusters; i++) {
+        offsets.push_back(packed.size());
+        const uint64_t *words = &_rows[size_t(i) * _words];
+        for(size_t w = 0; w < _words; w++) {
+            packed.push_back(words[w]);
+            if(words[w] != 0) continue;
+            size_t run = 1;
+            while(w + run < _words && words[w + run] == 0) run++;
+            packed.push_back(run);
+            w += run - 1;
+        }
+    }
+    offsets.push_back(packed.size());
+
+    // Dense rows would grow, those stay as they are
+    if(packed.size() * sizeof(uint64_t) + offsets.size() * sizeof(uint32_t) >= memory()) return;
+    _rows.swap(packed);
+    _rows.shrink_to_fit();
+    _offsets.swap(offsets);
+    _is_compressed = true;
+}
+
+uint64_t Pvs::word(int from, size_t index) const {
+    if(!_is_compressed) return _rows[size_t(from) * _words + index];
+
+    size_t w = 0;
+    for(size_t i = _offsets[from]; i < _offsets[from + 1]; i++) {
+        uint64_t value = _rows[i];
+        size_t run = value != 0 ? 1 : _rows[++i];
+        if(index < w + run) return value;
+        w += run;
+    }
+    return 0;
+}
+
+bool Pvs::visible(int from, int to) const {
+    if(_clusters == 0 || from < 0) return true;
+    if(from >= _clusters || to < 0 || size_t(to) >= _words * 64) return false;
+    return (word(from, to / 64) >> (to % 64)) & 1;
+}
+
+void Pvs::row(int from, uint64_t *out) const {
+    if(_clusters == 0 || from < 0 || from >= _clusters) {
+        std::fill(out, out + _words, (_clusters == 0 || from < 0) ? ~0ull : 0ull);
+        return;
+    }
+    if(!_is_compressed) {
+        std::memcpy(out, &_rows[size_t(from) * _words], _words * sizeof(uint64_t));
+        return;
+    }
+
+    uint64_t *word = out;
+    for(size_t i = _offsets[from]; i < _offsets[from + 1]; i++) {
+        if(_rows[i] != 0) {
+            *word++ = _rows[i];
+        } else {
+            size_t run = _rows[++i];
+            std::fill(word, word + run, 0ull);
+            word += run;
+        }
+    }
+}
+
+size_t Pvs::visible_leafs(int from, const int *leaf_clusters, size_t leafs_num, uint64_t *leaf_bits) const {
+    size_t leaf_words = words_for(leafs_num);
+    if(_clusters == 0 || from < 0) {
+        // Everything is visible, the bits past the last leaf stay clear
+        std::fill(leaf_bits, leaf_bits + leaf_words, ~0ull);
+        if(leafs_num % 64) leaf_bits[leaf_words - 1] = (1ull << (leafs_num % 64)) - 1;
+        return leafs_num;
+    }
+
+    std::vector<uint64_t> expanded;
+    const uint64_t *row_bits = nullptr;
+    if(from < _clusters && !_is_compressed) {
+        row_bits = &_rows[size_t(from) * _words];
+    } else {
+        expanded.resize(_words);
+        row(from, expanded.data());
+        row_bits = expanded.data();
+    }
+
+    // 64 leafs are gathered into one word before it is stored, clusters
+    // outside the row count as not visible
+    const size_t row_bits_num = _words * 64;
+    size_t visible = 0;
+    for(size_t w = 0; w < leaf_words; w++) {
+        uint64_t bits = 0;
+        size_t end = std::min(leafs_num, (w + 1) * 64);
+        for(size_t i = w * 64; i < end; i++) {
+            size_t cluster = size_t(leaf_clusters[i]);
+            uint64_t bit = cluster < row_bits_num ? (row_bits[cluster / 64] >> (cluster % 64)) & 1 : 0;
+            bits |= bit << (i % 64);
+        }
+        leaf_bits[w] = bits;
+        visible += __builtin_popcountll(bits);
+    }
+    return visible;
+}
+
+size_t Pvs::count(const uint64_t *bits, size_t words) {
+    size_t total = 0;
+    for(size_t i = 0; i < words; i++) total += __builtin_popcountll(bits[i]);
+    return total;
+}
+
+size_t Pvs::count_and(const uint64_t *a, const uint64_t *b, size_t words) {
+    size_t total = 0;
+    for(size_t i = 0; i < words; i++) total += __builtin_popcountll(a[i] & b[i]);
+    return total;
+}
+
+bool Pvs::any(const uint64_t *bits, size_t first, size_t last) {
+    size_t first_word = first / 64, last_word = last / 64;
+    uint64_t first_mask = ~0ull << (first % 64);
+    uint64_t last_mask = ~0ull >> (63 - last % 64);
+    if(first_word == last_word) return (bits[first_word] & first_mask & last_mask) != 0;
+
+    if(bits[first_word] & first_mask) return true;
+    for(size_t w = first_word + 1; w < last_word; w++) {
+        if(bits[w]) return true;
+    }
+    return (bits[last_word] & last_mask) != 0;
+}
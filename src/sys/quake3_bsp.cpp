@@ -1,13 +1,19 @@
-#include <SDL_image.h>
 #include <iostream>
-#include <fstream>
+#include <algorithm>
 #include <cstring>
 #include <cstdlib>
 #include <cmath>
+#include <cfloat>
 #include <cstdio>
 
 #include <thread>
 #include <chrono>
+#include <atomic>
+#include <functional>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #ifdef __APPLE__
 #include <OpenGL/gl.h>
@@ -18,101 +24,136 @@
 #endif
 
 #include <game/sys/quake3_bsp.h>
+#include <game/sys/hash.h>
+#include <game/sys/asset_index.h>
+#include <game/sys/image_ops.h>
+#include <game/sys/patch_lod.h>
 #include <game/config.h>
 #define MAX_PATH 255
 
-#define BEZIER_LEVEL 3
+#if defined(__x86_64__) || defined(__i386__)
+#define BSP_X86
+#include <immintrin.h>
+// AVX2 code is compiled per function, like the image operations
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+// The side planes traces test at once, the lanes of Quake3Bsp::CollisionSides
+#define SIDE_LANES 8
 
 using namespace game;
 
 using namespace std::chrono_literals;
 
 Quake3Bsp::Quake3Bsp() {
-    _logger = spdlog::stdout_color_mt("bsp");
+    _logger = spdlog::get("bsp");
+    if(_logger == nullptr)
+        _logger = spdlog::stdout_color_mt("bsp");
+    _pool = &game::sys::ThreadPool::global();
+    _use_cache = Config::map_use_cache();
+    bezier_level(Config::patch_level());
+    _visibility_cache_size = Config::visibility_cache_size();
+    _cull_faces = Config::frustum_cull_faces();
+    _walk_nodes = Config::frustum_walk_nodes();
+    _occlusion_cull = Config::occlusion_cull();
+    _occlusion.resize(Config::occlusion_width(), Config::occlusion_height());
+    occluders(Config::occluder_max_faces(), Config::occluder_min_size());
+
+    _patch_lod.reset(new game::sys::PatchLod());
+    _patch_lod->pool(_pool);
+    _patch_lod->levels(Config::patch_lod_min_level(), Config::patch_lod_max_level(),
+                       Config::patch_lod_distance());
 }
 
-bool Quake3Bsp::create_texture(uint32_t &texture, const std::string &filename) {
-    _logger->info("Loading texture: {}", filename);
-    std::unique_ptr<SDL_Surface, decltype(&SDL_FreeSurface)> img =
-        decltype(img)(IMG_Load((Config::data_path() + filename).c_str()),
-                      SDL_FreeSurface);
-    if(!img) {
-        _logger->error("Failed to load image, SDL_error: {}", IMG_GetError());
-        return false;
-    }
-    // Generate a texture with the associative texture _id stored in the array
-    glGenTextures(1, &texture);
-
-    // This sets the alignment requirements for the start of each pixel row in memory.
-    glPixelStorei (GL_UNPACK_ALIGNMENT, 1);
-
-    // Bind the texture to the texture arrays index and init the texture
-    glBindTexture(GL_TEXTURE_2D, texture);
-
-    int texture_type = GL_RGB;
-    if(img->format->BytesPerPixel == 4) texture_type = GL_RGBA;
-
-    // Build Mipmaps (builds different versions of the picture for distances - looks better)
-    gluBuild2DMipmaps(GL_TEXTURE_2D, img->format->BytesPerPixel, img->w,
-                      img->h, texture_type, GL_UNSIGNED_BYTE, img->pixels);
+// This is our maximum height that the user can climb over
+const float MAX_STEP_HEIGHT = 10.0f;
 
-    //Assign the mip map levels and texture info
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
-    glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+// This holds the gamma value that was stored in the config file
+static float g_Gamma = 3;
 
-    return true;
+void Quake3Bsp::change_gamma(uint8_t *pImage, int size, float factor) {
+    // Vectorized for the CPU, gives the same bytes as going through every
+    // pixel one by one
+    game::sys::ImageOps::gamma(pImage, size / 3, factor);
 }
 
 
-// This is our maximum height that the user can climb over
-const float MAX_STEP_HEIGHT = 10.0f;
+LightmapSlot Quake3Bsp::lightmap_slot(int lightmap_id) const {
+    const int per_row_max = LIGHTMAP_ATLAS_MAX_SIZE / LIGHTMAP_SIZE;
+    const int per_atlas_max = per_row_max * per_row_max;
 
-// This will store how many faces are drawn and are seen by the camera
-static int g_VisibleFaces = 0;
+    LightmapSlot slot;
+    slot.atlas = lightmap_id / per_atlas_max;
 
-// This tells us if we want to render the lightmaps
-static bool g_bLightmaps = true;
+    // The last atlas only grows as large as its lightmaps need
+    int count = std::min(per_atlas_max, _lightmaps_num - slot.atlas * per_atlas_max);
+    int per_row = 1;
+    while(per_row * per_row < count) per_row *= 2;
 
-// This holds the gamma value that was stored in the config file
-static float g_Gamma = 3;
+    int index = lightmap_id % per_atlas_max;
+    slot.x = (index % per_row) * LIGHTMAP_SIZE;
+    slot.y = (index / per_row) * LIGHTMAP_SIZE;
+    slot.atlas_size = per_row * LIGHTMAP_SIZE;
+    return slot;
+}
 
-// This tells us if we want to render the textures
-static bool g_bTextures = true;
+int Quake3Bsp::lightmap_atlases_num() const {
+    const int per_row_max = LIGHTMAP_ATLAS_MAX_SIZE / LIGHTMAP_SIZE;
+    const int per_atlas_max = per_row_max * per_row_max;
+    return (_lightmaps_num + per_atlas_max - 1) / per_atlas_max;
+}
 
-void Quake3Bsp::change_gamma(uint8_t *pImage, int size, float factor) {
-    // Go through every pixel in the lightmap
-    for(int i = 0; i < size / 3; i++, pImage += 3) {
-        float scale = 1.0f, temp = 0.0f;
-        float r = 0, g = 0, b = 0;
+void Quake3Bsp::remap_lightmap_coords() {
+    BSPVertex *verts = _verts.mutable_data();
+    int verts_num = _verts.size();
 
-        // extract the current RGB values
-        r = (float)pImage[0];
-        g = (float)pImage[1];
-        b = (float)pImage[2];
+    // Faces don't share vertices in q3map output, but a shared vertex must
+    // not be moved twice
+    std::vector<int> owners(verts_num, -1);
+    bool has_conflicts = false;
 
-        // Multiply the factor by the RGB values, while keeping it to a 255 ratio
-        r = r * factor / 255.0f;
-        g = g * factor / 255.0f;
-        b = b * factor / 255.0f;
+    for(const auto &face : _faces) {
+        if(face.lightmap_id < 0 || face.lightmap_id >= _lightmaps_num) continue;
+        if(face.start_vert_index < 0 || face.verts_num < 0 ||
+           face.start_vert_index + face.verts_num > verts_num) continue;
 
-        // Check if the the values went past the highest value
-        if(r > 1.0f && (temp = (1.0f/r)) < scale) scale=temp;
-        if(g > 1.0f && (temp = (1.0f/g)) < scale) scale=temp;
-        if(b > 1.0f && (temp = (1.0f/b)) < scale) scale=temp;
+        LightmapSlot slot = lightmap_slot(face.lightmap_id);
+        glm::vec2 offset(float(slot.x) / slot.atlas_size, float(slot.y) / slot.atlas_size);
+        float scale = float(LIGHTMAP_SIZE) / slot.atlas_size;
 
-        // Get the scale for this pixel and multiply it by our pixel values
-        scale*=255.0f;
-        r*=scale;   g*=scale;   b*=scale;
+        for(int i = face.start_vert_index; i < face.start_vert_index + face.verts_num; i++) {
+            if(owners[i] >= 0) {
+                has_conflicts |= owners[i] != face.lightmap_id;
+                continue;
+            }
+            owners[i] = face.lightmap_id;
+            verts[i].lightmap_coord = offset + verts[i].lightmap_coord * scale;
+        }
+    }
 
-        // Assign the new gamma'nized RGB values to our image
-        pImage[0] = (uint8_t)r;
-        pImage[1] = (uint8_t)g;
-        pImage[2] = (uint8_t)b;
+    if(has_conflicts) {
+        _logger->warn("Some vertices are shared by faces with different lightmaps");
     }
 }
 
+void Quake3Bsp::create_lightmap_atlas(uint32_t &texture, int atlas) {
+    const int per_row_max = LIGHTMAP_ATLAS_MAX_SIZE / LIGHTMAP_SIZE;
+    const int per_atlas_max = per_row_max * per_row_max;
+    int first = atlas * per_atlas_max;
+    int last = std::min(_lightmaps_num, first + per_atlas_max);
+    int size = lightmap_slot(first).atlas_size;
+
+    // Copy every lightmap row into its place, unused cells stay black
+    const size_t row_size = LIGHTMAP_SIZE * 3;
+    std::vector<uint8_t> pixels(size_t(size) * size * 3, 0);
+    for(int i = first; i < last; i++) {
+        LightmapSlot slot = lightmap_slot(i);
+        const uint8_t *src = &_lightmaps[i].imageBits[0][0][0];
+        for(int row = 0; row < LIGHTMAP_SIZE; row++) {
+            memcpy(&pixels[(size_t(slot.y + row) * size + slot.x) * 3], src + row * row_size, row_size);
+        }
+    }
 
-void Quake3Bsp::create_lightmap_texture(uint32_t &texture, uint8_t *pImageBits, int width, int height) {
     // Generate a texture with the associative texture _id stored in the array
     glGenTextures(1, &texture);
 
@@ -121,111 +162,209 @@ void Quake3Bsp::create_lightmap_texture(uint32_t &texture, uint8_t *pImageBits,
 
     // Bind the texture to the texture arrays index and init the texture
     glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, size, size, 0, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+
+    // No mipmaps, the smaller levels would blend neighbouring lightmaps
+    // together. Lightmaps are blurry enough to be minified linearly.
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    // The shaders modulate the lightmap themselves, and the core profile
+    // they run in has no texture environment
+    if(_render_backend != RenderBackend::Glsl) glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+}
 
-    // Change the lightmap gamma values by our desired gamma
-    change_gamma(pImageBits, width*height*3, g_Gamma);
-
-    // Build Mipmaps (builds different versions of the picture for distances - looks better)
-    gluBuild2DMipmaps(GL_TEXTURE_2D, 3, width, height, GL_RGB, GL_UNSIGNED_BYTE, pImageBits);
-
-    //Assign the mip map levels
-    glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
-    glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+void Quake3Bsp::find_texture(char *filename) {
+    // The index prefers .jpg over .tga when both exist
+    const auto *asset = game::sys::AssetIndex::global().find(filename);
+    if(asset == nullptr || asset->name.size() >= sizeof(BSPTexture::name)) return;
+    std::copy(asset->name.begin(), asset->name.end(), filename);
+    filename[asset->name.size()] = '\0';
 }
 
-static bool file_exists(const std::string& str) {
-   std::ifstream fs(str);
-   return fs.is_open();
+bool Quake3Bsp::validate_lumps(const BSPHeader &header, const BSPLump *lumps, size_t file_size) {
+    if(strncmp(header.str_id, BSP_IDENT, 4) != 0 || header.version != BSP_VERSION) {
+        _logger->error("Not a Quake 3 BSP file (id {}, version {})",
+                       std::string(header.str_id, 4), header.version);
+        return false;
+    }
+
+    for(int i = 0; i < LUMP_MAX_LUMPS; i++) {
+        const BSPLump &lump = lumps[i];
+        if(lump.offset < 0 || lump.length < 0 ||
+           static_cast<size_t>(lump.offset) + lump.length > file_size) {
+            _logger->error("Lump {} is out of file bounds (offset {}, length {}, file size {})",
+                           i, lump.offset, lump.length, file_size);
+            return false;
+        }
+    }
+    return true;
 }
 
-void Quake3Bsp::find_texture(char *filename) {
-    std::string jpg_path = filename + std::string(".jpg");
-    std::string tga_path = filename + std::string(".tga");
+bool Quake3Bsp::validate_vis(const BSPLump &vis, const int *vis_header, size_t &size) {
+    if(static_cast<size_t>(vis.length) < 2 * sizeof(int)) {
+        _logger->error("Vis data lump is truncated");
+        return false;
+    }
 
-    if(file_exists(Config::data_path() + jpg_path)) {
-        std::copy(jpg_path.begin(), jpg_path.end(), filename);
-        return;
+    int clusters_num = vis_header[0], bytes_per_cluster = vis_header[1];
+    size = static_cast<size_t>(clusters_num) * static_cast<size_t>(bytes_per_cluster);
+    if(clusters_num < 0 || bytes_per_cluster < 0 || size > vis.length - 2 * sizeof(int)) {
+        _logger->error("Vis data doesn't fit its lump ({} clusters, {} bytes each)",
+                       clusters_num, bytes_per_cluster);
+        return false;
     }
+    return true;
+}
 
-    if(file_exists(Config::data_path() + tga_path)) {
-        std::copy(tga_path.begin(), tga_path.end(), filename);
-        return;
+// Points the array at the lump inside the mapping, or copies it if the lump
+// isn't aligned well enough to be used in place.
+template<typename T>
+static void map_lump(const game::sys::MappedFile &file, const BSPLump &lump, BSPLumpArray<T> &out) {
+    size_t count = lump.length / sizeof(T);
+    const T *data = file.at<T>(lump.offset);
+    if(lump.offset % alignof(T) == 0) {
+        out.view(data, count);
+    } else {
+        out.resize(count);
+        memcpy(out.mutable_data(), data, count * sizeof(T));
     }
 }
 
-BSPVertex operator+(const BSPVertex& v1, const BSPVertex& v2) {
-    BSPVertex temp;
-    temp.position = v1.position + v2.position;
-    temp.texture_coord = v1.texture_coord + v2.texture_coord;
-    temp.lightmap_coord = v1.lightmap_coord + v2.lightmap_coord;
-    temp.normal = v1.normal + v2.normal;
-    return temp;
+static bool read_at(int fd, void *data, size_t size, size_t offset) {
+    auto *dst = static_cast<uint8_t*>(data);
+    while(size > 0) {
+        ssize_t done = pread(fd, dst, size, offset);
+        if(done <= 0) return false;
+        dst += done;
+        offset += done;
+        size -= done;
+    }
+    return true;
 }
 
-BSPVertex operator*(const BSPVertex& v1, const float& d) {
-    BSPVertex temp;
-    temp.position = v1.position * d;
-    temp.texture_coord = v1.texture_coord * d;
-    temp.lightmap_coord = v1.lightmap_coord * d;
-    temp.normal = v1.normal * d;
-    return temp;
+template<typename T>
+static bool read_lump(int fd, const BSPLump &lump, BSPLumpArray<T> &out) {
+    size_t count = lump.length / sizeof(T);
+    out.resize(count);
+    if(count == 0) return true;
+    return read_at(fd, out.mutable_data(), count * sizeof(T), lump.offset);
 }
 
-void Quake3Bsp::tesselate(int control_offset, int control_width, int vert_offset, int index_offset) {
-    BSPVertex controls[9];
-    int cIndex = 0;
-    for (int c = 0; c < 3; c++) {
-        int pos = c * control_width;
-        controls[cIndex++] = _verts[control_offset + pos];
-        controls[cIndex++] = _verts[control_offset + pos + 1];
-        controls[cIndex++] = _verts[control_offset + pos + 2];
+void Quake3Bsp::run_tasks(std::vector<std::function<void()>> &tasks) {
+    if(_pool == nullptr) {
+        for(auto &task : tasks) task();
+        return;
     }
 
-    int L1 = BEZIER_LEVEL + 1;
+    std::vector<std::future<void>> futures;
+    futures.reserve(tasks.size());
+    for(auto &task : tasks) futures.emplace_back(_pool->submit(std::move(task)));
+    _pool->wait(futures);
+}
 
-    for (int j = 0; j <= BEZIER_LEVEL; ++j) {
-        float a = (float)j / BEZIER_LEVEL;
-        float b = 1.f - a;
-        _verts[vert_offset + j] = controls[0] * b * b + controls[3] * 2 * b * a + controls[6] * a * a;
+void Quake3Bsp::for_range(size_t count, size_t grain, const std::function<void(size_t, size_t)> &fn) {
+    if(_pool == nullptr) {
+        fn(0, count);
+        return;
     }
+    _pool->parallel_for(0, count, grain, fn);
+}
 
-    for (int i = 1; i <= BEZIER_LEVEL; ++i) {
-        float a = (float)i / BEZIER_LEVEL;
-        float b = 1.f - a;
-
-        BSPVertex temp[3];
+bool Quake3Bsp::read_bsp_stdio(const std::string &filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) {
+        _logger->error("Couldn't find BSP file {}", filename);
+        return false;
+    }
 
-        for (int j = 0; j < 3; ++j) {
-            int k = 3 * j;
-            temp[j] = controls[k + 0] * b * b + controls[k + 1] * 2 * b * a + controls[k + 2] * a * a;
-        }
+    BSPHeader header = {};
+    BSPLump lumps[LUMP_MAX_LUMPS] = {};
+    struct stat st = {};
+
+    if(fstat(fd, &st) != 0 ||
+       !read_at(fd, &header, sizeof(BSPHeader), 0) ||
+       !read_at(fd, &lumps, sizeof(lumps), sizeof(BSPHeader)) ||
+       !validate_lumps(header, lumps, st.st_size)) {
+        _logger->error("Failed to read BSP header from {}", filename);
+        close(fd);
+        return false;
+    }
 
-        for (int j = 0; j <= BEZIER_LEVEL; ++j) {
-            float a = (float)j / BEZIER_LEVEL;
-            float b = 1.f - a;
+    // Every lump goes to its own array, so they are read concurrently with
+    // positioned reads on the shared descriptor.
+    std::atomic<bool> is_read(true);
+    auto lump_task = [&is_read, fd](const BSPLump &lump, auto &out) -> std::function<void()> {
+        auto *dst = &out;
+        return [&is_read, fd, lump, dst] {
+            if(!read_lump(fd, lump, *dst)) is_read = false;
+        };
+    };
+
+    std::vector<std::function<void()>> tasks = {
+        lump_task(lumps[LUMP_FACES],        _faces),
+        lump_task(lumps[LUMP_VERTICES],     _verts),
+        lump_task(lumps[LUMP_INDICES],      _indices),
+        lump_task(lumps[LUMP_TEXTURES],     _textures),
+        lump_task(lumps[LUMP_LIGHTMAPS],    _lightmaps),
+        lump_task(lumps[LUMP_NODES],        _nodes),
+        lump_task(lumps[LUMP_LEAFS],        _leafs),
+        lump_task(lumps[LUMP_LEAF_FACES],   _leaf_faces),
+        lump_task(lumps[LUMP_PLANES],       _planes),
+        lump_task(lumps[LUMP_BRUSHES],      _brushes),
+        lump_task(lumps[LUMP_BRUSH_SIDES],  _brush_sides),
+        lump_task(lumps[LUMP_LEAF_BRUSHES], _leaf_brushes),
+    };
+
+    const BSPLump &vis = lumps[LUMP_VIS_DATA];
+    if(vis.length) {
+        tasks.emplace_back([this, &is_read, fd, vis] {
+            int vis_header[2] = {};
+            if(static_cast<size_t>(vis.length) >= sizeof(vis_header) &&
+               !read_at(fd, vis_header, sizeof(vis_header), vis.offset)) {
+                is_read = false;
+                return;
+            }
+            size_t size = 0;
+            if(!validate_vis(vis, vis_header, size)) {
+                is_read = false;
+                return;
+            }
+            _clusters.clusters_num = vis_header[0];
+            _clusters.bytes_per_cluster = vis_header[1];
+            _clusters.bitsets.resize(size);
 
-            _verts[vert_offset + i * L1 + j] = temp[0] * b * b + temp[1] * 2 * b * a + temp[2] * a * a;
-        }
+            if(!read_at(fd, _clusters.bitsets.mutable_data(), size, vis.offset + sizeof(vis_header)))
+                is_read = false;
+        });
     }
 
-    for (int i = 0; i <= BEZIER_LEVEL; ++i) {
-        for (int j = 0; j <= BEZIER_LEVEL; ++j) {
-            int offset = index_offset + (i * BEZIER_LEVEL + j) * 6;
-            _indices[offset + 0] = (i    ) * L1 + (j    ) + vert_offset;
-            _indices[offset + 1] = (i    ) * L1 + (j + 1) + vert_offset;
-            _indices[offset + 2] = (i + 1) * L1 + (j + 1) + vert_offset;
+    run_tasks(tasks);
+    close(fd);
 
-            _indices[offset + 3] = (i + 1) * L1 + (j + 1) + vert_offset;
-            _indices[offset + 4] = (i + 1) * L1 + (j    ) + vert_offset;
-            _indices[offset + 5] = (i    ) * L1 + (j    ) + vert_offset;
-        }
+    if(!is_read) {
+        _logger->error("Failed to read lumps from {}", filename);
+        return false;
     }
+    return true;
 }
 
-bool Quake3Bsp::load_bsp(const std::string &filename) {
+template<typename T>
+static bool read_lump(FILE *fp, const BSPLump &lump, BSPLumpArray<T> &out) {
+    size_t count = lump.length / sizeof(T);
+    out.resize(count);
+    if(count == 0) return true;
+    return fseek(fp, lump.offset, SEEK_SET) == 0 &&
+           fread(out.mutable_data(), sizeof(T), count, fp) == count;
+}
+
+// The reader the loader started with, kept as the baseline of the load
+// benchmark. It reads the lumps in file order on the calling thread, and
+// the vertices one at a time as it always did.
+bool Quake3Bsp::read_bsp_sequential(const std::string &filename) {
     FILE *fp = NULL;
-    int i = 0;
 
     if((fp = fopen(filename.c_str(), "rb")) == NULL) {
         _logger->error("Couldn't find BSP file {}", filename);
@@ -235,177 +374,363 @@ bool Quake3Bsp::load_bsp(const std::string &filename) {
     BSPHeader header = {};
     BSPLump lumps[LUMP_MAX_LUMPS] = {};
 
-    fread(&header, 1, sizeof(BSPHeader), fp);
-    fread(&lumps, LUMP_MAX_LUMPS, sizeof(BSPLump), fp);
-
-    size_t faces_num = lumps[LUMP_FACES].length / sizeof(BSPFace);
-    _faces.resize(faces_num);
-
-    fseek(fp, lumps[LUMP_FACES].offset, SEEK_SET);
-
-    fread(&_faces[0], faces_num, sizeof(BSPFace), fp);
-    int bezier_count = 0;
-	int bezier_patch_size = (BEZIER_LEVEL + 1) * (BEZIER_LEVEL + 1);
-	int bezier_index_size = BEZIER_LEVEL * BEZIER_LEVEL * 6;
-	for (int i = 0; i < faces_num; i++) {
-		if(_faces[i].type != FACE_PATCH) continue;
-		int dimx = (_faces[i].size[0] - 1) / 2;
-		int dimy = (_faces[i].size[0] - 1) / 2;
-		int size = dimx * dimy;
-		bezier_count += size;
-	}
+    bool is_read = fread(&header, sizeof(BSPHeader), 1, fp) == 1 &&
+                   fread(&lumps, sizeof(BSPLump), LUMP_MAX_LUMPS, fp) == LUMP_MAX_LUMPS &&
+                   fseek(fp, 0, SEEK_END) == 0;
+    if(!is_read || !validate_lumps(header, lumps, ftell(fp))) {
+        _logger->error("Failed to read BSP header from {}", filename);
+        fclose(fp);
+        return false;
+    }
 
-    size_t indices_num = lumps[LUMP_INDICES].length / sizeof(int);
-    _indices.resize(indices_num + bezier_index_size * bezier_count);
+    is_read = read_lump(fp, lumps[LUMP_FACES], _faces);
 
     size_t verts_num = lumps[LUMP_VERTICES].length / sizeof(BSPVertex);
-    _verts.resize(verts_num + bezier_patch_size * bezier_count);
-
-    _textures_num = lumps[LUMP_TEXTURES].length / sizeof(BSPTexture);
-    _textures.resize(_textures_num);
-
-    _lightmaps_num = lumps[LUMP_LIGHTMAPS].length / sizeof(BSPLightmap);
-    std::vector<BSPLightmap> lightmaps(_lightmaps_num);
+    _verts.resize(verts_num);
+    BSPVertex *verts = _verts.mutable_data();
 
     fseek(fp, lumps[LUMP_VERTICES].offset, SEEK_SET);
-
-
-    for(i = 0; i < verts_num; i++) {
-        fread(&_verts[i], 1, sizeof(BSPVertex), fp);
-        // Swap the y and z values, and negate the new z so Y is up.
-        float temp = _verts[i].position.y;
-        _verts[i].position.y = _verts[i].position.z;
-        _verts[i].position.z = -temp;
+    for(size_t i = 0; is_read && i < verts_num; i++) {
+        is_read = fread(&verts[i], sizeof(BSPVertex), 1, fp) == 1;
     }
 
-    fseek(fp, lumps[LUMP_INDICES].offset, SEEK_SET);
-
-    fread(&_indices[0], indices_num, sizeof(int), fp);
-
-
-    //for (int i = 0, vOffset = verts_num, iOffset = indices_num; i < faces_num; i++) {
-        //BSPFace &face = _faces[i];
-        //if (face.type == FACE_PATCH) {
-            //int dimX = (face.size[0] - 1) / 2;
-            //int dimY = (face.size[1] - 1) / 2;
-
-            //face.start_index = iOffset;
-
-            //for (int x = 0, n = 0; n < dimX; n++, x = 2 * n) {
-                //for (int y = 0, m = 0; m < dimY; m++, y = 2 * m) {
-                    //tesselate(face.start_vert_index + x + face.size[0] * y,
-                              //face.size[0], vOffset, iOffset);
-                    //vOffset += bezier_patch_size;
-                    //iOffset += bezier_index_size;
-                //}
-            //}
-
-            //face.indices_num = iOffset - face.start_index;
-        //} else {
-            //for (int i = 0; i < face.indices_num; i++) {
-                //_indices[face.start_index + i] += face.start_vert_index;
-            //}
-        //}
-    //}
-
-    fseek(fp, lumps[LUMP_TEXTURES].offset, SEEK_SET);
-
-    fread(&_textures[0], _textures_num, sizeof(BSPTexture), fp);
+    is_read = is_read && read_lump(fp, lumps[LUMP_INDICES], _indices);
+    is_read = is_read && read_lump(fp, lumps[LUMP_TEXTURES], _textures);
+    is_read = is_read && read_lump(fp, lumps[LUMP_LIGHTMAPS], _lightmaps);
+    is_read = is_read && read_lump(fp, lumps[LUMP_NODES], _nodes);
+    is_read = is_read && read_lump(fp, lumps[LUMP_LEAFS], _leafs);
+    is_read = is_read && read_lump(fp, lumps[LUMP_LEAF_FACES], _leaf_faces);
+    is_read = is_read && read_lump(fp, lumps[LUMP_PLANES], _planes);
+
+    const BSPLump &vis = lumps[LUMP_VIS_DATA];
+    if(is_read && vis.length) {
+        int vis_header[2] = {};
+        if(static_cast<size_t>(vis.length) >= sizeof(vis_header)) {
+            is_read = fseek(fp, vis.offset, SEEK_SET) == 0 &&
+                      fread(vis_header, sizeof(int), 2, fp) == 2;
+        }
+        size_t size = 0;
+        if(!is_read || !validate_vis(vis, vis_header, size)) {
+            fclose(fp);
+            return false;
+        }
+        _clusters.clusters_num = vis_header[0];
+        _clusters.bytes_per_cluster = vis_header[1];
+        _clusters.bitsets.resize(size);
 
-    for(i = 0; i < _textures_num; i++) {
-        find_texture(_textures[i].name);
-        create_texture(_textures_list[i], _textures[i].name);
+        is_read = fread(_clusters.bitsets.mutable_data(), 1, size, fp) == size;
     }
 
-    fseek(fp, lumps[LUMP_LIGHTMAPS].offset, SEEK_SET);
-
-    for(i = 0; i < _lightmaps_num ; i++) {
-        fread(&lightmaps[i], 1, sizeof(BSPLightmap), fp);
+    is_read = is_read && read_lump(fp, lumps[LUMP_BRUSHES], _brushes);
+    is_read = is_read && read_lump(fp, lumps[LUMP_BRUSH_SIDES], _brush_sides);
+    is_read = is_read && read_lump(fp, lumps[LUMP_LEAF_BRUSHES], _leaf_brushes);
 
-        // Create a texture map for each lightmap that is read in.  The lightmaps
-        // are always 128 by 128.
-        create_lightmap_texture(_lightmaps_list[i],
-                             (unsigned char *)lightmaps[i].imageBits, 128, 128);
+    fclose(fp);
+    if(!is_read) {
+        _logger->error("Failed to read lumps from {}", filename);
+        return false;
     }
+    return true;
+}
 
-    size_t nodes_num = lumps[LUMP_NODES].length / sizeof(BSPNode);
-    _nodes.resize(nodes_num);
-
-    fseek(fp, lumps[LUMP_NODES].offset, SEEK_SET);
-    fread(&_nodes[0], nodes_num, sizeof(BSPNode), fp);
+bool Quake3Bsp::read_bsp_mapped(const std::string &filename) {
+    _map_file.reset(new game::sys::MappedFile());
+    if(!_map_file->open(filename)) {
+        _logger->error("Couldn't find BSP file {}", filename);
+        return false;
+    }
 
-    _leafs_num = lumps[LUMP_LEAFS].length / sizeof(BSPLeaf);
-    _leafs.resize(_leafs_num);
+    const auto &file = *_map_file;
+    if(file.size() < sizeof(BSPHeader) + sizeof(BSPLump) * LUMP_MAX_LUMPS) {
+        _logger->error("BSP file {} is truncated", filename);
+        return false;
+    }
 
-    fseek(fp, lumps[LUMP_LEAFS].offset, SEEK_SET);
-    fread(&_leafs[0], _leafs_num, sizeof(BSPLeaf), fp);
+    const auto *header = file.at<BSPHeader>(0);
+    const auto *lumps = file.at<BSPLump>(sizeof(BSPHeader));
+    if(!validate_lumps(*header, lumps, file.size())) return false;
+
+    map_lump(file, lumps[LUMP_FACES], _faces);
+    map_lump(file, lumps[LUMP_VERTICES], _verts);
+    map_lump(file, lumps[LUMP_INDICES], _indices);
+    map_lump(file, lumps[LUMP_TEXTURES], _textures);
+    map_lump(file, lumps[LUMP_LIGHTMAPS], _lightmaps);
+    map_lump(file, lumps[LUMP_NODES], _nodes);
+    map_lump(file, lumps[LUMP_LEAFS], _leafs);
+    map_lump(file, lumps[LUMP_LEAF_FACES], _leaf_faces);
+    map_lump(file, lumps[LUMP_PLANES], _planes);
+    map_lump(file, lumps[LUMP_BRUSHES], _brushes);
+    map_lump(file, lumps[LUMP_BRUSH_SIDES], _brush_sides);
+    map_lump(file, lumps[LUMP_LEAF_BRUSHES], _leaf_brushes);
+
+    const BSPLump &vis = lumps[LUMP_VIS_DATA];
+    if(vis.length) {
+        int vis_header[2] = {};
+        if(static_cast<size_t>(vis.length) >= sizeof(vis_header))
+            memcpy(vis_header, file.at<uint8_t>(vis.offset), sizeof(vis_header));
+        size_t size = 0;
+        if(!validate_vis(vis, vis_header, size)) return false;
+        _clusters.clusters_num = vis_header[0];
+        _clusters.bytes_per_cluster = vis_header[1];
+        _clusters.bitsets.view(file.at<uint8_t>(vis.offset + 2 * sizeof(int)), size);
+    }
 
-    // Now we need to go through and convert all the leaf bounding boxes
-    // to the normal OpenGL Y up axis.
-    for(i = 0; i < _leafs_num; i++) {
-        // Swap the min y and z values, then negate the new Z
-        int temp = _leafs[i].min.y;
-        _leafs[i].min.y = _leafs[i].min.z;
-        _leafs[i].min.z = -temp;
+    return true;
+}
 
-        // Swap the max y and z values, then negate the new Z
-        temp = _leafs[i].max.y;
-        _leafs[i].max.y = _leafs[i].max.z;
-        _leafs[i].max.z = -temp;
+bool Quake3Bsp::read_bsp(const std::string &filename) {
+    // The LOD tessellates from the control points, stop it first
+    _patch_lod->clear();
+    clear_visibility_cache();
+
+    // Drop the views into a previous mapping before releasing it
+    _verts.clear();
+    _indices.clear();
+    _faces.clear();
+    _textures.clear();
+    _lightmaps.clear();
+    _nodes.clear();
+    _leafs.clear();
+    _leaf_faces.clear();
+    _planes.clear();
+    _brushes.clear();
+    _brush_sides.clear();
+    _leaf_brushes.clear();
+    _patches.clear();
+    _clusters = {};
+    _map_file.reset();
+
+    // The cooked level is keyed by the source contents, so a changed .bsp
+    // or changed load settings simply miss the cache.
+    uint64_t key = 0;
+    std::string cooked_path = filename + COOKED_EXTENSION;
+    bool has_key = _use_cache && source_key(filename, key);
+    if(has_key && read_cooked(cooked_path, key)) {
+        update_counts();
+        reset_patch_lod();
+        update_bounds();
+        update_pvs();
+        update_areas();
+        update_collision();
+        return true;
     }
 
-    size_t leaf_faces_num = lumps[LUMP_LEAF_FACES].length / sizeof(int);
-    _leaf_faces.resize(leaf_faces_num);
+    bool done = false;
+    if(_load_mode == LoadMode::Mapped) {
+        done = read_bsp_mapped(filename);
+    } else if(_load_mode == LoadMode::Sequential) {
+        done = read_bsp_sequential(filename);
+    } else {
+        done = read_bsp_stdio(filename);
+    }
+    if(!done) return false;
 
-    fseek(fp, lumps[LUMP_LEAF_FACES].offset, SEEK_SET);
-    fread(&_leaf_faces[0], leaf_faces_num, sizeof(int), fp);
+    post_process();
+    update_counts();
+    reset_patch_lod();
+    update_bounds();
+    update_pvs();
+    update_areas();
+    update_collision();
 
-    size_t planes_num = lumps[LUMP_PLANES].length / sizeof(BSPPlane);
-    _planes.resize(planes_num);
+    if(has_key) write_cooked(cooked_path, key);
 
-    fseek(fp, lumps[LUMP_PLANES].offset, SEEK_SET);
-    fread(&_planes[0], planes_num, sizeof(BSPPlane), fp);
+    return true;
+}
 
-    for(i = 0; i < planes_num; i++) {
-        float temp = _planes[i].normal.y;
-        _planes[i].normal.y = _planes[i].normal.z;
-        _planes[i].normal.z = -temp;
+void Quake3Bsp::update_counts() {
+    _textures_num = _textures.size();
+    _lightmaps_num = _lightmaps.size();
+    _leafs_num = _leafs.size();
+    _faces_drawn.resize(_faces.size());
+
+    // Every face gets its own range of the index buffer uploaded later
+    _face_first_index.resize(_faces.size());
+    uint32_t first_index = 0;
+    for(size_t i = 0; i < _faces.size(); i++) {
+        _face_first_index[i] = first_index;
+        first_index += std::max(0, _faces[i].indices_num);
     }
+}
 
-    fseek(fp, lumps[LUMP_VIS_DATA].offset, SEEK_SET);
-
-    if(lumps[LUMP_VIS_DATA].length) {
-        fread(&(_clusters.clusters_num),     1, sizeof(int), fp);
-        fread(&(_clusters.bytes_per_cluster), 1, sizeof(int), fp);
-
-        int size = _clusters.clusters_num * _clusters.bytes_per_cluster;
-        _clusters.bitsets.resize(size);
-
-        fread(&_clusters.bitsets[0], 1, sizeof(uint8_t) * size, fp);
+bool Quake3Bsp::source_key(const std::string &filename, uint64_t &key) {
+    game::sys::MappedFile source;
+    if(!source.open(filename)) return false;
+
+    // Everything that changes the post-processed data is part of the key
+    struct {
+        float gamma;
+        int bezier_level;
+        int lightmap_atlas_size;
+    } settings = { g_Gamma, _bezier_level, LIGHTMAP_ATLAS_MAX_SIZE };
+
+    key = game::sys::fnv1a_words(source.data(), source.size());
+    key = game::sys::fnv1a(&settings, sizeof(settings), key);
+
+    // The cooked textures hold the names the asset index resolved, which
+    // change with the files under the data directory, not with the .bsp
+    if(source.size() < sizeof(BSPHeader) + sizeof(BSPLump) * LUMP_MAX_LUMPS) return false;
+    const auto *lumps = source.at<BSPLump>(sizeof(BSPHeader));
+    if(!validate_lumps(*source.at<BSPHeader>(0), lumps, source.size())) return false;
+    const BSPLump &lump = lumps[LUMP_TEXTURES];
+    size_t textures_num = lump.length / sizeof(BSPTexture);
+    for(size_t i = 0; i < textures_num; i++) {
+        BSPTexture texture;
+        memcpy(&texture, source.at<uint8_t>(lump.offset + i * sizeof(BSPTexture)), sizeof(BSPTexture));
+        texture.name[sizeof(texture.name) - 1] = '\0';
+        find_texture(texture.name);
+        key = game::sys::fnv1a(texture.name, strlen(texture.name) + 1, key);
     }
+    return true;
+}
 
-    size_t brushes_num = lumps[LUMP_BRUSHES].length / sizeof(int);
-    _brushes.resize(brushes_num);
+void Quake3Bsp::post_process() {
+    update_counts();
+
+    // The post-processing steps below touch disjoint arrays, so they run
+    // concurrently and give the same result as running them in order.
+    // Every step copies a lump only if it has to transform it.
+    std::vector<std::function<void()>> tasks;
+
+    tasks.emplace_back([this] {
+        // Now we need to go through and convert all the leaf bounding boxes
+        // to the normal OpenGL Y up axis.
+        BSPLeaf *leafs = _leafs.mutable_data();
+        for(int i = 0; i < _leafs_num; i++) {
+            // Swap the min y and z values, then negate the new Z
+            int temp = leafs[i].min.y;
+            leafs[i].min.y = leafs[i].min.z;
+            leafs[i].min.z = -temp;
+
+            // Swap the max y and z values, then negate the new Z
+            temp = leafs[i].max.y;
+            leafs[i].max.y = leafs[i].max.z;
+            leafs[i].max.z = -temp;
+        }
+    });
+
+    tasks.emplace_back([this] {
+        BSPPlane *planes = _planes.mutable_data();
+        for(size_t i = 0; i < _planes.size(); i++) {
+            float temp = planes[i].normal.y;
+            planes[i].normal.y = planes[i].normal.z;
+            planes[i].normal.z = -temp;
+        }
+    });
+
+    tasks.emplace_back([this] {
+        // Change the lightmap gamma values by our desired gamma
+        BSPLightmap *lightmaps = _lightmaps.mutable_data();
+        for_range(_lightmaps_num, 4, [lightmaps, this](size_t begin, size_t end) {
+            for(size_t i = begin; i < end; i++) {
+                change_gamma((uint8_t *)lightmaps[i].imageBits,
+                             sizeof(BSPLightmap), g_Gamma);
+            }
+        });
+    });
+
+    tasks.emplace_back([this] {
+        // Names are resolved through the asset index, the GL textures
+        // themselves are created later on the context thread.
+        BSPTexture *textures = _textures.mutable_data();
+        for(int i = 0; i < _textures_num; i++) find_texture(textures[i].name);
+    });
+
+    tasks.emplace_back([this] {
+        size_t verts_num = _verts.size();
+        BSPVertex *verts = _verts.mutable_data();
+        for_range(verts_num, 16384, [verts](size_t begin, size_t end) {
+            for(size_t i = begin; i < end; i++) {
+                // Swap the y and z values, and negate the new z so Y is up.
+                float temp = verts[i].position.y;
+                verts[i].position.y = verts[i].position.z;
+                verts[i].position.z = -temp;
+            }
+        });
+
+        remap_lightmap_coords();
+    });
 
-    fseek(fp, lumps[LUMP_BRUSHES].offset, SEEK_SET);
-    fread(&_brushes[0], brushes_num, sizeof(BSPBrush), fp);
+    run_tasks(tasks);
 
-    size_t brush_sides_num = lumps[LUMP_BRUSH_SIDES].length / sizeof(int);
-    _brush_sides.resize(brush_sides_num);
+    // Patches are evaluated from the converted control points, so the
+    // tessellated vertices need no conversion of their own
+    tessellate_patches();
+}
 
-    // Read in the brush sides data
-    fseek(fp, lumps[LUMP_BRUSH_SIDES].offset, SEEK_SET);
-    fread(&_brush_sides[0], brush_sides_num, sizeof(BSPBrushSide), fp);
+uint64_t Quake3Bsp::data_hash() const {
+    uint64_t hash = game::sys::FNV_OFFSET_BASIS;
+    auto add = [&hash](const auto &array) {
+        hash = game::sys::fnv1a(array.data(), array.size() * sizeof(array[0]), hash);
+    };
+    add(_verts);
+    add(_indices);
+    add(_faces);
+    add(_textures);
+    add(_lightmaps);
+    add(_nodes);
+    add(_leafs);
+    add(_leaf_faces);
+    add(_planes);
+    add(_brushes);
+    add(_brush_sides);
+    add(_leaf_brushes);
+    add(_patches);
+    add(_clusters.bitsets);
+    return hash;
+}
 
-    size_t leaf_brushes_num = lumps[LUMP_LEAF_BRUSHES].length / sizeof(int);
-    _leaf_brushes.resize(leaf_brushes_num);
+bool Quake3Bsp::load_bsp(const std::string &filename) {
+    auto start = std::chrono::steady_clock::now();
+
+    if(!read_bsp(filename)) return false;
+
+    auto read_end = std::chrono::steady_clock::now();
+
+    // The images are decoded on the pool and uploaded a few per frame by
+    // update_textures(), the level is drawn with the placeholder meanwhile
+    _streamer.clear();
+    _streamer.pool(_pool);
+    _streamer.is_core_profile(_render_backend == RenderBackend::Glsl);
+    _streamer.init();
+    const auto &assets = game::sys::AssetIndex::global();
+    for(int i = 0; i < _textures_num; i++) {
+        const auto *asset = assets.find(_textures[i].name);
+        if(asset == nullptr) {
+            // Shader names without an image of their own keep the placeholder
+            _logger->warn("Texture {} not found", _textures[i].name);
+            _textures_list[i] = _streamer.placeholder();
+            continue;
+        }
+        _streamer.request(asset->path, &_textures_list[i]);
+    }
+    if(!Config::texture_streaming()) _streamer.finish();
 
-    fseek(fp, lumps[LUMP_LEAF_BRUSHES].offset, SEEK_SET);
-    fread(&_leaf_brushes[0], leaf_brushes_num, sizeof(int), fp);
+    // Create a texture map for each atlas, every lightmap refers to the
+    // atlas it was packed into
+    _lightmap_atlases.resize(lightmap_atlases_num());
+    for(size_t i = 0; i < _lightmap_atlases.size(); i++) {
+        create_lightmap_atlas(_lightmap_atlases[i], i);
+    }
+    for(int i = 0; i < _lightmaps_num; i++) {
+        _lightmaps_list[i] = _lightmap_atlases[lightmap_slot(i).atlas];
+    }
 
-    fclose(fp);
+    // The vertex arrays are laid out for the backend that draws them
+    if(_render_backend == RenderBackend::Glsl && !create_world_program()) {
+        _logger->warn("Failed to create the world shader, drawing with the legacy renderer");
+        _render_backend = RenderBackend::Legacy;
+    }
+    create_world_buffers();
+    _is_uploaded = true;
 
-    _faces_drawn.resize(faces_num);
+    auto end = std::chrono::steady_clock::now();
+    std::chrono::duration<double, std::milli> read_time = read_end - start;
+    std::chrono::duration<double, std::milli> total_time = end - start;
+    _logger->info("Loaded {} in {:.2f} ms (read {:.2f} ms, {} loader), {} textures pending",
+                  filename, total_time.count(), read_time.count(),
+                  _load_mode == LoadMode::Mapped ? "mmap" :
+                  _load_mode == LoadMode::Sequential ? "sequential" : "stdio", _streamer.pending());
 
     return true;
 }
@@ -444,20 +769,294 @@ int Quake3Bsp::find_leaf(const glm::vec3 &pos) {
     return ~i;  // Binary operation
 }
 
-inline int Quake3Bsp::is_cluster_visible(int current, int test) {
-    // Make sure we have valid memory and that the current cluster is > 0.
-    // If we don't have any memory or a negative cluster, return a visibility (1).
-    if(_clusters.bitsets.empty() || current < 0) return 1;
+int Quake3Bsp::is_cluster_visible(int current, int test) {
+    // If we don't have any vis data or a negative cluster, everything is
+    // visible. Leafs without a cluster are not visible from one.
+    return _pvs.visible(current, test) ? 1 : 0;
+}
+
+void Quake3Bsp::update_pvs() {
+    // Big levels keep their rows compressed, most of their words are empty
+    int compress_clusters = Config::pvs_compress_clusters();
+    bool compress = compress_clusters > 0 && _clusters.clusters_num >= compress_clusters;
+    _pvs.reset(_clusters.clusters_num, _clusters.bytes_per_cluster,
+               _clusters.bitsets.empty() ? nullptr : _clusters.bitsets.data(), compress);
+
+    _leaf_clusters.resize(_leafs.size());
+    for(size_t i = 0; i < _leafs.size(); i++) _leaf_clusters[i] = _leafs[i].cluster;
+
+    _logger->debug("PVS of {} clusters takes {} bytes{}", _pvs.clusters(), _pvs.memory(),
+                   _pvs.is_compressed() ? " compressed" : "");
+}
+
+void Quake3Bsp::update_collision() {
+    // One more leaf past the map's own, without brushes, takes the place
+    // of every child the tree can't have
+    _collision_leafs.resize(_leafs.size() + 1);
+    for(size_t i = 0; i < _leafs.size(); i++) {
+        const BSPLeaf &leaf = _leafs[i];
+        bool is_valid = leaf.leaf_brush >= 0 && leaf.leaf_brushes_num >= 0 &&
+                        leaf.leaf_brush + leaf.leaf_brushes_num <= int(_leaf_brushes.size());
+        _collision_leafs[i] = { leaf.leaf_brush, is_valid ? leaf.leaf_brushes_num : 0 };
+    }
+    _collision_leafs.back() = { 0, 0 };
+    const int32_t empty_leaf = -int32_t(_leafs.size()) - 1;
+
+    // Every plane gets its type and the signs of its normal. Only exact
+    // axes count as axial, so that one coordinate is exactly the distance
+    // the dot product would give.
+    _plane_classes.resize(_planes.size());
+    for(size_t i = 0; i < _planes.size(); i++) {
+        const glm::vec3 &n = _planes[i].normal;
+        PlaneClass &plane_class = _plane_classes[i];
+        plane_class.type = PLANE_NON_AXIAL;
+        plane_class.signbits = 0;
+        for(int axis = 0; axis < 3; axis++) {
+            if(n[axis] < 0.0f) plane_class.signbits |= 1 << axis;
+            if((n[axis] == 1.0f || n[axis] == -1.0f) && n[(axis + 1) % 3] == 0.0f &&
+               n[(axis + 2) % 3] == 0.0f) {
+                plane_class.type = axis;
+            }
+        }
+    }
+
+    // Depth first from the root, the front child before the back one,
+    // giving every node its place in the new order. A child out of range,
+    // or a node reached a second time, would send the traces outside the
+    // arrays or around a loop forever, so it becomes the empty leaf.
+    struct Visit {
+        int node;
+        int depth;
+        int32_t *child;   // Where the parent keeps its place
+    };
+    _collision_nodes.clear();
+    _collision_nodes.reserve(_nodes.size());
+    _collision_depth = 0;
+    std::vector<bool> placed(_nodes.size(), false);
+    std::vector<int> order;
+    std::vector<Visit> stack;
+    int32_t root = 0;
+    int bad_children = 0;
+    if(!_nodes.empty()) stack.push_back({ 0, 1, &root });
+    while(!stack.empty()) {
+        Visit visit = stack.back();
+        stack.pop_back();
+        if(visit.node < 0) {
+            bool is_leaf = -(visit.node + 1) < int(_leafs.size());
+            *visit.child = is_leaf ? visit.node : empty_leaf;
+            bad_children += !is_leaf;
+            continue;
+        }
+        if(visit.node >= int(_nodes.size()) || placed[visit.node]) {
+            *visit.child = empty_leaf;
+            bad_children++;
+            continue;
+        }
+        placed[visit.node] = true;
+        *visit.child = int32_t(order.size());
+        order.push_back(visit.node);
+        _collision_depth = std::max(_collision_depth, visit.depth);
+
+        // The children are written straight into the packed node, which
+        // never moves as there is room for every node
+        _collision_nodes.emplace_back();
+        CollisionNode &packed = _collision_nodes.back();
+        const BSPNode &node = _nodes[visit.node];
+        stack.push_back({ node.back, visit.depth + 1, &packed.children[1] });
+        stack.push_back({ node.front, visit.depth + 1, &packed.children[0] });
+    }
+    if(bad_children > 0) {
+        _logger->warn("{} nodes have children outside the tree, they are left empty", bad_children);
+    }
+
+    for(size_t i = 0; i < order.size(); i++) {
+        const BSPNode &node = _nodes[order[i]];
+        BSPPlane plane = {};
+        PlaneClass plane_class = { PLANE_NON_AXIAL, 0 };
+        if(node.plane >= 0 && node.plane < int(_planes.size())) {
+            plane = _planes[node.plane];
+            plane_class = _plane_classes[node.plane];
+        }
+        CollisionNode &packed = _collision_nodes[i];
+        packed.normal = plane.normal;
+        packed.d = plane.d;
+        packed.type = plane_class.type;
+        packed.signbits = plane_class.signbits;
+    }
+
+    // The axial sides of every brush, its other side planes in groups of
+    // CollisionSides::LANES, and the box of its axial sides
+    static_assert(CollisionSides::LANES == SIDE_LANES, "the side tests take SIDE_LANES planes");
+    const int lanes = CollisionSides::LANES;
+    _collision_brushes.resize(_brushes.size());
+    _collision_axial.clear();
+    _collision_sides.clear();
+    for(size_t i = 0; i < _brushes.size(); i++) {
+        const BSPBrush &brush = _brushes[i];
+        CollisionBrush &packed = _collision_brushes[i];
+        packed.min = glm::vec3(-FLT_MAX);
+        packed.max = glm::vec3(FLT_MAX);
+        packed.first_axial = int32_t(_collision_axial.size());
+        packed.axial_num = 0;
+        packed.first_sides = int32_t(_collision_sides.size());
+        packed.sides_num = 0;
+        packed.contents = 0;
+
+        bool is_valid = brush.brush_side >= 0 && brush.brush_sides_num > 0 &&
+                        brush.brush_side + brush.brush_sides_num <= int(_brush_sides.size()) &&
+                        brush.texture_id >= 0 && brush.texture_id < int(_textures.size());
+        for(int k = 0; is_valid && k < brush.brush_sides_num; k++) {
+            int plane = _brush_sides[brush.brush_side + k].plane;
+            is_valid = plane >= 0 && plane < int(_planes.size());
+        }
+        if(!is_valid) continue;
+
+        packed.contents = _textures[brush.texture_id].texture_type;
+        for(int k = 0; k < brush.brush_sides_num; k++) {
+            int plane = _brush_sides[brush.brush_side + k].plane;
+            const BSPPlane &p = _planes[plane];
+            const PlaneClass &plane_class = _plane_classes[plane];
+            if(plane_class.type != PLANE_NON_AXIAL) {
+                // The brush is behind its sides, so an axial one bounds it
+                int axis = plane_class.type;
+                if(plane_class.signbits) packed.min[axis] = std::max(packed.min[axis], -p.d);
+                else packed.max[axis] = std::min(packed.max[axis], p.d);
+                _collision_axial.push_back({ p.d, k, plane, plane_class.type, plane_class.signbits });
+                packed.axial_num++;
+                continue;
+            }
+
+            if(packed.sides_num % lanes == 0) {
+                // Nothing is ever in front of a plane at FLT_MAX
+                CollisionSides sides = {};
+                std::fill(sides.d, sides.d + lanes, FLT_MAX);
+                std::fill(sides.plane, sides.plane + lanes, -1);
+                std::fill(sides.side, sides.side + lanes, -1);
+                _collision_sides.push_back(sides);
+            }
+            CollisionSides &sides = _collision_sides.back();
+            int lane = packed.sides_num++ % lanes;
+            sides.x[lane] = p.normal.x;
+            sides.y[lane] = p.normal.y;
+            sides.z[lane] = p.normal.z;
+            sides.d[lane] = p.d;
+            sides.plane[lane] = plane;
+            sides.side[lane] = k;
+        }
+    }
+}
+
+void Quake3Bsp::update_areas() {
+    int areas_num = 0;
+    _leaf_areas.resize(_leafs.size());
+    for(size_t i = 0; i < _leafs.size(); i++) {
+        _leaf_areas[i] = _leafs[i].area;
+        areas_num = std::max(areas_num, _leafs[i].area + 1);
+    }
+    _area_portals.reset(areas_num);
+    if(areas_num < 2) return;
+
+    // The leafs holding an area portal brush join the areas around them
+    std::vector<uint8_t> is_portal_leaf(_leafs.size(), 0);
+    for(size_t i = 0; i < _leafs.size(); i++) {
+        const BSPLeaf &leaf = _leafs[i];
+        for(int k = 0; k < leaf.leaf_brushes_num; k++) {
+            int brush_index = leaf.leaf_brush + k;
+            if(brush_index < 0 || brush_index >= int(_leaf_brushes.size())) break;
+            int brush = _leaf_brushes[brush_index];
+            if(brush < 0 || brush >= int(_brushes.size())) continue;
+            int texture = _brushes[brush].texture_id;
+            if(texture >= 0 && texture < int(_textures.size()) &&
+               (_textures[texture].texture_type & CONTENTS_AREAPORTAL)) {
+                is_portal_leaf[i] = 1;
+            }
+        }
+    }
+
+    // Sweeping the leafs along x finds the ones whose bounds share a face
+    std::vector<int> order;
+    for(size_t i = 0; i < _leafs.size(); i++) {
+        if(is_portal_leaf[i] || (_leafs[i].cluster >= 0 && _leaf_areas[i] >= 0)) order.push_back(i);
+    }
+    std::sort(order.begin(), order.end(), [this](int a, int b) {
+        return _leaf_bounds[a].min.x < _leaf_bounds[b].min.x;
+    });
+
+    std::vector<std::pair<int, int>> bridges;    // Portal leaf and an area next to it
+    for(size_t i = 0; i < order.size(); i++) {
+        const Bounds &a = _leaf_bounds[order[i]];
+        for(size_t j = i + 1; j < order.size() && _leaf_bounds[order[j]].min.x <= a.max.x; j++) {
+            const Bounds &b = _leaf_bounds[order[j]];
+            glm::vec3 min = glm::max(a.min, b.min), max = glm::min(a.max, b.max);
+            glm::vec3 overlap = max - min;
+            if(overlap.x < 0 || overlap.y < 0 || overlap.z < 0) continue;
+            if((overlap.x > 0) + (overlap.y > 0) + (overlap.z > 0) < 2) continue;
+
+            int leaf_a = order[i], leaf_b = order[j];
+            if(is_portal_leaf[leaf_a] || is_portal_leaf[leaf_b]) {
+                if(is_portal_leaf[leaf_a] && !is_portal_leaf[leaf_b])
+                    bridges.emplace_back(leaf_a, _leaf_areas[leaf_b]);
+                if(is_portal_leaf[leaf_b] && !is_portal_leaf[leaf_a])
+                    bridges.emplace_back(leaf_b, _leaf_areas[leaf_a]);
+                continue;
+            }
+            if(_leaf_areas[leaf_a] != _leaf_areas[leaf_b]) {
+                _area_portals.add(_leaf_areas[leaf_a], _leaf_areas[leaf_b], min, max);
+            }
+        }
+    }
+
+    std::sort(bridges.begin(), bridges.end());
+    bridges.erase(std::unique(bridges.begin(), bridges.end()), bridges.end());
+    for(size_t i = 0; i < bridges.size(); i++) {
+        for(size_t j = i + 1; j < bridges.size() && bridges[j].first == bridges[i].first; j++) {
+            const Bounds &bounds = _leaf_bounds[bridges[i].first];
+            _area_portals.add(bridges[i].second, bridges[j].second, bounds.min, bounds.max);
+        }
+    }
+
+    _logger->debug("{} areas with {} area portals", _area_portals.areas(), _area_portals.portals().size());
+}
+
+int Quake3Bsp::area_portal(size_t index, bool open) {
+    if(!_area_portals.open(index, open)) return 0;
+    clear_visibility_cache();
+    return 1;
+}
 
-    // Use binary math to get the 8 bit visibility set for the current cluster
-    uint8_t visSet = _clusters.bitsets[(current*_clusters.bytes_per_cluster) + (test / 8)];
+int Quake3Bsp::area_portal(int area1, int area2, bool open) {
+    int changed = 0;
+    const auto &portals = _area_portals.portals();
+    for(size_t i = 0; i < portals.size(); i++) {
+        if((portals[i].area1 == area1 && portals[i].area2 == area2) ||
+           (portals[i].area1 == area2 && portals[i].area2 == area1)) {
+            changed += _area_portals.open(i, open);
+        }
+    }
+    if(changed) clear_visibility_cache();
+    return changed;
+}
 
-    // Now that we have our vector (bitset), do some bit shifting to find if
-    // the "test" cluster is visible from the "current" cluster, according to the bitset.
-    int result = visSet & (1 << ((test) & 7));
+int Quake3Bsp::area_portal(const glm::vec3 &min, const glm::vec3 &max, bool open) {
+    int changed = 0;
+    const auto &portals = _area_portals.portals();
+    for(size_t i = 0; i < portals.size(); i++) {
+        const auto &portal = portals[i];
+        if(portal.min.x <= max.x && portal.min.y <= max.y && portal.min.z <= max.z &&
+           min.x <= portal.max.x && min.y <= portal.max.y && min.z <= portal.max.z) {
+            changed += _area_portals.open(i, open);
+        }
+    }
+    if(changed) clear_visibility_cache();
+    return changed;
+}
 
-    // Return the result ( either 1 (visible) or 0 (not visible) )
-    return ( result );
+bool Quake3Bsp::in_pvs(const glm::vec3 &a, const glm::vec3 &b) {
+    if(_leafs.empty()) return true;
+    const BSPLeaf &leaf_a = _leafs[find_leaf(a)];
+    const BSPLeaf &leaf_b = _leafs[find_leaf(b)];
+    return _pvs.visible(leaf_a.cluster, leaf_b.cluster) &&
+           _area_portals.connected(leaf_a.area, leaf_b.area);
 }
 
 glm::vec3 Quake3Bsp::try_step(glm::vec3 start, glm::vec3 end) {
@@ -487,22 +1086,247 @@ glm::vec3 Quake3Bsp::try_step(glm::vec3 start, glm::vec3 end) {
     return start;
 }
 
-glm::vec3 Quake3Bsp::trace(glm::vec3 start, glm::vec3 end) {
+// Traces keep this many waiting parts on their own stack, deeper trees
+// take one from the heap
+#define COLLISION_STACK_SIZE 64
+
+// The trace as the side plane tests read it. Every side is tested with
+// the corner of the box nearest to it, the mins where the normal is
+// positive and the maxs where it is negative, pushed out by offset.
+struct SideTest {
+    float start[3], end[3];
+    float mins[3], maxs[3];   // The box of a box trace, 0 for the others
+    float offset;             // The radius of a sphere trace, 0 for the others
+};
+
+// The arrays of a group of side planes
+struct SidePlanes {
+    const float *x, *y, *z, *d;
+};
+
+// Scalar reference for the distances of the start and end of a trace from
+// a group of side planes. The SIMD versions add in the same order. Returns
+// false, leaving some distances out, as soon as the start and the end are
+// both in front of one plane, as the trace then misses the brush.
+static bool side_distances_scalar(const SideTest &t, const SidePlanes &sides,
+                                  float *starts, float *ends) {
+    for(int k = 0; k < SIDE_LANES; k++) {
+        float x = sides.x[k] < 0.0f ? t.maxs[0] : t.mins[0];
+        float y = sides.y[k] < 0.0f ? t.maxs[1] : t.mins[1];
+        float z = sides.z[k] < 0.0f ? t.maxs[2] : t.mins[2];
+        float d = sides.d[k] + t.offset;
+        starts[k] = (t.start[0] + x) * sides.x[k] + (t.start[1] + y) * sides.y[k] +
+                    (t.start[2] + z) * sides.z[k] - d;
+        ends[k] = (t.end[0] + x) * sides.x[k] + (t.end[1] + y) * sides.y[k] +
+                  (t.end[2] + z) * sides.z[k] - d;
+        if(starts[k] > 0.0f && ends[k] > 0.0f) return false;
+    }
+    return true;
+}
+
+#ifdef BSP_X86
+
+// 4 planes per pass
+static bool side_distances_sse2(const SideTest &t, const SidePlanes &sides,
+                                float *starts, float *ends) {
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 offset = _mm_set1_ps(t.offset);
+    for(int k = 0; k < SIDE_LANES; k += 4) {
+        __m128 a = _mm_loadu_ps(sides.x + k), b = _mm_loadu_ps(sides.y + k);
+        __m128 c = _mm_loadu_ps(sides.z + k), d = _mm_add_ps(_mm_loadu_ps(sides.d + k), offset);
+
+        // The corner of the box along every axis, picked by the sign of the normal
+        __m128 mask = _mm_cmplt_ps(a, zero);
+        __m128 x = _mm_or_ps(_mm_and_ps(mask, _mm_set1_ps(t.maxs[0])), _mm_andnot_ps(mask, _mm_set1_ps(t.mins[0])));
+        mask = _mm_cmplt_ps(b, zero);
+        __m128 y = _mm_or_ps(_mm_and_ps(mask, _mm_set1_ps(t.maxs[1])), _mm_andnot_ps(mask, _mm_set1_ps(t.mins[1])));
+        mask = _mm_cmplt_ps(c, zero);
+        __m128 z = _mm_or_ps(_mm_and_ps(mask, _mm_set1_ps(t.maxs[2])), _mm_andnot_ps(mask, _mm_set1_ps(t.mins[2])));
+
+        __m128 start = _mm_sub_ps(_mm_add_ps(_mm_add_ps(
+            _mm_mul_ps(_mm_add_ps(_mm_set1_ps(t.start[0]), x), a),
+            _mm_mul_ps(_mm_add_ps(_mm_set1_ps(t.start[1]), y), b)),
+            _mm_mul_ps(_mm_add_ps(_mm_set1_ps(t.start[2]), z), c)), d);
+        __m128 end = _mm_sub_ps(_mm_add_ps(_mm_add_ps(
+            _mm_mul_ps(_mm_add_ps(_mm_set1_ps(t.end[0]), x), a),
+            _mm_mul_ps(_mm_add_ps(_mm_set1_ps(t.end[1]), y), b)),
+            _mm_mul_ps(_mm_add_ps(_mm_set1_ps(t.end[2]), z), c)), d);
+        _mm_storeu_ps(starts + k, start);
+        _mm_storeu_ps(ends + k, end);
+        if(_mm_movemask_ps(_mm_and_ps(_mm_cmpgt_ps(start, zero), _mm_cmpgt_ps(end, zero))))
+            return false;
+    }
+    return true;
+}
+
+// 8 planes per pass
+TARGET_AVX2
+static bool side_distances_avx2(const SideTest &t, const SidePlanes &sides,
+                                float *starts, float *ends) {
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 offset = _mm256_set1_ps(t.offset);
+    for(int k = 0; k < SIDE_LANES; k += 8) {
+        __m256 a = _mm256_loadu_ps(sides.x + k), b = _mm256_loadu_ps(sides.y + k);
+        __m256 c = _mm256_loadu_ps(sides.z + k), d = _mm256_add_ps(_mm256_loadu_ps(sides.d + k), offset);
+
+        __m256 x = _mm256_blendv_ps(_mm256_set1_ps(t.mins[0]), _mm256_set1_ps(t.maxs[0]),
+                                    _mm256_cmp_ps(a, zero, _CMP_LT_OQ));
+        __m256 y = _mm256_blendv_ps(_mm256_set1_ps(t.mins[1]), _mm256_set1_ps(t.maxs[1]),
+                                    _mm256_cmp_ps(b, zero, _CMP_LT_OQ));
+        __m256 z = _mm256_blendv_ps(_mm256_set1_ps(t.mins[2]), _mm256_set1_ps(t.maxs[2]),
+                                    _mm256_cmp_ps(c, zero, _CMP_LT_OQ));
+
+        __m256 start = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(
+            _mm256_mul_ps(_mm256_add_ps(_mm256_set1_ps(t.start[0]), x), a),
+            _mm256_mul_ps(_mm256_add_ps(_mm256_set1_ps(t.start[1]), y), b)),
+            _mm256_mul_ps(_mm256_add_ps(_mm256_set1_ps(t.start[2]), z), c)), d);
+        __m256 end = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(
+            _mm256_mul_ps(_mm256_add_ps(_mm256_set1_ps(t.end[0]), x), a),
+            _mm256_mul_ps(_mm256_add_ps(_mm256_set1_ps(t.end[1]), y), b)),
+            _mm256_mul_ps(_mm256_add_ps(_mm256_set1_ps(t.end[2]), z), c)), d);
+        _mm256_storeu_ps(starts + k, start);
+        _mm256_storeu_ps(ends + k, end);
+        __m256 out = _mm256_and_ps(_mm256_cmp_ps(start, zero, _CMP_GT_OQ), _mm256_cmp_ps(end, zero, _CMP_GT_OQ));
+        if(_mm256_movemask_ps(out)) return false;
+    }
+    return true;
+}
+
+#endif
+
+void Quake3Bsp::trace_isa(game::sys::Isa isa) {
+    _trace_isa = game::sys::is_supported(isa) ? isa : game::sys::best_isa();
+}
+
+// The state of one trace while it walks the tree
+struct Quake3Bsp::TraceWork {
+    TraceDesc desc;
+    glm::vec3 extents;        // The largest length of the box on every axis
+    glm::vec3 sweep_min;      // The box around everything the trace goes through
+    glm::vec3 sweep_max;
+    SideTest sides;
+    TraceResult result;
+    uint32_t *stamps;         // The mailbox of every brush, nullptr to check them all
+    uint32_t stamp;           // The number of this trace on its thread
+};
+
+// The brushes checked by the traces of a thread, each stamped with the
+// number of the last trace that checked it. A new trace takes a new
+// number, which no brush has yet, so nothing has to be cleared between
+// traces and threads never share a stamp.
+struct BrushMailbox {
+    uint32_t trace = 0;
+    std::vector<uint32_t> stamps;
+};
+static thread_local BrushMailbox thread_mailbox;
+
+TraceResult Quake3Bsp::trace(const TraceDesc &desc) const {
     // Initially we set our trace ratio to 1.0f, which means that we don't have
     // a collision or intersection point, so we can move freely.
-    _traceRatio = 1.0f;
+    TraceWork work;
+    work.desc = desc;
+    work.result = {};
+    work.result.fraction = 1.0f;
+
+    // Grab the extend of our box (the largest size for each x, y, z axis)
+    work.extents = glm::vec3(0.0f);
+    if(desc.type == TYPE_BOX) {
+        work.extents = glm::vec3(std::max(-desc.mins.x, desc.maxs.x),
+                                 std::max(-desc.mins.y, desc.maxs.y),
+                                 std::max(-desc.mins.z, desc.maxs.z));
+    }
+
+    // The whole movement with the box or sphere around it at both ends
+    glm::vec3 lo(0.0f), hi(0.0f);
+    if(desc.type == TYPE_BOX) {
+        lo = desc.mins;
+        hi = desc.maxs;
+    } else if(desc.type == TYPE_SPHERE) {
+        lo = glm::vec3(-desc.radius);
+        hi = glm::vec3(desc.radius);
+    }
+    work.sweep_min = glm::min(desc.start + lo, desc.end + lo);
+    work.sweep_max = glm::max(desc.start + hi, desc.end + hi);
+
+    SideTest &sides = work.sides;
+    for(int axis = 0; axis < 3; axis++) {
+        sides.start[axis] = desc.start[axis];
+        sides.end[axis] = desc.end[axis];
+        sides.mins[axis] = desc.type == TYPE_BOX ? desc.mins[axis] : 0.0f;
+        sides.maxs[axis] = desc.type == TYPE_BOX ? desc.maxs[axis] : 0.0f;
+    }
+    sides.offset = desc.type == TYPE_SPHERE ? desc.radius : 0.0f;
+
+    work.stamps = nullptr;
+    work.stamp = 0;
+    if(_brush_mailbox) {
+        BrushMailbox &mailbox = thread_mailbox;
+        if(mailbox.stamps.size() < _brushes.size()) mailbox.stamps.resize(_brushes.size(), 0);
+        if(++mailbox.trace == 0) {
+            // Wrapped around, the old stamps could match the new numbers
+            std::fill(mailbox.stamps.begin(), mailbox.stamps.end(), 0);
+            mailbox.trace = 1;
+        }
+        work.stamps = mailbox.stamps.data();
+        work.stamp = mailbox.trace;
+    }
+
+    // We go down the nodes from the first one (0) to see which brushes we should check
+    if(!_collision_nodes.empty()) check_nodes(work);
+
+    // Set our new position to a position that is right up to the brush we collided with
+    work.result.end_pos = work.result.fraction == 1.0f ?
+                          desc.end : desc.start + (desc.end - desc.start) * work.result.fraction;
+    return work.result;
+}
+
+void Quake3Bsp::trace(const TraceDesc *descs, TraceResult *results, size_t count,
+                      game::sys::ThreadPool *pool) const {
+    // Every trace writes only its own result, so chunks need no locking
+    auto run = [this, descs, results](size_t begin, size_t end) {
+        for(size_t i = begin; i < end; i++) results[i] = trace(descs[i]);
+    };
+    if(pool == nullptr) {
+        run(0, count);
+        return;
+    }
+    pool->parallel_for(0, count, 64, run);
+}
 
-    // We start out with the first node (0), setting our start and end ratio to 0 and 1.
-    // We will recursively go through all of the nodes to see which brushes we should check.
-    check_node(0, 0.0f, 1.0f, start, end);
+glm::vec3 Quake3Bsp::trace(glm::vec3 start, glm::vec3 end) {
+    TraceDesc desc = _move;
+    desc.start = start;
+    desc.end = end;
+    TraceResult result = trace(desc);
 
-    // If the traceRatio is STILL 1.0f, then we never collided and just return our end position
-    if(_traceRatio == 1.0f) {
+    // If the fraction is STILL 1.0f, then we never collided and just return our end position
+    if(result.fraction == 1.0f) {
         return end;
     }
     else {
-        // Set our new position to a position that is right up to the brush we collided with
-        glm::vec3 newPosition = start + ((end - start) * _traceRatio);
+        _is_collided = true;        // Let us know we collided!
+
+        // Store the normal of plane that we collided with for sliding calculations
+        _collisionNormal = result.plane.normal;
+
+        // This checks first tests if we actually moved along the x or z-axis,
+        // meaning that we went in a direction somewhere.  The next check makes
+        // sure that we don't always check to step every time we collide.  If
+        // the normal of the plane has a Y value of 1, that means it's just the
+        // flat ground and we don't need to check if we can step over it, it's flat!
+        if((start.x != end.x || start.z != end.z) && _collisionNormal.y != 1) {
+            // We can try and step over the wall we collided with
+            _is_try_step = true;
+        }
+
+        // Here we make sure that we don't slide slowly down walls when we
+        // jump and collide into them.  We only want to say that we are on
+        // the ground if we actually have stopped from falling.  A wall wouldn't
+        // have a high y value for the normal, it would most likely be 0.
+        if(_collisionNormal.y >= 0.2f)
+            _is_grounded = true;
+
+        glm::vec3 newPosition = result.end_pos;
 
         // Get the distance from the end point to the new position we just got
         glm::vec3 move = end - newPosition;
@@ -531,7 +1355,9 @@ glm::vec3 Quake3Bsp::trace(glm::vec3 start, glm::vec3 end) {
 glm::vec3 Quake3Bsp::trace_ray(glm::vec3 start, glm::vec3 end) {
     // We don't use this function, but we set it up to allow us to just check a
     // ray with the BSP tree brushes.  We do so by setting the trace type to TYPE_RAY.
-    _traceType = TYPE_RAY;
+    _move = {};
+    _move.type = TYPE_RAY;
+    _move.contents = CONTENTS_SOLID;
 
     // Run the normal trace() function with our start and end
     // position and return a new position
@@ -541,15 +1367,16 @@ glm::vec3 Quake3Bsp::trace_ray(glm::vec3 start, glm::vec3 end) {
 
 glm::vec3 Quake3Bsp::trace_sphere(glm::vec3 start, glm::vec3 end, float radius) {
     // Here we initialize the type of trace (SPHERE) and initialize other data
-    _traceType = TYPE_SPHERE;
+    _move = {};
+    _move.type = TYPE_SPHERE;
+    _move.radius = radius;
+    _move.contents = CONTENTS_SOLID;
     _is_collided = false;
 
     // Here we initialize our variables for a new round of collision checks
     _is_try_step = false;
     _is_grounded = false;
 
-    _traceRadius = radius;
-
     // Get the new position that we will return to the camera or player
     glm::vec3 newPosition = trace(start, end);
 
@@ -564,9 +1391,11 @@ glm::vec3 Quake3Bsp::trace_sphere(glm::vec3 start, glm::vec3 end, float radius)
 }
 
 glm::vec3 Quake3Bsp::trace_box(glm::vec3 start, glm::vec3 end, glm::vec3 min, glm::vec3 max) {
-    _traceType = TYPE_BOX;            // Set the trace type to a BOX
-    _traceMaxs = max;            // Set the max value of our AABB
-    _traceMins = min;            // Set the min value of our AABB
+    _move = {};
+    _move.type = TYPE_BOX;            // Set the trace type to a BOX
+    _move.maxs = max;            // Set the max value of our AABB
+    _move.mins = min;            // Set the min value of our AABB
+    _move.contents = CONTENTS_SOLID;
     _is_collided = false;            // Reset the collised flag
 
 
@@ -574,12 +1403,6 @@ glm::vec3 Quake3Bsp::trace_box(glm::vec3 start, glm::vec3 end, glm::vec3 min, gl
     _is_try_step = false;
     _is_grounded = false;
 
-    // Grab the extend of our box (the largest size for each x, y, z axis)
-    _extents = glm::vec3(-_traceMins.x > _traceMaxs.x ? -_traceMins.x : _traceMaxs.x,
-                          -_traceMins.y > _traceMaxs.y ? -_traceMins.y : _traceMaxs.y,
-                          -_traceMins.z > _traceMaxs.z ? -_traceMins.z : _traceMaxs.z);
-
-
     // Check if our movement collided with anything, then get back our new position
     glm::vec3 newPosition = trace(start, end);
 
@@ -595,76 +1418,112 @@ glm::vec3 Quake3Bsp::trace_box(glm::vec3 start, glm::vec3 end, glm::vec3 min, gl
 }
 
 
-void Quake3Bsp::check_node(int nodeIndex, float startRatio, float endRatio, glm::vec3 start, glm::vec3 end) {
-    // Check if the next node is a leaf
-    if(nodeIndex < 0) {
-        // If this node in the BSP is a leaf, we need to negate and add 1 to offset
-        // the real node index into the _leafs[] array.  You could also do [~nodeIndex].
-        BSPLeaf *pLeaf = &_leafs[-(nodeIndex + 1)];
-
-        // We have a leaf, so let's go through all of the brushes for that leaf
-        for(int i = 0; i < pLeaf->leaf_brushes_num; i++) {
-            // Get the current brush that we going to check
-            BSPBrush *pBrush = &_brushes[_leaf_brushes[pLeaf->leaf_brush + i]];
+void Quake3Bsp::check_nodes(TraceWork &work) const {
+    // The second halves of split traces wait here. Each one was split at
+    // another level of the tree, so there are never more than its depth.
+    TraceSpan local[COLLISION_STACK_SIZE];
+    std::vector<TraceSpan> heap;
+    TraceSpan *stack = local;
+    if(_collision_depth > COLLISION_STACK_SIZE) {
+        heap.resize(_collision_depth);
+        stack = heap.data();
+    }
+    size_t stack_size = 0;
 
-            // Check if we have brush sides and the current brush is solid and collidable
-            if((pBrush->brush_sides_num > 0) && (_textures[pBrush->texture_id].texture_type & 1)) {
-                // Now we delve into the dark depths of the real calculations for collision.
-                // We can now check the movement vector against our brush planes.
-                check_brush(pBrush, start, end);
-            }
-        }
+    // We start out with the first node (0) and the whole movement vector
+    int nodeIndex = 0;
+    glm::vec3 start = work.desc.start, end = work.desc.end;
 
-        // Since we found the brushes, we can go back up and stop recursing at this level
-        return;
-    }
+    // If we are doing sphere collision, include an offset for our collision tests below
+    float sphere_offset = work.desc.type == TYPE_SPHERE ? work.desc.radius : 0.0f;
+
+    for(;;) {
+        // Check if the next node is a leaf
+        if(nodeIndex < 0) {
+            // If this node in the BSP is a leaf, we need to negate and add 1 to offset
+            // the real node index into the _leafs[] array.  You could also do [~nodeIndex].
+            const CollisionLeaf &leaf = _collision_leafs[-(nodeIndex + 1)];
+
+            // We have a leaf, so let's go through all of the brushes for that leaf
+            for(int i = 0; i < leaf.brushes_num; i++) {
+                // Get the current brush that we going to check, unless this
+                // trace already did through another leaf
+                int brush_index = _leaf_brushes[leaf.first_brush + i];
+                if(work.stamps != nullptr) {
+                    if(work.stamps[brush_index] == work.stamp) continue;
+                    work.stamps[brush_index] = work.stamp;
+                }
+                const CollisionBrush &brush = _collision_brushes[brush_index];
 
-    // Grad the next node to work with and grab this node's plane data
-    BSPNode *pNode = &_nodes[nodeIndex];
-    BSPPlane *pPlane = &_planes[pNode->plane];
+                // Check if we have brush sides and the current brush stops this trace
+                if(brush.contents & work.desc.contents) {
+                    // Now we delve into the dark depths of the real calculations for collision.
+                    // We can now check the movement vector against our brush planes.
+                    check_brush(work, brush);
+                }
+            }
 
-    // Here we use the plane equation to find out where our initial start position is
-    // according the the node that we are checking.  We then grab the same info for the end pos.
-    float startDistance = glm::dot(start, pPlane->normal) - pPlane->d;
-    float endDistance = glm::dot(end, pPlane->normal) - pPlane->d;
-    float offset = 0.0f;
+            // Since we found the brushes, we go on with the part of the
+            // trace waiting the longest, or stop when there is none
+            if(stack_size == 0) return;
+            const TraceSpan &span = stack[--stack_size];
+            nodeIndex = span.node;
+            start = span.start;
+            end = span.end;
+            continue;
+        }
 
-    // If we are doing sphere collision, include an offset for our collision tests below
-    if(_traceType == TYPE_SPHERE)
-        offset = _traceRadius;
+        // Grab the next node to work with, its plane is right there
+        const CollisionNode &node = _collision_nodes[nodeIndex];
+
+        float startDistance, endDistance;
+        float offset = sphere_offset;
+        if(node.type != PLANE_NON_AXIAL) {
+            // The normal of an axial plane is 1 or -1 on one axis, so the distances
+            // are one coordinate, and so is the extent of our AABB towards the plane
+            int axis = node.type;
+            startDistance = node.signbits ? -start[axis] - node.d : start[axis] - node.d;
+            endDistance = node.signbits ? -end[axis] - node.d : end[axis] - node.d;
+            if(work.desc.type == TYPE_BOX)
+                offset = work.extents[axis];
+        } else {
+            // Here we use the plane equation to find out where our initial start position is
+            // according the the node that we are checking.  We then grab the same info for the end pos.
+            startDistance = glm::dot(start, node.normal) - node.d;
+            endDistance = glm::dot(end, node.normal) - node.d;
+
+            // Here we check to see if we are working with a BOX or not
+            if(work.desc.type == TYPE_BOX) {
+                // Get the distance our AABB is from the current splitter plane
+                offset = (float)(fabs( work.extents.x * node.normal.x ) +
+                                 fabs( work.extents.y * node.normal.y ) +
+                                 fabs( work.extents.z * node.normal.z ) );
+            }
+        }
 
-    // Here we check to see if we are working with a BOX or not
-    else if(_traceType == TYPE_BOX) {
-        // Get the distance our AABB is from the current splitter plane
-        offset = (float)(fabs( _extents.x * pPlane->normal.x ) +
-                         fabs( _extents.y * pPlane->normal.y ) +
-                         fabs( _extents.z * pPlane->normal.z ) );
-    }
+        // Here we check to see if the start and end point are both in front of the current node.
+        // If so, we want to check all of the nodes in front of this current splitter plane.
+        if(startDistance >= offset && endDistance >= offset) {
+            nodeIndex = node.children[0];
+            continue;
+        }
+        // If both points are behind the current splitter plane, traverse down the back nodes
+        if(startDistance < -offset && endDistance < -offset) {
+            nodeIndex = node.children[1];
+            continue;
+        }
 
-    // Here we check to see if the start and end point are both in front of the current node.
-    // If so, we want to check all of the nodes in front of this current splitter plane.
-    if(startDistance >= offset && endDistance >= offset) {
-        // Traverse the BSP tree on all the nodes in front of this current splitter plane
-        check_node(pNode->front, startDistance, endDistance, start, end);
-    }
-    // If both points are behind the current splitter plane, traverse down the back nodes
-    else if(startDistance < -offset && endDistance < -offset) {
-        // Traverse the BSP tree on all the nodes in back of this current splitter plane
-        check_node(pNode->back, startDistance, endDistance, start, end);
-    }
-    else {
         // If we get here, then our ray needs to be split in half to check the nodes
         // on both sides of the current splitter plane.  Thus we create 2 ratios.
-        float Ratio1 = 1.0f, Ratio2 = 0.0f, middleRatio = 0.0f;
-        glm::vec3 middle;    // This stores the middle point for our split ray
+        float Ratio1 = 1.0f, Ratio2 = 0.0f;
 
         // Start of the side as the front side to check
-        int side = pNode->front;
+        int side = 0;
 
         // Here we check to see if the start point is in back of the plane (negative)
         if(startDistance < endDistance) {
             // Since the start position is in back, let's check the back nodes
-            side = pNode->back;
+            side = 1;
 
             // Here we create 2 ratios that hold a distance from the start to the
             // extent closest to the start (take into account a sphere and epsilon).
@@ -674,7 +1533,7 @@ void Quake3Bsp::check_node(int nodeIndex, float startRatio, float endRatio, glm:
         }
         // Check if the starting point is greater than the end point (positive)
         else if(startDistance > endDistance) {
-            // This means that we are going to recurse down the front nodes first.
+            // This means that we are going to walk down the front nodes first.
             // We do the same thing as above and get 2 ratios for split ray.
             float inverseDistance = 1.0f / (startDistance - endDistance);
             Ratio1 = (startDistance + offset + M_EPS) * inverseDistance;
@@ -683,84 +1542,52 @@ void Quake3Bsp::check_node(int nodeIndex, float startRatio, float endRatio, glm:
 
         // Make sure that we have valid numbers and not some weird float problems.
         // This ensures that we have a value from 0 to 1 as a good ratio should be :)
-        if (Ratio1 < 0.0f) Ratio1 = 0.0f;
-        else if (Ratio1 > 1.0f) Ratio1 = 1.0f;
-
-        if (Ratio2 < 0.0f) Ratio2 = 0.0f;
-        else if (Ratio2 > 1.0f) Ratio2 = 1.0f;
-
-        // Just like we do in the trace() function, we find the desired middle
-        // point on the ray, but instead of a point we get a middleRatio percentage.
-        middleRatio = startRatio + ((endRatio - startRatio) * Ratio1);
-        middle = start + ((end - start) * Ratio1);
-
-        // Now we recurse on the current side with only the first half of the ray
-        check_node(side, startRatio, middleRatio, start, middle);
-
-        // Now we need to make a middle point and ratio for the other side of the node
-        middleRatio = startRatio + ((endRatio - startRatio) * Ratio2);
-        middle = start + ((end - start) * Ratio2);
-
-        // Depending on which side should go last, traverse the bsp with the
-        // other side of the split ray (movement vector).
-        if(side == pNode->back)
-            check_node(pNode->front, middleRatio, endRatio, middle, end);
-        else
-            check_node(pNode->back, middleRatio, endRatio, middle, end);
+        Ratio1 = std::min(std::max(Ratio1, 0.0f), 1.0f);
+        Ratio2 = std::min(std::max(Ratio2, 0.0f), 1.0f);
+
+        // The other side waits with the second half of the ray, from the
+        // middle point of Ratio2 on, while we go on with the first half
+        // on the current side
+        stack[stack_size++] = { node.children[side ^ 1], start + ((end - start) * Ratio2), end };
+        end = start + ((end - start) * Ratio1);
+        nodeIndex = node.children[side];
     }
 }
 
-void Quake3Bsp::check_brush(BSPBrush *pBrush, glm::vec3 start, glm::vec3 end) {
+void Quake3Bsp::check_brush(TraceWork &work, const CollisionBrush &brush) const {
+    // The brush is checked against the whole movement and not the part of
+    // it inside the leaf we came from, so the ratios are along the whole
+    // trace and the brush gives the same answer from every leaf
+    work.result.brush_tests++;
+
+    // Most brushes of a leaf are nowhere near the trace, which misses
+    // their box on one of the axes
+    const float margin = 1.0f;
+    if(_brush_bounds &&
+       (work.sweep_max.x + margin < brush.min.x || work.sweep_min.x - margin > brush.max.x ||
+        work.sweep_max.y + margin < brush.min.y || work.sweep_min.y - margin > brush.max.y ||
+        work.sweep_max.z + margin < brush.min.z || work.sweep_min.z - margin > brush.max.z)) {
+        return;
+    }
+
     float startRatio = -1.0f;        // Like in BrushCollision.htm, start a ratio at -1
     float endRatio = 1.0f;            // Set the end ratio to 1
     bool startsOut = false;            // This tells us if we starting outside the brush
-
-    // Go through all of the brush sides and check collision against each plane
-    for(int i = 0; i < pBrush->brush_sides_num; i++) {
-        // Here we grab the current brush side and plane in this brush
-        BSPBrushSide *pBrushSide = &_brush_sides[pBrush->brush_side + i];
-        BSPPlane *pPlane = &_planes[pBrushSide->plane];
-
-        // Let's store a variable for the offset (like for sphere collision)
-        float offset = 0.0f;
-
-        // If we are testing sphere collision we need to add the sphere radius
-        if(_traceType == TYPE_SPHERE)
-            offset = _traceRadius;
-
-        // Test the start and end points against the current plane of the brush side.
-        // Notice that we add an offset to the distance from the origin, which makes
-        // our sphere collision work.
-        float startDistance = glm::dot(start, pPlane->normal) - (pPlane->d + offset);
-        float endDistance = glm::dot(end, pPlane->normal) - (pPlane->d + offset);
-
-        // Store the offset that we will check against the plane
-        glm::vec3 offset_vec = glm::vec3(0, 0, 0);
-
-        // If we are using AABB collision
-        if(_traceType == TYPE_BOX) {
-            // Grab the closest corner (x, y, or z value) that is closest to the plane
-            offset_vec.x = (pPlane->normal.x < 0)    ? _traceMaxs.x : _traceMins.x;
-            offset_vec.y = (pPlane->normal.y < 0)    ? _traceMaxs.y : _traceMins.y;
-            offset_vec.z = (pPlane->normal.z < 0)    ? _traceMaxs.z : _traceMins.z;
-
-            // Use the plane equation to grab the distance our start position is from the plane.
-            startDistance = glm::dot(start + offset_vec, pPlane->normal) - pPlane->d;
-
-            // Get the distance our end position is from this current brush plane
-            endDistance   = glm::dot(end + offset_vec, pPlane->normal) - pPlane->d;
-        }
-
+    bool endsOut = false;              // and if we ever get out of it
+    int hitPlane = -1;                 // The side we would enter the brush through
+    int hitSide = -1;                  // and its order in the brush
+
+    // This clips the movement vector with one brush side, given the distances of the start
+    // and end points from it. The sides are not clipped in their order in the brush, so when
+    // two give the same startRatio the first one in the brush wins, as if they were.
+    auto clip = [&](float startDistance, float endDistance, int side, int plane) {
         // Make sure we start outside of the brush's volume
         if(startDistance > 0)    startsOut = true;
-
-        // Stop checking since both the start and end position are in front of the plane
-        if(startDistance > 0 && endDistance > 0)
-            return;
+        if(endDistance > 0)      endsOut = true;
 
         // Continue on to the next brush side if both points are behind or on the plane
         if(startDistance <= 0 && endDistance <= 0)
-            continue;
+            return;
 
         // If the distance of the start point is greater than the end point, we have a collision!
         if(startDistance > endDistance) {
@@ -768,31 +1595,12 @@ void Quake3Bsp::check_brush(BSPBrush *pBrush, glm::vec3 start, glm::vec3 end) {
             float Ratio1 = (startDistance - M_EPS) / (startDistance - endDistance);
 
             // If this is the first time coming here, then this will always be true,
-            if(Ratio1 > startRatio) {
+            if(Ratio1 > startRatio || (Ratio1 == startRatio && side < hitSide)) {
                 // Set the startRatio (currently the closest collision distance from start)
+                // and remember the plane for sliding along it
                 startRatio = Ratio1;
-                _is_collided = true;        // Let us know we collided!
-
-                // Store the normal of plane that we collided with for sliding calculations
-                _collisionNormal = pPlane->normal;
-
-
-                // This checks first tests if we actually moved along the x or z-axis,
-                // meaning that we went in a direction somewhere.  The next check makes
-                // sure that we don't always check to step every time we collide.  If
-                // the normal of the plane has a Y value of 1, that means it's just the
-                // flat ground and we don't need to check if we can step over it, it's flat!
-                if((start.x != end.x || start.z != end.z) && pPlane->normal.y != 1) {
-                    // We can try and step over the wall we collided with
-                    _is_try_step = true;
-                }
-
-                // Here we make sure that we don't slide slowly down walls when we
-                // jump and collide into them.  We only want to say that we are on
-                // the ground if we actually have stopped from falling.  A wall wouldn't
-                // have a high y value for the normal, it would most likely be 0.
-                if(_collisionNormal.y >= 0.2f)
-                    _is_grounded = true;
+                hitPlane = plane;
+                hitSide = side;
             }
         }
         else {
@@ -804,132 +1612,109 @@ void Quake3Bsp::check_brush(BSPBrush *pBrush, glm::vec3 start, glm::vec3 end) {
             if(Ratio < endRatio)
                 endRatio = Ratio;
         }
+    };
+
+    // The axial sides first. Their distance is one coordinate of the start and end points,
+    // with the corner of our AABB facing them, and the sphere radius added to the plane's.
+    const SideTest &t = work.sides;
+    for(int i = 0; i < brush.axial_num; i++) {
+        const CollisionAxialSide &side = _collision_axial[brush.first_axial + i];
+        int axis = side.type;
+        float d = side.d + t.offset;
+        float startDistance, endDistance;
+        if(side.signbits) {
+            startDistance = -(t.start[axis] + t.maxs[axis]) - d;
+            endDistance = -(t.end[axis] + t.maxs[axis]) - d;
+        } else {
+            startDistance = (t.start[axis] + t.mins[axis]) - d;
+            endDistance = (t.end[axis] + t.mins[axis]) - d;
+        }
+
+        // Stop checking since both the start and end position are in front of the plane
+        if(startDistance > 0 && endDistance > 0)
+            return;
+        clip(startDistance, endDistance, side.side, side.plane);
+    }
+
+    // Then the other sides, a group of them at a time
+    const int lanes = CollisionSides::LANES;
+    float starts[lanes], ends[lanes];
+    for(int first = 0; first < brush.sides_num; first += lanes) {
+        const CollisionSides &sides = _collision_sides[brush.first_sides + first / lanes];
+        SidePlanes planes = { sides.x, sides.y, sides.z, sides.d };
+
+        // Test the start and end points against the planes of the brush sides.
+        // For spheres the radius is added to the distance from the origin, and
+        // boxes use the corner (x, y, and z value) closest to every plane.
+        // Both positions are in front of one of the planes when it returns false.
+        bool is_touched;
+        switch(_trace_isa) {
+#ifdef BSP_X86
+        case game::sys::Isa::AVX2:
+            is_touched = side_distances_avx2(t, planes, starts, ends);
+            break;
+        case game::sys::Isa::SSE2:
+            is_touched = side_distances_sse2(t, planes, starts, ends);
+            break;
+#endif
+        default:
+            is_touched = side_distances_scalar(t, planes, starts, ends);
+            break;
+        }
+        if(!is_touched) return;
+
+        int count = std::min(lanes, brush.sides_num - first);
+        for(int i = 0; i < count; i++)
+            clip(starts[i], ends[i], sides.side[i], sides.plane[i]);
     }
 
-    // If we didn't start outside of the brush we don't want to count this collision - return;
+    // If we didn't start outside of the brush we don't want to count this collision,
+    // only tell that we started inside it - return;
     if(startsOut == false) {
+        work.result.start_solid = true;
+        if(endsOut == false)
+            work.result.all_solid = true;
         return;
     }
 
     // If our startRatio is less than the endRatio there was a collision!!!
     if(startRatio < endRatio) {
         // Make sure the startRatio moved from the start and check if the collision
-        // ratio we just got is less than the current ratio stored in _traceRatio.
+        // ratio we just got is less than the current fraction of the trace.
         // We want the closest collision to our original starting position.
-        if(startRatio > -1 && startRatio < _traceRatio) {
+        if(startRatio > -1 && startRatio < work.result.fraction) {
             // If the startRatio is less than 0, just set it to 0
             if(startRatio < 0)
                 startRatio = 0;
 
-            // Store the new ratio in our member variable for later
-            _traceRatio = startRatio;
+            // Store the new ratio and what we hit in the result
+            work.result.fraction = startRatio;
+            work.result.plane = _planes[hitPlane];
+            work.result.contents = brush.contents;
         }
     }
 }
 
-void Quake3Bsp::render_face(int faceIndex) {
-    // Here we grab the face from the index passed in
-    BSPFace *pFace = &_faces[faceIndex];
-
-    // Assign our array of face vertices for our vertex arrays and enable vertex arrays
-    glVertexPointer(3, GL_FLOAT, sizeof(BSPVertex), &(_verts[pFace->start_vert_index].position));
-    glEnableClientState(GL_VERTEX_ARRAY);
-
-    // If we want to render the textures
-    if(g_bTextures) {
-        // Set the current pass as the first texture (For multi-texturing)
-        glActiveTextureARB(GL_TEXTURE0_ARB);
-
-        // Give OpenGL the texture coordinates for the first texture, and enable that texture
-        glClientActiveTextureARB(GL_TEXTURE0_ARB);
-        glTexCoordPointer(2, GL_FLOAT, sizeof(BSPVertex),
-                                       &(_verts[pFace->start_vert_index].texture_coord));
-
-        // Set our vertex array client states for allowing texture coordinates
-        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
-
-        // Turn on texture arrays for the first pass
-        glClientActiveTextureARB(GL_TEXTURE0_ARB);
-
-        // Turn on texture mapping and bind the face's texture map
-        glEnable(GL_TEXTURE_2D);
-        glBindTexture(GL_TEXTURE_2D,  _textures_list[pFace->texture_id]);
-    }
-
-    if(g_bLightmaps) {
-        // Set the current pass as the second lightmap texture_
-        glActiveTextureARB(GL_TEXTURE1_ARB);
-
-        // Turn on texture arrays for the second lightmap pass
-        glClientActiveTextureARB(GL_TEXTURE1_ARB);
-        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
-
-        // Next, we need to specify the UV coordinates for our lightmaps.  This is done
-        // by switching to the second texture and giving OpenGL our lightmap array.
-        glClientActiveTextureARB(GL_TEXTURE1_ARB);
-        glTexCoordPointer(2, GL_FLOAT, sizeof(BSPVertex),
-                                       &(_verts[pFace->start_vert_index].lightmap_coord));
-
-        // Turn on texture mapping and bind the face's lightmap over the texture
-        glEnable(GL_TEXTURE_2D);
-        glBindTexture(GL_TEXTURE_2D,  _lightmaps_list[pFace->lightmap_id]);
-    }
-
-    // Render our current face to the screen with vertex arrays
-    glDrawElements(GL_TRIANGLES, pFace->indices_num, GL_UNSIGNED_INT, &(_indices[pFace->start_index]) );
+void Quake3Bsp::update_textures() {
+    _streamer.update(Config::texture_upload_ms());
 }
 
-
-void Quake3Bsp::render(const glm::vec3 &pos) {
-    // Reset our bitset so all the slots are zero.
-    std::fill(_faces_drawn.begin(), _faces_drawn.end(), 0);
-
-    // Grab the leaf index that our camera is in
-    int leafIndex = find_leaf(pos);
-
-    // Grab the cluster that is assigned to the leaf
-    int cluster = _leafs[leafIndex].cluster;
-
-    // Initialize our counter variables (start at the last leaf and work down)
-    int i = _leafs_num;
-    g_VisibleFaces = 0;
-
-    // Go through all the leafs and check their visibility
-    while(i--) {
-        // Get the current leaf that is to be tested for visibility from our camera's leaf
-        BSPLeaf *pLeaf = &(_leafs[i]);
-
-        // If the current leaf can't be seen from our cluster, go to the next leaf
-        if(!is_cluster_visible(cluster, pLeaf->cluster))
-            continue;
-
-        // If we get here, the leaf we are testing must be visible in our camera's view.
-        // Get the number of faces that this leaf is in charge of.
-        int faceCount = pLeaf->leaf_faces_num;
-
-        // Loop through and render all of the faces in this leaf
-        while(faceCount--) {
-            // Grab the current face index from our leaf faces array
-            int faceIndex = _leaf_faces[pLeaf->leafface + faceCount];
-
-            // Since many faces are duplicated in other leafs, we need to
-            // make sure this face already hasn't been drawn.
-            if(!_faces_drawn[faceIndex])  {
-                // Increase the rendered face count to display for fun
-                g_VisibleFaces++;
-
-                _faces_drawn[faceIndex] = true;
-                render_face(faceIndex);
-            }
-        }
-    }
+void Quake3Bsp::update_patches(const glm::vec3 &pos) {
+    if(Config::patch_lod()) _patch_lod->update(pos);
 }
 
 void Quake3Bsp::destroy() {
-    glDeleteTextures(_textures_num, _textures_list);
-    glDeleteTextures(_lightmaps_num, _lightmaps_list);
+    if(!_is_uploaded) return;
+    _streamer.clear();
+    glDeleteTextures(_lightmap_atlases.size(), _lightmap_atlases.data());
+    _lightmap_atlases.clear();
+    delete_world_buffers();
+    delete_world_program();
+    _is_uploaded = false;
 }
 
 Quake3Bsp::~Quake3Bsp() {
+    // Pending tessellations read the level arrays
+    _patch_lod->clear();
     destroy();
 }
@@ -0,0 +1,170 @@
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+
+#include <game/sys/quake3_bsp.h>
+
+static uint64_t align_offset(uint64_t offset) {
+    return (offset + COOKED_ALIGNMENT - 1) & ~static_cast<uint64_t>(COOKED_ALIGNMENT - 1);
+}
+
+template<typename T>
+static bool check_section(const CookedSection &section, size_t file_size) {
+    return section.offset % COOKED_ALIGNMENT == 0 &&
+           section.length % sizeof(T) == 0 &&
+           section.offset <= file_size &&
+           section.length <= file_size - section.offset;
+}
+
+template<typename T>
+static void map_section(const game::sys::MappedFile &file, const CookedSection &section,
+                        BSPLumpArray<T> &out) {
+    out.view(file.at<T>(section.offset), section.length / sizeof(T));
+}
+
+bool Quake3Bsp::read_cooked(const std::string &filename, uint64_t key) {
+    if(access(filename.c_str(), R_OK) != 0) {
+        _logger->debug("No cooked level {}", filename);
+        return false;
+    }
+
+    std::unique_ptr<game::sys::MappedFile> file(new game::sys::MappedFile());
+    if(!file->open(filename)) return false;
+
+    if(file->size() < sizeof(CookedHeader)) {
+        _logger->warn("Cooked level {} is truncated, ignoring it", filename);
+        return false;
+    }
+
+    const auto &header = *file->at<CookedHeader>(0);
+    if(strncmp(header.str_id, COOKED_IDENT, 4) != 0 || header.version != COOKED_VERSION) {
+        _logger->info("Cooked level {} has an old format, recooking", filename);
+        return false;
+    }
+    if(header.source_key != key) {
+        _logger->info("Cooked level {} is out of date, recooking", filename);
+        return false;
+    }
+
+    const auto *sections = header.sections;
+    bool is_valid = header.file_size == file->size() &&
+        header.clusters_num >= 0 && header.bytes_per_cluster >= 0 &&
+        check_section<BSPVertex>(sections[COOKED_VERTICES], file->size()) &&
+        check_section<int>(sections[COOKED_INDICES], file->size()) &&
+        check_section<BSPFace>(sections[COOKED_FACES], file->size()) &&
+        check_section<BSPTexture>(sections[COOKED_TEXTURES], file->size()) &&
+        check_section<BSPLightmap>(sections[COOKED_LIGHTMAPS], file->size()) &&
+        check_section<BSPNode>(sections[COOKED_NODES], file->size()) &&
+        check_section<BSPLeaf>(sections[COOKED_LEAFS], file->size()) &&
+        check_section<int>(sections[COOKED_LEAF_FACES], file->size()) &&
+        check_section<BSPPlane>(sections[COOKED_PLANES], file->size()) &&
+        check_section<BSPBrush>(sections[COOKED_BRUSHES], file->size()) &&
+        check_section<BSPBrushSide>(sections[COOKED_BRUSH_SIDES], file->size()) &&
+        check_section<int>(sections[COOKED_LEAF_BRUSHES], file->size()) &&
+        check_section<uint8_t>(sections[COOKED_VIS_DATA], file->size()) &&
+        check_section<BSPPatch>(sections[COOKED_PATCHES], file->size()) &&
+        sections[COOKED_VIS_DATA].length ==
+            static_cast<uint64_t>(header.clusters_num) * header.bytes_per_cluster;
+    if(!is_valid) {
+        _logger->warn("Cooked level {} is corrupted, recooking", filename);
+        return false;
+    }
+
+    map_section(*file, sections[COOKED_VERTICES],     _verts);
+    map_section(*file, sections[COOKED_INDICES],      _indices);
+    map_section(*file, sections[COOKED_FACES],        _faces);
+    map_section(*file, sections[COOKED_TEXTURES],     _textures);
+    map_section(*file, sections[COOKED_LIGHTMAPS],    _lightmaps);
+    map_section(*file, sections[COOKED_NODES],        _nodes);
+    map_section(*file, sections[COOKED_LEAFS],        _leafs);
+    map_section(*file, sections[COOKED_LEAF_FACES],   _leaf_faces);
+    map_section(*file, sections[COOKED_PLANES],       _planes);
+    map_section(*file, sections[COOKED_BRUSHES],      _brushes);
+    map_section(*file, sections[COOKED_BRUSH_SIDES],  _brush_sides);
+    map_section(*file, sections[COOKED_LEAF_BRUSHES], _leaf_brushes);
+    map_section(*file, sections[COOKED_VIS_DATA],     _clusters.bitsets);
+    map_section(*file, sections[COOKED_PATCHES],      _patches);
+    _clusters.clusters_num = header.clusters_num;
+    _clusters.bytes_per_cluster = header.bytes_per_cluster;
+
+    _map_file = std::move(file);
+    _logger->info("Using cooked level {}", filename);
+    return true;
+}
+
+bool Quake3Bsp::write_cooked(const std::string &filename, uint64_t key) {
+    struct Blob {
+        const void *data;
+        size_t length;
+    };
+    auto blob = [](const auto &array) {
+        return Blob{ array.data(), array.size() * sizeof(array[0]) };
+    };
+
+    const Blob blobs[COOKED_MAX_SECTIONS] = {
+        blob(_verts),
+        blob(_indices),
+        blob(_faces),
+        blob(_textures),
+        blob(_lightmaps),
+        blob(_nodes),
+        blob(_leafs),
+        blob(_leaf_faces),
+        blob(_planes),
+        blob(_brushes),
+        blob(_brush_sides),
+        blob(_leaf_brushes),
+        blob(_clusters.bitsets),
+        blob(_patches),
+    };
+
+    CookedHeader header = {};
+    memcpy(header.str_id, COOKED_IDENT, 4);
+    header.version = COOKED_VERSION;
+    header.source_key = key;
+    header.clusters_num = _clusters.clusters_num;
+    header.bytes_per_cluster = _clusters.bytes_per_cluster;
+
+    uint64_t offset = align_offset(sizeof(CookedHeader));
+    for(int i = 0; i < COOKED_MAX_SECTIONS; i++) {
+        header.sections[i].offset = offset;
+        header.sections[i].length = blobs[i].length;
+        offset = align_offset(offset + blobs[i].length);
+    }
+    header.file_size = offset;
+
+    // Written aside and renamed, so a crash never leaves a half written
+    // file that passes the header checks
+    std::string temp_name = filename + ".tmp";
+    FILE *fp = fopen(temp_name.c_str(), "wb");
+    if(fp == NULL) {
+        _logger->warn("Couldn't write cooked level {}: {}", temp_name, strerror(errno));
+        return false;
+    }
+
+    static const uint8_t padding[COOKED_ALIGNMENT] = {};
+    bool is_written = fwrite(&header, sizeof(header), 1, fp) == 1;
+    uint64_t written = sizeof(header);
+    for(int i = 0; i < COOKED_MAX_SECTIONS && is_written; i++) {
+        size_t pad = header.sections[i].offset - written;
+        is_written = fwrite(padding, 1, pad, fp) == pad &&
+                     fwrite(blobs[i].data, 1, blobs[i].length, fp) == blobs[i].length;
+        written = header.sections[i].offset + blobs[i].length;
+    }
+    if(is_written) {
+        size_t pad = header.file_size - written;
+        is_written = fwrite(padding, 1, pad, fp) == pad;
+    }
+    is_written = fclose(fp) == 0 && is_written;
+
+    if(!is_written || rename(temp_name.c_str(), filename.c_str()) != 0) {
+        _logger->warn("Couldn't write cooked level {}: {}", filename, strerror(errno));
+        unlink(temp_name.c_str());
+        return false;
+    }
+
+    _logger->info("Wrote cooked level {} ({} bytes)", filename, header.file_size);
+    return true;
+}
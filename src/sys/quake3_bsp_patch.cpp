@@ -0,0 +1,272 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <game/sys/quake3_bsp.h>
+#include <game/sys/patch_lod.h>
+
+// Patches are evaluated one vertex attribute at a time: every float of
+// BSPVertex, colours included, gets its own plane of values. Both passes
+// of the separable evaluation then blend three rows of a plane at once.
+#define PATCH_COMPONENTS 14
+
+// Plane rows are padded to whole SIMD vectors
+#define PATCH_LANES 4
+
+static size_t pad_lanes(size_t count) {
+    return (count + PATCH_LANES - 1) / PATCH_LANES * PATCH_LANES;
+}
+
+// out[i] = a[i] * wa + b[i] * wb + c[i] * wc, count is a multiple of PATCH_LANES
+static void blend3(float *out, const float *a, const float *b, const float *c,
+                   float wa, float wb, float wc, size_t count) {
+#ifdef __SSE2__
+    __m128 va = _mm_set1_ps(wa), vb = _mm_set1_ps(wb), vc = _mm_set1_ps(wc);
+    for(size_t i = 0; i < count; i += PATCH_LANES) {
+        __m128 sum = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a + i), va),
+                                           _mm_mul_ps(_mm_loadu_ps(b + i), vb)),
+                                _mm_mul_ps(_mm_loadu_ps(c + i), vc));
+        _mm_storeu_ps(out + i, sum);
+    }
+#else
+    for(size_t i = 0; i < count; i++) out[i] = a[i] * wa + b[i] * wb + c[i] * wc;
+#endif
+}
+
+static void vertex_to_components(const BSPVertex &v, float *out, size_t stride) {
+    const float values[PATCH_COMPONENTS] = {
+        v.position.x, v.position.y, v.position.z,
+        v.texture_coord.x, v.texture_coord.y,
+        v.lightmap_coord.x, v.lightmap_coord.y,
+        v.normal.x, v.normal.y, v.normal.z,
+        float(v.color[0]), float(v.color[1]), float(v.color[2]), float(v.color[3]),
+    };
+    for(int k = 0; k < PATCH_COMPONENTS; k++) out[k * stride] = values[k];
+}
+
+static void components_to_vertex(const float *in, size_t stride, BSPVertex &v) {
+    v.position = glm::vec3(in[0], in[stride], in[2 * stride]);
+    v.texture_coord = glm::vec2(in[3 * stride], in[4 * stride]);
+    v.lightmap_coord = glm::vec2(in[5 * stride], in[6 * stride]);
+
+    glm::vec3 normal(in[7 * stride], in[8 * stride], in[9 * stride]);
+    float length = std::sqrt(normal.x * normal.x + normal.y * normal.y + normal.z * normal.z);
+    v.normal = length > 0.0f ? normal * (1.0f / length) : normal;
+
+    for(int i = 0; i < 4; i++) {
+        float color = std::min(std::max(in[(10 + i) * stride], 0.0f), 255.0f);
+        v.color[i] = uint8_t(color + 0.5f);
+    }
+}
+
+// Quadratic Bezier basis weights at j / level for j in [0, level], padded
+// with zeros to whole vectors
+struct PatchBasis {
+    std::vector<float> weights[3];
+    size_t padded = 0;
+
+    explicit PatchBasis(int level) {
+        padded = pad_lanes(level + 1);
+        for(auto &w : weights) w.assign(padded, 0.0f);
+        for(int j = 0; j <= level; j++) {
+            float t = float(j) / level;
+            weights[0][j] = (1.0f - t) * (1.0f - t);
+            weights[1][j] = 2.0f * t * (1.0f - t);
+            weights[2][j] = t * t;
+        }
+    }
+};
+
+Quake3Bsp::PatchSize Quake3Bsp::patch_size(int width, int height, int level) {
+    PatchSize size = { 0, 0, 0, 0 };
+    if(width < 3 || height < 3 || width % 2 == 0 || height % 2 == 0 || level < 1) {
+        return size;
+    }
+
+    // Neighbouring 3x3 sub-patches share their edge control points, and
+    // the tessellated grid shares the edge vertices the same way
+    size.columns = (width - 1) / 2 * level + 1;
+    size.rows = (height - 1) / 2 * level + 1;
+    size.verts_num = size.columns * size.rows;
+    size.indices_num = (size.columns - 1) * (size.rows - 1) * 6;
+    return size;
+}
+
+void Quake3Bsp::tessellate_patch(const BSPVertex *controls, int width, int height,
+                                 int level, BSPVertex *verts, int *indices) {
+    const PatchBasis basis(level);
+    const int columns = (width - 1) / 2 * level + 1;
+    const int rows = (height - 1) / 2 * level + 1;
+
+    // Control point planes, one row per control row
+    const size_t control_stride = pad_lanes(width);
+    const size_t control_plane = control_stride * height;
+    std::vector<float> control(PATCH_COMPONENTS * control_plane, 0.0f);
+    for(int r = 0; r < height; r++) {
+        for(int c = 0; c < width; c++) {
+            vertex_to_components(controls[r * width + c],
+                                 &control[r * control_stride + c], control_plane);
+        }
+    }
+
+    // The vertical pass blends control rows into one row per output row
+    const size_t column_plane = control_stride * rows;
+    std::vector<float> column(PATCH_COMPONENTS * column_plane);
+    for(int row = 0; row < rows; row++) {
+        int sub = std::min(row / level, (height - 1) / 2 - 1);
+        int j = row - sub * level;
+        for(int k = 0; k < PATCH_COMPONENTS; k++) {
+            const float *plane = &control[k * control_plane + 2 * sub * control_stride];
+            blend3(&column[k * column_plane + row * control_stride],
+                   plane, plane + control_stride, plane + 2 * control_stride,
+                   basis.weights[0][j], basis.weights[1][j], basis.weights[2][j],
+                   control_stride);
+        }
+    }
+
+    // The horizontal pass blends the basis weights of a whole sub-patch
+    // row at once. Each sub-patch writes a few padding values past its
+    // end, which the next one overwrites, so they go in order.
+    const size_t output_stride = pad_lanes(columns) + basis.padded;
+    const size_t output_plane = output_stride * rows;
+    std::vector<float> output(PATCH_COMPONENTS * output_plane);
+    for(int k = 0; k < PATCH_COMPONENTS; k++) {
+        for(int row = 0; row < rows; row++) {
+            const float *in = &column[k * column_plane + row * control_stride];
+            float *out = &output[k * output_plane + row * output_stride];
+            for(int sub = 0; sub < (width - 1) / 2; sub++) {
+                blend3(out + sub * level,
+                       basis.weights[0].data(), basis.weights[1].data(), basis.weights[2].data(),
+                       in[2 * sub], in[2 * sub + 1], in[2 * sub + 2], basis.padded);
+            }
+        }
+    }
+
+    for(int row = 0; row < rows; row++) {
+        for(int col = 0; col < columns; col++) {
+            components_to_vertex(&output[row * output_stride + col], output_plane,
+                                 verts[row * columns + col]);
+        }
+    }
+
+    // Two triangles per grid cell, indices relative to the first vertex
+    // with the winding of the original tesselation
+    int *index = indices;
+    for(int row = 0; row + 1 < rows; row++) {
+        for(int col = 0; col + 1 < columns; col++) {
+            int v00 = row * columns + col;
+            int v01 = v00 + 1;
+            int v10 = v00 + columns;
+            int v11 = v10 + 1;
+            *index++ = v00;
+            *index++ = v10;
+            *index++ = v11;
+
+            *index++ = v11;
+            *index++ = v01;
+            *index++ = v00;
+        }
+    }
+}
+
+void Quake3Bsp::tessellate_patches() {
+    // Vertex and index ranges are assigned up front, so every patch writes
+    // its own part of the arrays and they can all run in parallel
+    struct Patch {
+        int face;
+        int first_vert;
+        int first_index;
+        PatchSize size;
+    };
+    std::vector<Patch> patches;
+    int verts_num = _verts.size();
+    int indices_num = _indices.size();
+    int invalid = 0;
+    for(size_t i = 0; i < _faces.size(); i++) {
+        const BSPFace &face = _faces[i];
+        if(face.type != FACE_PATCH) continue;
+        PatchSize size = patch_size(face.size[0], face.size[1], _bezier_level);
+        if(size.verts_num == 0 || face.verts_num != face.size[0] * face.size[1] ||
+           face.start_vert_index < 0 || face.start_vert_index + face.verts_num > int(_verts.size())) {
+            invalid++;
+            continue;
+        }
+        patches.push_back({ int(i), verts_num, indices_num, size });
+        verts_num += size.verts_num;
+        indices_num += size.indices_num;
+    }
+    if(invalid) _logger->warn("Skipped {} malformed patches", invalid);
+    if(patches.empty()) return;
+
+    _verts.resize(verts_num);
+    _indices.resize(indices_num);
+    _patches.resize(patches.size());
+    BSPVertex *verts = _verts.mutable_data();
+    int *indices = _indices.mutable_data();
+    BSPFace *faces = _faces.mutable_data();
+    BSPPatch *lod_patches = _patches.mutable_data();
+
+    for_range(patches.size(), 1, [&](size_t begin, size_t end) {
+        for(size_t i = begin; i < end; i++) {
+            const Patch &patch = patches[i];
+            BSPFace &face = faces[patch.face];
+            const BSPVertex *controls = &verts[face.start_vert_index];
+            tessellate_patch(controls, face.size[0], face.size[1],
+                             _bezier_level, &verts[patch.first_vert], &indices[patch.first_index]);
+
+            // A Bezier surface lies inside the box of its control points
+            BSPPatch &lod_patch = lod_patches[i];
+            lod_patch.face = patch.face;
+            lod_patch.start_vert_index = face.start_vert_index;
+            lod_patch.size[0] = face.size[0];
+            lod_patch.size[1] = face.size[1];
+            lod_patch.min = lod_patch.max = controls[0].position;
+            for(int c = 1; c < face.verts_num; c++) {
+                lod_patch.min = glm::min(lod_patch.min, controls[c].position);
+                lod_patch.max = glm::max(lod_patch.max, controls[c].position);
+            }
+
+            // The face now refers to the tessellated grid instead of its
+            // control points, which stay in place for collision and LOD
+            face.start_vert_index = patch.first_vert;
+            face.verts_num = patch.size.verts_num;
+            face.start_index = patch.first_index;
+            face.indices_num = patch.size.indices_num;
+        }
+    });
+
+    _logger->debug("Tessellated {} patches at level {} into {} triangles", patches.size(),
+                   _bezier_level, (indices_num - patches.front().first_index) / 3);
+}
+
+void Quake3Bsp::reset_patch_lod() {
+    _face_patches.assign(_faces.size(), -1);
+
+    // The patches come from our own tessellation, a bad one means the
+    // cooked level was damaged and the loading level is all we can draw
+    for(const auto &patch : _patches) {
+        PatchSize size = patch_size(patch.size[0], patch.size[1], 1);
+        if(size.verts_num == 0 || patch.face < 0 || patch.face >= int(_faces.size()) ||
+           patch.start_vert_index < 0 ||
+           patch.start_vert_index + patch.size[0] * patch.size[1] > int(_verts.size())) {
+            _logger->warn("Level has malformed patch data, patch LOD is disabled");
+            _patches.clear();
+            break;
+        }
+    }
+    for(size_t i = 0; i < _patches.size(); i++) _face_patches[_patches[i].face] = i;
+
+    _patch_lod->reset(_patches, _bezier_level,
+        [this](size_t index, int level, game::sys::PatchLod::Geometry &geometry) {
+            const BSPPatch &patch = _patches[index];
+            PatchSize size = patch_size(patch.size[0], patch.size[1], level);
+            geometry.verts.resize(size.verts_num);
+            geometry.indices.resize(size.indices_num);
+            tessellate_patch(&_verts[patch.start_vert_index], patch.size[0], patch.size[1],
+                             level, geometry.verts.data(), geometry.indices.data());
+        });
+}
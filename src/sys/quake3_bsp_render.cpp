@@ -0,0 +1,836 @@
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+
+#include <GL/glew.h>
+#ifdef __APPLE__
+#include <OpenGL/gl.h>
+#else
+#include <GL/gl.h>
+#endif
+
+#include <game/sys/quake3_bsp.h>
+#include <game/sys/patch_lod.h>
+#include <game/sys/glsl.h>
+#include <game/config.h>
+
+// This tells us if we want to render the lightmaps
+static bool g_bLightmaps = true;
+
+// This tells us if we want to render the textures
+static bool g_bTextures = true;
+
+// Sort keys order the visible faces by vertex array, texture, lightmap
+// atlas and face index, from the highest bits down
+#define SORT_PATCH_BIT    (uint64_t(1) << 63)
+#define SORT_TEXTURE_SHIFT 48
+#define SORT_ATLAS_SHIFT   32
+#define SORT_FACE_MASK     0xffffffffull
+
+// Bytes of LOD geometry a frame starts out with, doubled when the visible
+// patches need more
+#define PATCH_STREAM_SECTION_SIZE (256 * 1024)
+
+void Quake3Bsp::create_vertex_array(VertexArray &array, const BSPVertex *verts, size_t verts_num,
+                                    const uint32_t *indices, size_t indices_num, bool is_static) {
+    GLenum usage = is_static ? GL_STATIC_DRAW : GL_DYNAMIC_DRAW;
+    glGenVertexArrays(1, &array.array);
+    glGenBuffers(1, &array.vertices);
+    glGenBuffers(1, &array.indices);
+
+    // The element buffer binding is part of the vertex array state
+    glBindVertexArray(array.array);
+    glBindBuffer(GL_ARRAY_BUFFER, array.vertices);
+    glBufferData(GL_ARRAY_BUFFER, verts_num * sizeof(BSPVertex), verts, usage);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, array.indices);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices_num * sizeof(uint32_t), indices, usage);
+
+    vertex_layout(0);
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void Quake3Bsp::vertex_layout(size_t offset) {
+    const uint8_t *base = reinterpret_cast<const uint8_t *>(offset);
+
+    // The shaders read generic attributes, at the locations the world
+    // shader declares
+    if(_render_backend == RenderBackend::Glsl) {
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(BSPVertex),
+                              base + offsetof(BSPVertex, position));
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(BSPVertex),
+                              base + offsetof(BSPVertex, texture_coord));
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(BSPVertex),
+                              base + offsetof(BSPVertex, lightmap_coord));
+        glEnableVertexAttribArray(2);
+        return;
+    }
+
+    // The pointers are now offsets into the vertex buffer
+    glVertexPointer(3, GL_FLOAT, sizeof(BSPVertex), base + offsetof(BSPVertex, position));
+    glEnableClientState(GL_VERTEX_ARRAY);
+
+    // Texture coordinates on the first unit, lightmap coordinates on the second
+    glClientActiveTextureARB(GL_TEXTURE0_ARB);
+    glTexCoordPointer(2, GL_FLOAT, sizeof(BSPVertex), base + offsetof(BSPVertex, texture_coord));
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+
+    glClientActiveTextureARB(GL_TEXTURE1_ARB);
+    glTexCoordPointer(2, GL_FLOAT, sizeof(BSPVertex), base + offsetof(BSPVertex, lightmap_coord));
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glClientActiveTextureARB(GL_TEXTURE0_ARB);
+}
+
+void Quake3Bsp::delete_vertex_array(VertexArray &array) {
+    if(array.array != 0) glDeleteVertexArrays(1, &array.array);
+    if(array.vertices != 0) glDeleteBuffers(1, &array.vertices);
+    if(array.indices != 0) glDeleteBuffers(1, &array.indices);
+    array = VertexArray();
+}
+
+void Quake3Bsp::create_world_buffers() {
+    // Face indices are relative to the face's first vertex. They are made
+    // absolute here, so every face is a plain range of the index buffer
+    // and ranges of different faces can be drawn together.
+    size_t indices_num = _faces.empty() ? 0 :
+        _face_first_index.back() + std::max(0, _faces[_faces.size() - 1].indices_num);
+    std::vector<uint32_t> indices(indices_num);
+    for_range(_faces.size(), 1024, [this, &indices](size_t begin, size_t end) {
+        for(size_t i = begin; i < end; i++) {
+            const BSPFace &face = _faces[i];
+            uint32_t *out = &indices[_face_first_index[i]];
+            for(int k = 0; k < face.indices_num; k++) {
+                out[k] = _indices[face.start_index + k] + face.start_vert_index;
+            }
+        }
+    });
+
+    delete_vertex_array(_world_array);
+    create_vertex_array(_world_array, _verts.data(), _verts.size(),
+                        indices.data(), indices.size(), true);
+
+    // The LOD geometry of the visible patches is written into a section of
+    // the stream every frame, the GPU may still be drawing from the others
+    if(_patch_array == 0) glGenVertexArrays(1, &_patch_array);
+    _patch_stream.init(PATCH_STREAM_SECTION_SIZE);
+
+    _logger->debug("Uploaded {} vertices and {} indices", _verts.size(), indices.size());
+}
+
+void Quake3Bsp::delete_world_buffers() {
+    delete_vertex_array(_world_array);
+    _patch_stream.destroy();
+    if(_patch_array != 0) glDeleteVertexArrays(1, &_patch_array);
+    _patch_array = 0;
+}
+
+void Quake3Bsp::update_bounds() {
+    // The node boxes are still Z up, they get the same swizzle as the leafs
+    _render_nodes.resize(_nodes.size());
+    for(size_t i = 0; i < _nodes.size(); i++) {
+        const BSPNode &node = _nodes[i];
+        const BSPPlane &plane = _planes[node.plane];
+        glm::vec3 a(node.min.x, node.min.z, -node.min.y);
+        glm::vec3 b(node.max.x, node.max.z, -node.max.y);
+        _render_nodes[i] = { glm::min(a, b), glm::max(a, b), plane.normal, plane.d,
+                             node.front, node.back, int(_leafs.size()), -1 };
+    }
+
+    // The leaf range of a node spans the ranges of its children, so the
+    // nodes are visited from the root and their ranges filled in reverse,
+    // children before parents. The compiler numbers the leafs in tree
+    // order, which makes every range hold only the leafs below the node.
+    std::vector<int> order;
+    std::vector<bool> is_queued(_nodes.size(), false);
+    if(!_nodes.empty()) {
+        order.push_back(0);
+        is_queued[0] = true;
+    }
+    for(size_t i = 0; i < order.size(); i++) {
+        const RenderNode &node = _render_nodes[order[i]];
+        for(int child : { node.front, node.back }) {
+            if(child >= 0 && child < int(_nodes.size()) && !is_queued[child]) {
+                is_queued[child] = true;
+                order.push_back(child);
+            }
+        }
+    }
+    for(size_t i = order.size(); i--;) {
+        RenderNode &node = _render_nodes[order[i]];
+        for(int child : { node.front, node.back }) {
+            int first = 0, last = -1;
+            if(child >= 0 && child < int(_nodes.size())) {
+                first = _render_nodes[child].first_leaf;
+                last = _render_nodes[child].last_leaf;
+            } else if(child < 0 && -(child + 1) < int(_leafs.size())) {
+                first = last = -(child + 1);
+            }
+            if(first > last) continue;
+            node.first_leaf = std::min(node.first_leaf, first);
+            node.last_leaf = std::max(node.last_leaf, last);
+        }
+    }
+    _face_order.assign(_faces.size(), 0);
+
+    // The leaf boxes were swizzled to Y up like everything else, which
+    // swaps the min and max of the Z axis
+    _leaf_bounds.resize(_leafs.size());
+    for(size_t i = 0; i < _leafs.size(); i++) {
+        const BSPLeaf &leaf = _leafs[i];
+        glm::vec3 a(leaf.min.x, leaf.min.y, leaf.min.z);
+        glm::vec3 b(leaf.max.x, leaf.max.y, leaf.max.z);
+        _leaf_bounds[i] = { glm::min(a, b), glm::max(a, b) };
+    }
+
+    // Patches are bounded by their control points, which also hold every
+    // level the LOD may switch them to
+    _face_boxes.resize(_faces.size());
+    _face_areas.assign(_faces.size(), 0.0f);
+    for_range(_faces.size(), 1024, [this](size_t begin, size_t end) {
+        for(size_t i = begin; i < end; i++) {
+            const BSPFace &face = _faces[i];
+            _face_areas[i] = occluder_area(i);
+            int patch = _face_patches[i];
+            if(patch >= 0) {
+                _face_boxes.set(i, _patches[patch].min, _patches[patch].max);
+                continue;
+            }
+
+            glm::vec3 min(0.0f), max(0.0f);
+            if(face.verts_num > 0 && face.start_vert_index >= 0 &&
+               face.start_vert_index + face.verts_num <= int(_verts.size())) {
+                min = max = _verts[face.start_vert_index].position;
+                for(int k = 1; k < face.verts_num; k++) {
+                    min = glm::min(min, _verts[face.start_vert_index + k].position);
+                    max = glm::max(max, _verts[face.start_vert_index + k].position);
+                }
+            }
+            _face_boxes.set(i, min, max);
+        }
+    });
+}
+
+float Quake3Bsp::occluder_area(size_t face_index) const {
+    // Only flat faces of solid brushes are sure to hide what is behind
+    // them, patches and models are too thin and windows and grates are
+    // see through
+    const BSPFace &face = _faces[face_index];
+    if(face.type != FACE_POLYGON || face.texture_id < 0 || face.texture_id >= int(_textures.size()) ||
+       face.start_index < 0 || face.start_index + face.indices_num > int(_indices.size())) {
+        return 0.0f;
+    }
+    const BSPTexture &texture = _textures[face.texture_id];
+    if(!(texture.texture_type & CONTENTS_SOLID) || (texture.texture_type & CONTENTS_TRANSLUCENT) ||
+       (texture.flags & (SURF_SKY | SURF_NODRAW))) {
+        return 0.0f;
+    }
+
+    float area = 0.0f;
+    for(int k = 0; k + 2 < face.indices_num; k += 3) {
+        glm::vec3 corners[3];
+        for(int v = 0; v < 3; v++) {
+            int vert = _indices[face.start_index + k + v] + face.start_vert_index;
+            if(vert < 0 || vert >= int(_verts.size())) return 0.0f;
+            corners[v] = _verts[vert].position;
+        }
+        area += 0.5f * glm::length(glm::cross(corners[1] - corners[0], corners[2] - corners[0]));
+    }
+    return area;
+}
+
+void Quake3Bsp::occluders(size_t max_faces, float min_size) {
+    _occluder_max_faces = max_faces;
+    _occluder_min_size = min_size;
+    _is_frame_built = false;
+}
+
+// The visibility cache holds a cluster once for every area it is seen from
+static uint64_t cluster_key(int cluster, int area) {
+    return (uint64_t(uint32_t(cluster)) << 32) | uint32_t(area);
+}
+
+void Quake3Bsp::collect_faces(int cluster, int area, ClusterFaces &visible) {
+    // Reset our bitset so all the slots are zero.
+    std::fill(_faces_drawn.begin(), _faces_drawn.end(), 0);
+    std::vector<int> &faces = visible.faces;
+    visible.cluster = cluster;
+    visible.area = area;
+    visible.area_culled = 0;
+    faces.clear();
+    visible.leafs.clear();
+    visible.leaf_boxes.clear();
+    _visibility_misses++;
+
+    // One bit for every leaf whose cluster the row of our cluster has,
+    // gathered a word of leafs at a time
+    visible.leaf_bits.resize(game::sys::Pvs::words_for(_leafs.size()));
+    size_t pvs_leafs = _pvs.visible_leafs(cluster, _leaf_clusters.data(), _leafs.size(),
+                                          visible.leaf_bits.data());
+
+    // Closed area portals hide the areas our area can't reach anymore
+    if(_area_portals.is_split() && area >= 0) {
+        _area_leaf_bits.resize(visible.leaf_bits.size());
+        _area_portals.connected_leafs(area, _leaf_areas.data(), _leafs.size(), _area_leaf_bits.data());
+        for(size_t w = 0; w < visible.leaf_bits.size(); w++) visible.leaf_bits[w] &= _area_leaf_bits[w];
+        size_t kept = game::sys::Pvs::count(visible.leaf_bits.data(), visible.leaf_bits.size());
+        visible.area_culled = int(pvs_leafs - kept);
+    }
+
+    // Go through the visible leafs, starting at the last leaf and working down,
+    // unless they are outside the frustum, which is checked every frame.
+    for(size_t word = visible.leaf_bits.size(); word--;) {
+        uint64_t bits = visible.leaf_bits[word];
+        while(bits) {
+            int bit = 63 - __builtin_clzll(bits);
+            bits &= ~(uint64_t(1) << bit);
+            int i = int(word * 64) + bit;
+            const BSPLeaf *pLeaf = &(_leafs[i]);
+
+            visible.leafs.push_back(i);
+            visible.leaf_boxes.push_back(_leaf_bounds[i].min, _leaf_bounds[i].max);
+
+            // Get the number of faces that this leaf is in charge of.
+            int faceCount = pLeaf->leaf_faces_num;
+
+            // Loop through and collect all of the faces in this leaf
+            while(faceCount--) {
+                // Grab the current face index from our leaf faces array
+                int faceIndex = _leaf_faces[pLeaf->leafface + faceCount];
+
+                // Since many faces are duplicated in other leafs, we need to
+                // make sure this face isn't collected twice.
+                if(!_faces_drawn[faceIndex])  {
+                    _faces_drawn[faceIndex] = true;
+                    faces.push_back(faceIndex);
+                }
+            }
+        }
+    }
+}
+
+const Quake3Bsp::ClusterFaces &Quake3Bsp::cluster_faces(int cluster, int area) {
+    if(_visibility_cache_size == 0) {
+        collect_faces(cluster, area, _uncached);
+        return _uncached;
+    }
+
+    auto found = _cluster_lookup.find(cluster_key(cluster, area));
+    if(found != _cluster_lookup.end()) {
+        // Move it to the front, it is the most recently used now
+        _cluster_faces.splice(_cluster_faces.begin(), _cluster_faces, found->second);
+        return *found->second;
+    }
+
+    // Reuse the storage of the least recently used cluster once full
+    if(_cluster_faces.size() >= _visibility_cache_size) {
+        _cluster_lookup.erase(cluster_key(_cluster_faces.back().cluster, _cluster_faces.back().area));
+        _cluster_faces.splice(_cluster_faces.begin(), _cluster_faces, std::prev(_cluster_faces.end()));
+    } else {
+        _cluster_faces.emplace_front();
+    }
+    ClusterFaces &entry = _cluster_faces.front();
+    collect_faces(cluster, area, entry);
+    _cluster_lookup[cluster_key(cluster, area)] = _cluster_faces.begin();
+    return entry;
+}
+
+void Quake3Bsp::clear_visibility_cache() {
+    _cluster_faces.clear();
+    _cluster_lookup.clear();
+    _uncached = {};
+    _visible_faces = &_uncached.faces;
+    _visible_leafs = &_uncached.leafs;
+    _is_frame_built = false;
+}
+
+void Quake3Bsp::visibility_cache_size(size_t size) {
+    _visibility_cache_size = size;
+    clear_visibility_cache();
+}
+
+void Quake3Bsp::descend_nodes(const ClusterFaces &visible, const glm::vec3 &pos,
+                              const game::sys::Frustum &frustum, RenderStats &stats) {
+    _node_stack.clear();
+    NodeVisit visit = { 0, game::sys::Frustum::ALL_PLANES };
+
+    for(;;) {
+        if(visit.index >= 0) {
+            // Nodes with nothing visible from our cluster below them, or
+            // outside the frustum, are skipped with their whole subtree
+            const RenderNode &node = _render_nodes[visit.index];
+            stats.nodes_visited++;
+            if(node.first_leaf <= node.last_leaf &&
+               game::sys::Pvs::any(visible.leaf_bits.data(), node.first_leaf, node.last_leaf) &&
+               (visit.planes == 0 || frustum.contains(node.min, node.max, visit.planes))) {
+                // The side of the splitter plane the camera is on can hide
+                // the other side but not the other way around, so the walk
+                // goes on with it and the other side waits on the stack
+                float distance = node.normal.x * pos.x + node.normal.y * pos.y +
+                                 node.normal.z * pos.z - node.d;
+                int near = distance >= 0 ? node.front : node.back;
+                int far = distance >= 0 ? node.back : node.front;
+                _node_stack.push_back({ far, visit.planes });
+                visit.index = near;
+                continue;
+            }
+            stats.nodes_culled++;
+        } else {
+            // A leaf only needs the planes its nodes weren't all in front of
+            int leaf = -(visit.index + 1);
+            const Bounds &bounds = _leaf_bounds[leaf];
+            if(game::sys::Pvs::test(visible.leaf_bits.data(), leaf) &&
+               (visit.planes == 0 || frustum.contains(bounds.min, bounds.max, visit.planes))) {
+                _culled_leafs.push_back(leaf);
+            }
+        }
+
+        if(_node_stack.empty()) break;
+        visit = _node_stack.back();
+        _node_stack.pop_back();
+    }
+}
+
+void Quake3Bsp::occlude_leafs(const glm::vec3 &pos, RenderStats &stats) {
+    auto start = std::chrono::steady_clock::now();
+
+    // The faces of the kept leafs that look the biggest from the camera
+    std::fill(_faces_drawn.begin(), _faces_drawn.end(), 0);
+    _occluder_scores.clear();
+    for(int leaf_index : _culled_leafs) {
+        const BSPLeaf &leaf = _leafs[leaf_index];
+        for(int k = 0; k < leaf.leaf_faces_num; k++) {
+            int face_index = _leaf_faces[leaf.leafface + k];
+            if(_faces_drawn[face_index] || _face_areas[face_index] <= 0.0f) continue;
+            _faces_drawn[face_index] = true;
+
+            glm::vec3 centre(_face_boxes.min_x[face_index] + _face_boxes.max_x[face_index],
+                             _face_boxes.min_y[face_index] + _face_boxes.max_y[face_index],
+                             _face_boxes.min_z[face_index] + _face_boxes.max_z[face_index]);
+            glm::vec3 offset = centre * 0.5f - pos;
+            float size = _face_areas[face_index] / std::max(glm::dot(offset, offset), 1.0f);
+            if(size >= _occluder_min_size) _occluder_scores.push_back({ size, face_index });
+        }
+    }
+    size_t occluders = std::min(_occluder_scores.size(), _occluder_max_faces);
+    std::partial_sort(_occluder_scores.begin(), _occluder_scores.begin() + occluders,
+                      _occluder_scores.end(), std::greater<std::pair<float, int>>());
+
+    _occlusion.clear(_view_projection);
+    for(size_t i = 0; i < occluders; i++) {
+        const BSPFace &face = _faces[_occluder_scores[i].second];
+        for(int k = 0; k + 2 < face.indices_num; k += 3) {
+            const int *indices = &_indices[face.start_index + k];
+            _occlusion.add_triangle(_verts[indices[0] + face.start_vert_index].position,
+                                    _verts[indices[1] + face.start_vert_index].position,
+                                    _verts[indices[2] + face.start_vert_index].position);
+        }
+    }
+    _occlusion.rasterize(_pool);
+
+    // The leafs keep their order, nearest first when walking the nodes
+    size_t kept = 0;
+    if(occluders > 0) {
+        for(int leaf_index : _culled_leafs) {
+            const Bounds &bounds = _leaf_bounds[leaf_index];
+            if(_occlusion.visible(bounds.min, bounds.max)) _culled_leafs[kept++] = leaf_index;
+        }
+    } else {
+        kept = _culled_leafs.size();
+    }
+    stats.occluders = int(occluders);
+    stats.leafs_occluded = int(_culled_leafs.size() - kept);
+    _culled_leafs.resize(kept);
+
+    std::chrono::duration<double, std::milli> time = std::chrono::steady_clock::now() - start;
+    stats.occlusion_ms = float(time.count());
+}
+
+void Quake3Bsp::cull_faces(const ClusterFaces &visible, const glm::vec3 &pos,
+                           const game::sys::Frustum &frustum, RenderStats &stats) {
+    // The leafs inside the frustum, nearest first when walking the nodes
+    _culled_leafs.clear();
+    if(_walk_nodes && !_nodes.empty()) {
+        descend_nodes(visible, pos, frustum, stats);
+    } else {
+        _box_inside.resize(visible.leafs.size());
+        frustum.test(visible.leaf_boxes, _box_inside.data());
+        for(size_t i = 0; i < visible.leafs.size(); i++) {
+            if(_box_inside[i]) _culled_leafs.push_back(visible.leafs[i]);
+        }
+    }
+    stats.leafs_culled = visible.leafs.size() - _culled_leafs.size();
+    if(_occlusion_cull) occlude_leafs(pos, stats);
+    stats.leafs_kept = _culled_leafs.size();
+
+    // The faces of the kept leafs, each one once, in the order of the leafs
+    std::fill(_faces_drawn.begin(), _faces_drawn.end(), 0);
+    _culled_faces.clear();
+    for(int leaf_index : _culled_leafs) {
+        const BSPLeaf &leaf = _leafs[leaf_index];
+        int faceCount = leaf.leaf_faces_num;
+        while(faceCount--) {
+            int faceIndex = _leaf_faces[leaf.leafface + faceCount];
+            if(!_faces_drawn[faceIndex]) {
+                _faces_drawn[faceIndex] = true;
+                _culled_faces.push_back(faceIndex);
+            }
+        }
+    }
+    if(!_cull_faces) return;
+
+    // Big leafs often stick out of the frustum with most of their faces
+    _candidate_boxes.clear();
+    for(int face_index : _culled_faces) _candidate_boxes.push_back(_face_boxes, face_index);
+    _box_inside.resize(_culled_faces.size());
+    frustum.test(_candidate_boxes, _box_inside.data());
+
+    size_t kept = 0;
+    for(size_t i = 0; i < _culled_faces.size(); i++) {
+        if(_box_inside[i]) _culled_faces[kept++] = _culled_faces[i];
+    }
+    stats.faces_culled = _culled_faces.size() - kept;
+    _culled_faces.resize(kept);
+}
+
+void Quake3Bsp::prepare_frame(const glm::vec3 &pos, const game::sys::Frustum *frustum) {
+    // Grab the leaf index that our camera is in
+    int leafIndex = find_leaf(pos);
+
+    // Grab the cluster that is assigned to the leaf
+    int cluster = _leafs[leafIndex].cluster;
+
+    // and its area, which only matters while a closed portal splits the areas
+    int area = _area_portals.is_split() ? _leafs[leafIndex].area : -1;
+
+    // Inside the same cluster and area and looking the same way the faces
+    // are the same, and the batches too unless a patch changed its level since
+    size_t lod_switches = _patch_lod->stats().switches;
+    bool is_culled = frustum != nullptr;
+    if(_is_frame_built && _visibility_cache_size > 0 && cluster == _frame_cluster &&
+       area == _frame_area &&
+       lod_switches == _frame_lod_switches && is_culled == _is_frame_culled &&
+       (!is_culled || *frustum == _frame_frustum)) {
+        _stats.leafs_tested = 0;
+        return;
+    }
+
+    size_t misses = _visibility_misses;
+    const ClusterFaces &visible = cluster_faces(cluster, area);
+    RenderStats culling = {};
+    if(is_culled) {
+        cull_faces(visible, pos, *frustum, culling);
+        _visible_faces = &_culled_faces;
+        _visible_leafs = &_culled_leafs;
+    } else {
+        culling.leafs_kept = visible.leafs.size();
+        _visible_faces = &visible.faces;
+        _visible_leafs = &visible.leafs;
+    }
+    _is_front_to_back = is_culled && _walk_nodes && !_nodes.empty();
+    build_batches();
+    _stats.leafs_tested = _visibility_misses != misses ? _leafs_num : 0;
+    _stats.leafs_kept = culling.leafs_kept;
+    _stats.leafs_culled = culling.leafs_culled;
+    _stats.faces_culled = culling.faces_culled;
+    _stats.nodes_visited = culling.nodes_visited;
+    _stats.nodes_culled = culling.nodes_culled;
+    _stats.leafs_area_culled = visible.area_culled;
+    _stats.occluders = culling.occluders;
+    _stats.leafs_occluded = culling.leafs_occluded;
+    _stats.occlusion_ms = culling.occlusion_ms;
+
+    _is_frame_built = true;
+    _frame_cluster = cluster;
+    _frame_area = area;
+    _frame_lod_switches = lod_switches;
+    _is_frame_culled = is_culled;
+    if(is_culled) _frame_frustum = *frustum;
+}
+
+void Quake3Bsp::build_frame(const glm::vec3 &pos) {
+    prepare_frame(pos, nullptr);
+}
+
+void Quake3Bsp::build_frame(const glm::vec3 &pos, const game::sys::Frustum &frustum) {
+    prepare_frame(pos, &frustum);
+}
+
+void Quake3Bsp::build_batches() {
+    _stats = {};
+    _batches.clear();
+    _range_counts.clear();
+    _range_offsets.clear();
+    _patch_verts.clear();
+    _patch_indices.clear();
+
+    // Sorting by material puts the faces of a batch next to each other,
+    // and by face index within a material the faces whose index ranges
+    // follow each other in the index buffer
+    _sort_keys.clear();
+    const std::vector<int> &visible_faces = *_visible_faces;
+    for(size_t i = 0; i < visible_faces.size(); i++) _face_order[visible_faces[i]] = i;
+    for(int face_index : visible_faces) {
+        const BSPFace &face = _faces[face_index];
+        if(face.indices_num <= 0) continue;
+
+        uint64_t key = uint64_t(uint32_t(face_index));
+        int patch = _face_patches[face_index];
+        if(patch >= 0 && _patch_lod->geometry(patch) != nullptr) key |= SORT_PATCH_BIT;
+        key |= uint64_t(face.texture_id & 0x7fff) << SORT_TEXTURE_SHIFT;
+        int atlas = face.lightmap_id >= 0 && face.lightmap_id < _lightmaps_num ?
+                    lightmap_slot(face.lightmap_id).atlas : -1;
+        key |= uint64_t((atlas + 1) & 0xffff) << SORT_ATLAS_SHIFT;
+        _sort_keys.push_back(key);
+    }
+    std::sort(_sort_keys.begin(), _sort_keys.end());
+
+    uint64_t material = ~0ull;
+    for(uint64_t key : _sort_keys) {
+        int face_index = int(key & SORT_FACE_MASK);
+        const BSPFace &face = _faces[face_index];
+
+        // Patches with LOD geometry are appended to the patch array, where
+        // the patches of a material follow each other like world faces
+        bool is_patch = (key & SORT_PATCH_BIT) != 0;
+        size_t offset = 0;
+        int indices_num = face.indices_num;
+        if(is_patch) {
+            const auto *geometry = _patch_lod->geometry(_face_patches[face_index]);
+            uint32_t first_vert = _patch_verts.size();
+            offset = _patch_indices.size() * sizeof(uint32_t);
+            indices_num = geometry->indices.size();
+            _patch_verts.insert(_patch_verts.end(), geometry->verts.begin(), geometry->verts.end());
+            for(int index : geometry->indices) _patch_indices.push_back(first_vert + index);
+        } else {
+            offset = _face_first_index[face_index] * sizeof(uint32_t);
+        }
+
+        // The patch bit is part of the material, the batch draws from one array
+        if(key >> SORT_ATLAS_SHIFT != material) {
+            material = key >> SORT_ATLAS_SHIFT;
+            _batches.push_back({ face.texture_id, face.lightmap_id, is_patch, _range_counts.size(), 0,
+                                 _face_order[face_index] });
+        }
+
+        // A face starting where the previous range ends extends it
+        DrawBatch &batch = _batches.back();
+        batch.order = std::min(batch.order, _face_order[face_index]);
+        if(batch.ranges_num > 0) {
+            size_t last = batch.first_range + batch.ranges_num - 1;
+            size_t end = reinterpret_cast<size_t>(_range_offsets[last]) +
+                         _range_counts[last] * sizeof(uint32_t);
+            if(end == offset) {
+                _range_counts[last] += indices_num;
+                _stats.triangles += indices_num / 3;
+                continue;
+            }
+        }
+        _range_counts.push_back(indices_num);
+        _range_offsets.push_back(reinterpret_cast<const void *>(offset));
+        batch.ranges_num++;
+        _stats.triangles += indices_num / 3;
+    }
+
+    // Drawing the batches with the nearest faces first lets the depth test
+    // reject more of the pixels behind them. Each batch keeps its ranges,
+    // so a batch is only as near as its nearest face.
+    if(_is_front_to_back) {
+        std::stable_sort(_batches.begin(), _batches.end(), [](const DrawBatch &a, const DrawBatch &b) {
+            return a.order < b.order;
+        });
+    }
+
+    // What submitting will take, the texture binds are counted again
+    // there since different textures may share a placeholder
+    _stats.faces = _visible_faces->size();
+    _stats.batches = _batches.size();
+    _stats.ranges = _range_counts.size();
+    _stats.draw_calls = _batches.size();
+    int texture_id = -1, atlas = -2;
+    for(const auto &batch : _batches) {
+        int batch_atlas = batch.lightmap_id >= 0 && batch.lightmap_id < _lightmaps_num ?
+                          lightmap_slot(batch.lightmap_id).atlas : -1;
+        if(g_bTextures && batch.texture_id != texture_id) _stats.texture_binds++;
+        if(g_bLightmaps && batch_atlas != atlas) _stats.texture_binds++;
+        texture_id = batch.texture_id;
+        atlas = batch_atlas;
+    }
+}
+
+bool Quake3Bsp::upload_patches() {
+    if(_patch_indices.empty()) return true;
+    if(_patch_array == 0) return false;
+
+    size_t verts_size = _patch_verts.size() * sizeof(BSPVertex);
+    size_t indices_size = _patch_indices.size() * sizeof(uint32_t);
+    auto verts = _patch_stream.allocate(verts_size);
+    auto indices = _patch_stream.allocate(indices_size);
+    if(verts.data == nullptr || indices.data == nullptr) {
+        // A new stream with sections big enough, the old one is only
+        // released by OpenGL once the GPU is done with it
+        size_t section_size = std::max(_patch_stream.section_size(), size_t(PATCH_STREAM_SECTION_SIZE));
+        while(section_size < verts_size + indices_size + 32) section_size *= 2;
+        _logger->debug("Growing the patch stream to sections of {} bytes", section_size);
+        if(!_patch_stream.init(section_size)) return false;
+        _patch_stream.begin_frame();
+        verts = _patch_stream.allocate(verts_size);
+        indices = _patch_stream.allocate(indices_size);
+        if(verts.data == nullptr || indices.data == nullptr) return false;
+    }
+    memcpy(verts.data, _patch_verts.data(), verts_size);
+    memcpy(indices.data, _patch_indices.data(), indices_size);
+    _patch_stream.commit(verts);
+    _patch_stream.commit(indices);
+
+    // The vertices move with the section, the indices stay relative to them
+    glBindVertexArray(_patch_array);
+    glBindBuffer(GL_ARRAY_BUFFER, verts.buffer);
+    vertex_layout(verts.offset);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices.buffer);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    _patch_index_offset = indices.offset;
+    return true;
+}
+
+uint32_t Quake3Bsp::batch_array(const DrawBatch &batch) {
+    return batch.is_patch ? _patch_array : _world_array.array;
+}
+
+bool Quake3Bsp::create_world_program() {
+    if(_world_program != 0) return true;
+
+    uint32_t program = game::sys::GLSL::load_shaders(game::Config::project_name() + ".vert",
+                                                     game::Config::project_name() + ".frag");
+    if(program == 0) return false;
+    GLint is_linked = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &is_linked);
+    if(is_linked != GL_TRUE) {
+        glDeleteProgram(program);
+        return false;
+    }
+
+    // The samplers never change, the texture on the first unit and the
+    // lightmap on the second like the legacy backend
+    _world_program = program;
+    _mvp_location = glGetUniformLocation(program, "MVP");
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "texture_sampler"), 0);
+    glUniform1i(glGetUniformLocation(program, "lightmap_sampler"), 1);
+    glUseProgram(0);
+    return true;
+}
+
+void Quake3Bsp::delete_world_program() {
+    if(_world_program != 0) glDeleteProgram(_world_program);
+    _world_program = 0;
+    _mvp_location = -1;
+}
+
+void Quake3Bsp::submit_batches() {
+    auto start = std::chrono::steady_clock::now();
+
+    // Anything may have been bound on the texture units since the last frame
+    uint32_t bound_texture = 0;
+    _bound_lightmap = 0;
+    _bound_array = 0;
+    _stats.texture_binds = 0;
+
+    // Everything the batches draw is in place before the first of them
+    _patch_stream.begin_frame();
+    bool has_patches = upload_patches();
+
+    // The shader samples both units itself, so it binds the placeholder
+    // for what is switched off
+    bool is_glsl = _render_backend == RenderBackend::Glsl;
+    if(is_glsl) {
+        glUseProgram(_world_program);
+        glUniformMatrix4fv(_mvp_location, 1, GL_FALSE, &_view_projection[0][0]);
+    } else {
+        // Texture mapping on the first unit, the lightmap over it on the second
+        if(g_bTextures) {
+            glActiveTextureARB(GL_TEXTURE0_ARB);
+            glEnable(GL_TEXTURE_2D);
+        }
+        if(g_bLightmaps) {
+            glActiveTextureARB(GL_TEXTURE1_ARB);
+            glEnable(GL_TEXTURE_2D);
+        }
+    }
+
+    for(const auto &batch : _batches) {
+        if(batch.is_patch && !has_patches) continue;
+
+        // The vertex arrays hold all the client state, so switching between
+        // them is the only setup a batch needs
+        uint32_t vertex_array = batch_array(batch);
+        if(vertex_array != _bound_array) {
+            glBindVertexArray(vertex_array);
+            _bound_array = vertex_array;
+        }
+
+        if(g_bTextures || is_glsl) {
+            uint32_t texture = g_bTextures ? _textures_list[batch.texture_id] : _streamer.placeholder();
+            if(texture != bound_texture) {
+                glActiveTextureARB(GL_TEXTURE0_ARB);
+                glBindTexture(GL_TEXTURE_2D, texture);
+                bound_texture = texture;
+                _stats.texture_binds++;
+            }
+        }
+
+        // Faces without a lightmap get the white placeholder, which leaves
+        // their texture as it is
+        if(g_bLightmaps || is_glsl) {
+            bool has_lightmap = batch.lightmap_id >= 0 && batch.lightmap_id < _lightmaps_num;
+            uint32_t lightmap = g_bLightmaps && has_lightmap ? _lightmaps_list[batch.lightmap_id]
+                                                             : _streamer.placeholder();
+            if(lightmap != _bound_lightmap) {
+                glActiveTextureARB(GL_TEXTURE1_ARB);
+                glBindTexture(GL_TEXTURE_2D, lightmap);
+                _bound_lightmap = lightmap;
+                _stats.texture_binds++;
+            }
+        }
+
+        // Patch ranges are offsets into the frame's indices
+        const void *const *offsets = &_range_offsets[batch.first_range];
+        if(batch.is_patch) {
+            _patch_offsets.resize(batch.ranges_num);
+            for(size_t i = 0; i < batch.ranges_num; i++) {
+                _patch_offsets[i] = static_cast<const uint8_t *>(offsets[i]) + _patch_index_offset;
+            }
+            offsets = _patch_offsets.data();
+        }
+
+        if(batch.ranges_num == 1) {
+            glDrawElements(GL_TRIANGLES, _range_counts[batch.first_range], GL_UNSIGNED_INT, offsets[0]);
+        } else {
+            glMultiDrawElements(GL_TRIANGLES, &_range_counts[batch.first_range], GL_UNSIGNED_INT,
+                                offsets, batch.ranges_num);
+        }
+    }
+
+    glBindVertexArray(0);
+    _bound_array = 0;
+    if(is_glsl) glUseProgram(0);
+
+    // The section is written again once the GPU passed the draws above
+    _patch_stream.end_frame();
+
+    std::chrono::duration<float, std::milli> submit_time = std::chrono::steady_clock::now() - start;
+    _stats.submit_ms = submit_time.count();
+}
+
+void Quake3Bsp::render(const glm::vec3 &pos) {
+    build_frame(pos);
+    submit_batches();
+}
+
+void Quake3Bsp::render(const glm::vec3 &pos, const game::sys::Frustum &frustum) {
+    build_frame(pos, frustum);
+    submit_batches();
+}
@@ -0,0 +1,235 @@
+#include <SDL_image.h>
+#include <algorithm>
+#include <limits>
+
+#include <GL/glew.h>
+#ifdef __APPLE__
+#include <OpenGL/gl.h>
+#else
+#include <GL/gl.h>
+#endif
+
+#include <game/config.h>
+#include <game/sys/texture_streamer.h>
+
+using namespace game;
+using namespace game::sys;
+
+static bool is_power_of_two(int value) {
+    return value > 0 && (value & (value - 1)) == 0;
+}
+
+// Halves the image with a 2x2 box filter, the same way glGenerateMipmap
+// builds the levels of power of two images
+static void halve_image(const uint8_t *src, int width, int height, int channels,
+                        std::vector<uint8_t> &dst) {
+    int dst_width = std::max(1, width / 2);
+    int dst_height = std::max(1, height / 2);
+    dst.resize(dst_width * dst_height * channels);
+
+    for(int y = 0; y < dst_height; y++) {
+        const uint8_t *row0 = src + (2 * y) * width * channels;
+        const uint8_t *row1 = src + std::min(2 * y + 1, height - 1) * width * channels;
+        for(int x = 0; x < dst_width; x++) {
+            int x0 = (2 * x) * channels;
+            int x1 = std::min(2 * x + 1, width - 1) * channels;
+            for(int c = 0; c < channels; c++) {
+                int sum = row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c];
+                dst[(y * dst_width + x) * channels + c] = static_cast<uint8_t>((sum + 2) / 4);
+            }
+        }
+    }
+}
+
+TextureStreamer::TextureStreamer() : _is_cancelled(false) {
+    _logger = spdlog::get("bsp");
+    if(_logger == nullptr)
+        _logger = spdlog::stdout_color_mt("bsp");
+    _pool = &ThreadPool::global();
+}
+
+TextureStreamer::~TextureStreamer() {
+    clear();
+}
+
+bool TextureStreamer::decode(const std::string &path, Image &image) {
+    std::unique_ptr<SDL_Surface, decltype(&SDL_FreeSurface)> img =
+        decltype(img)(IMG_Load(path.c_str()), SDL_FreeSurface);
+    if(!img) return false;
+
+    // Convert to plain RGB(A) bytes so the upload doesn't depend on the
+    // layout the image was stored with
+    image.channels = img->format->BytesPerPixel == 4 ? 4 : 3;
+    uint32_t format = image.channels == 4 ? SDL_PIXELFORMAT_RGBA32 : SDL_PIXELFORMAT_RGB24;
+    if(img->format->format != format) {
+        decltype(img) converted(SDL_ConvertSurfaceFormat(img.get(), format, 0), SDL_FreeSurface);
+        if(!converted) return false;
+        img = std::move(converted);
+    }
+
+    image.width = img->w;
+    image.height = img->h;
+    image.levels.assign(1, std::vector<uint8_t>());
+
+    // Surface rows may be padded, the levels are not
+    size_t row_size = image.width * image.channels;
+    auto &base = image.levels[0];
+    base.resize(row_size * image.height);
+    const auto *pixels = static_cast<const uint8_t*>(img->pixels);
+    for(int y = 0; y < image.height; y++) {
+        std::copy(pixels + y * img->pitch, pixels + y * img->pitch + row_size,
+                  base.begin() + y * row_size);
+    }
+
+    // NPOT images get their mipmaps from glGenerateMipmap at upload instead
+    if(!is_power_of_two(image.width) || !is_power_of_two(image.height)) return true;
+
+    int width = image.width, height = image.height;
+    while(width > 1 || height > 1) {
+        std::vector<uint8_t> level;
+        halve_image(image.levels.back().data(), width, height, image.channels, level);
+        image.levels.emplace_back(std::move(level));
+        width = std::max(1, width / 2);
+        height = std::max(1, height / 2);
+    }
+    return true;
+}
+
+void TextureStreamer::decode_job(size_t slot, const std::string &path) {
+    if(_is_cancelled) return;
+
+    Decoded decoded = { slot, false, Image() };
+    decoded.is_loaded = decode(path, decoded.image);
+    if(!decoded.is_loaded) {
+        _logger->error("Failed to load image {}, SDL_error: {}", path, IMG_GetError());
+        decoded.image = Image();
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _decoded.emplace_back(std::move(decoded));
+}
+
+bool TextureStreamer::init() {
+    if(_placeholder != 0) return true;
+
+    // A white texel leaves the lightmap alone, like an unbound texture
+    const uint8_t white[3] = { 255, 255, 255 };
+    glGenTextures(1, &_placeholder);
+    if(_placeholder == 0) {
+        _logger->error("Failed to create the placeholder texture");
+        return false;
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glBindTexture(GL_TEXTURE_2D, _placeholder);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, 1, 1, 0, GL_RGB, GL_UNSIGNED_BYTE, white);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    return true;
+}
+
+void TextureStreamer::request(const std::string &path, uint32_t *target) {
+    if(_targets.empty()) _start = std::chrono::steady_clock::now();
+
+    size_t slot = _targets.size();
+    _targets.push_back(target);
+    *target = _placeholder;
+
+    if(_pool == nullptr) {
+        decode_job(slot, path);
+        return;
+    }
+    _jobs.emplace_back(_pool->submit([this, slot, path] { decode_job(slot, path); }));
+}
+
+uint32_t TextureStreamer::upload(const Image &image) {
+    uint32_t texture = 0;
+    glGenTextures(1, &texture);
+
+    // This sets the alignment requirements for the start of each pixel row in memory.
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glBindTexture(GL_TEXTURE_2D, texture);
+
+    // Sized formats, the core profile doesn't take a channel count
+    int texture_type = image.channels == 4 ? GL_RGBA : GL_RGB;
+    int internal_format = image.channels == 4 ? GL_RGBA8 : GL_RGB8;
+    if(image.levels.size() > 1 || (image.width == 1 && image.height == 1)) {
+        // The mipmaps were built while decoding
+        int width = image.width, height = image.height;
+        for(size_t level = 0; level < image.levels.size(); level++) {
+            glTexImage2D(GL_TEXTURE_2D, level, internal_format, width, height, 0,
+                         texture_type, GL_UNSIGNED_BYTE, image.levels[level].data());
+            width = std::max(1, width / 2);
+            height = std::max(1, height / 2);
+        }
+    } else {
+        glTexImage2D(GL_TEXTURE_2D, 0, internal_format, image.width, image.height, 0,
+                     texture_type, GL_UNSIGNED_BYTE, image.levels[0].data());
+        glGenerateMipmap(GL_TEXTURE_2D);
+    }
+
+    //Assign the mip map levels and texture info
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
+    if(!_is_core_profile) glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+    return texture;
+}
+
+size_t TextureStreamer::update(double budget_ms) {
+    if(pending() == 0) return 0;
+
+    auto start = std::chrono::steady_clock::now();
+    size_t uploaded = 0;
+    for(;;) {
+        Decoded decoded;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if(_decoded.empty()) break;
+            decoded = std::move(_decoded.front());
+            _decoded.pop_front();
+        }
+
+        _finished++;
+        if(decoded.is_loaded) {
+            uint32_t texture = upload(decoded.image);
+            _textures.push_back(texture);
+            *_targets[decoded.slot] = texture;
+            uploaded++;
+        } else {
+            _failed++;
+        }
+
+        std::chrono::duration<double, std::milli> spent = std::chrono::steady_clock::now() - start;
+        if(spent.count() >= budget_ms) break;
+    }
+
+    if(pending() == 0) {
+        _jobs.clear();
+        std::chrono::duration<double, std::milli> total = std::chrono::steady_clock::now() - _start;
+        _logger->info("Streamed {} textures in {:.2f} ms, {} failed",
+                      _targets.size() - _failed, total.count(), _failed);
+    }
+    return uploaded;
+}
+
+void TextureStreamer::finish() {
+    if(_pool != nullptr) _pool->wait(_jobs);
+    _jobs.clear();
+    update(std::numeric_limits<double>::infinity());
+}
+
+void TextureStreamer::clear() {
+    _is_cancelled = true;
+    if(_pool != nullptr) _pool->wait(_jobs);
+    _jobs.clear();
+    _is_cancelled = false;
+
+    _decoded.clear();
+    _targets.clear();
+    _finished = 0;
+    _failed = 0;
+
+    if(!_textures.empty()) glDeleteTextures(_textures.size(), _textures.data());
+    _textures.clear();
+
+    if(_placeholder != 0) glDeleteTextures(1, &_placeholder);
+    _placeholder = 0;
+}
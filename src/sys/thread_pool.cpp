@@ -0,0 +1,153 @@
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+
+#include <game/config.h>
+#include <game/sys/thread_pool.h>
+
+using namespace game;
+using namespace game::sys;
+
+ThreadPool::ThreadPool(size_t threads) {
+    if(threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    _workers.reserve(threads);
+    for(size_t i = 0; i < threads; i++) {
+        _workers.emplace_back(&ThreadPool::worker, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _is_stopping = true;
+    }
+    _cv.notify_all();
+    for(auto &thread : _workers) thread.join();
+}
+
+void ThreadPool::worker() {
+    for(;;) {
+        std::packaged_task<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cv.wait(lock, [this] { return _is_stopping || !_tasks.empty(); });
+            if(_tasks.empty()) return;
+            task = std::move(_tasks.front());
+            _tasks.pop_front();
+        }
+        task();
+    }
+}
+
+bool ThreadPool::run_pending() {
+    std::packaged_task<void()> task;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(_tasks.empty()) return false;
+        task = std::move(_tasks.front());
+        _tasks.pop_front();
+    }
+    task();
+    return true;
+}
+
+std::future<void> ThreadPool::submit(std::function<void()> task) {
+    std::packaged_task<void()> packaged(std::move(task));
+    auto future = packaged.get_future();
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _tasks.emplace_back(std::move(packaged));
+    }
+    _cv.notify_one();
+    return future;
+}
+
+void ThreadPool::wait(std::future<void> &future) {
+    while(future.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        if(!run_pending()) future.wait_for(std::chrono::microseconds(100));
+    }
+    // Rethrows the exception of a failed task
+    future.get();
+}
+
+void ThreadPool::wait(std::vector<std::future<void>> &futures) {
+    // Every task has to finish before rethrowing, they may refer to the
+    // caller's stack
+    std::exception_ptr error;
+    for(auto &future : futures) {
+        try {
+            wait(future);
+        } catch(...) {
+            if(!error) error = std::current_exception();
+        }
+    }
+    if(error) std::rethrow_exception(error);
+}
+
+// The chunks of one parallel_for. The caller and the tasks it queued take
+// the next chunk from the counter until none is left, so a task that only
+// runs after the caller took every chunk does nothing and never touches
+// fn. The state is shared with those late tasks, which may outlive the call.
+struct ThreadPool::ForState {
+    std::atomic<size_t> next{0};
+    size_t begin, end, chunk_size, chunks;
+    const std::function<void(size_t, size_t)> *fn;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t done = 0;
+    std::exception_ptr error;
+
+    void run() {
+        for(;;) {
+            size_t chunk = next.fetch_add(1);
+            if(chunk >= chunks) return;
+            size_t chunk_begin = begin + chunk * chunk_size;
+            std::exception_ptr chunk_error;
+            try {
+                (*fn)(chunk_begin, std::min(chunk_begin + chunk_size, end));
+            } catch(...) {
+                chunk_error = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if(chunk_error && !error) error = chunk_error;
+            if(++done == chunks) cv.notify_all();
+        }
+    }
+};
+
+void ThreadPool::parallel_for(size_t begin, size_t end, size_t grain,
+                              const std::function<void(size_t, size_t)> &fn) {
+    if(begin >= end) return;
+    size_t count = end - begin;
+    grain = std::max<size_t>(grain, 1);
+
+    size_t chunks = std::min((count + grain - 1) / grain, size() + 1);
+    if(chunks <= 1) {
+        fn(begin, end);
+        return;
+    }
+
+    auto state = std::make_shared<ForState>();
+    state->begin = begin;
+    state->end = end;
+    state->chunk_size = (count + chunks - 1) / chunks;
+    state->chunks = (count + state->chunk_size - 1) / state->chunk_size;
+    state->fn = &fn;
+    for(size_t i = 1; i < state->chunks; i++) submit([state] { state->run(); });
+
+    // The calling thread works through the chunks too, and then only waits
+    // for the ones already taken. It never runs other queued tasks, which
+    // may be long, like texture decoding, and this may be the render thread.
+    state->run();
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->cv.wait(lock, [&state] { return state->done == state->chunks; });
+    if(state->error) std::rethrow_exception(state->error);
+}
+
+ThreadPool &ThreadPool::global() {
+    static ThreadPool pool(Config::worker_threads());
+    return pool;
+}